@@ -0,0 +1,37 @@
+#ifndef MEDIA_PROCESSOR_AUTO_FORMAT_H
+#define MEDIA_PROCESSOR_AUTO_FORMAT_H
+
+#include "converter.h"
+
+// Longest side of the proxy image used for trial encodes
+#define AUTO_PROXY_MAX_SIDE 256
+
+// What the content analysis found out about an image
+typedef struct {
+    bool has_alpha;         // Any pixel not fully opaque
+    size_t colors;          // Distinct RGBA colors, counted up to 257
+    double flat_ratio;      // Share of neighboring pixels that are identical
+    double edge_density;    // Share of neighboring pixels with a hard edge between them
+    bool graphic;           // Drawing/screenshot rather than a photo
+} ImageContentStats;
+
+typedef struct {
+    ImageFormat format;
+    ConversionOptions options;  // Settings to encode img with in that format
+    ImageContentStats content;
+    size_t proxy_size;          // Encoded size of the proxy in the chosen format
+} AutoFormatChoice;
+
+void analyze_image_content(const ImageData* img, ImageContentStats* stats);
+
+// Picks a lossless format for graphics and a lossy one for photos, whichever
+// candidate encodes a downscaled proxy of img smallest. Photo candidates are
+// compared at the quality reaching the SSIM JPEG has at base's quality (or
+// base's SSIM target), which is the quality then set in choice->options.
+// Formats whose module is missing are skipped, down to PNG or JPEG; false if
+// no candidate encodes. For animated inputs (img is the first frame) only
+// formats holding animations are considered, without a fallback.
+bool choose_auto_format(const ImageData* img, bool animated, const ConversionOptions* base,
+                        AutoFormatChoice* choice);
+
+#endif // MEDIA_PROCESSOR_AUTO_FORMAT_H
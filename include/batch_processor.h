@@ -2,6 +2,7 @@
 #define BATCH_PROCESSOR_H
 
 #include "converter.h"
+#include "io_backend.h"
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -11,18 +12,21 @@
 
 typedef struct {
     char* input_dir;
-    ImageFormat target_format;
+    ImageFormat target_formats[MAX_TARGET_FORMATS];  // Every file is converted to each
+    size_t target_count;
+    bool auto_format;        // Pick format and settings per file (target_formats unused)
     ConversionOptions options;
-    bool replace_originals;
+    bool replace_originals;  // Needs a single target format
+    bool verify;             // Decode each output and compare before publishing it
     char* extension_filter;  // Optional: only process files with this extension
+    int threads;             // Files converted in parallel (0 = all cores)
+    IoBackend io_backend;    // How source files are read ahead
+    size_t mem_limit;        // Estimated bytes of conversions in flight (0 = cgroup limit or RAM)
 } BatchProcessingOptions;
 
 // Main batch processing function
 int process_directory(const BatchProcessingOptions* options);
 
-// Helper function to get temporary filename
-char* get_temp_filename(const char* original_filename);
-
 // Helper function to check if file is supported image
 bool is_supported_image(const char* filename);
 
@@ -0,0 +1,101 @@
+#ifndef MEDIA_PROCESSOR_CODEC_H
+#define MEDIA_PROCESSOR_CODEC_H
+
+#include "converter.h"
+
+// Every supported format is described by one Codec: how to recognize it,
+// what it can do and the functions doing it. Conversions, the batch
+// scheduler and the CLI look formats up here instead of switching over
+// ImageFormat, so a capability is added in one place.
+
+// What a codec can do, beyond plain decoding and encoding
+typedef enum {
+    CODEC_CAP_DECODE_SCALED   = 1 << 0,  // decode_scaled() shrinks while decoding
+    CODEC_CAP_DECODE_CROPPED  = 1 << 1,  // Decodes only options->crop
+    CODEC_CAP_STREAMS_DECODE  = 1 << 2,  // Decodes into spilled images a band of rows at a time
+    CODEC_CAP_STREAMS_ENCODE  = 1 << 3,  // Encodes spilled images a band of rows at a time
+    CODEC_CAP_THREADED_DECODE = 1 << 4,  // Spreads one decode over several cores
+    CODEC_CAP_THREADED_ENCODE = 1 << 5,  // Likewise for encoding
+    CODEC_CAP_ANIMATION       = 1 << 6,  // Holds animations (frame hooks of codec_backend.h)
+    CODEC_CAP_TRANSCODE       = 1 << 7,  // Re-encodes its own files without decoding pixels
+    // Keeps codec objects between images (codec_cache.h). For HEIC that is
+    // only libheif's encoder handle: x265 itself is still opened and torn
+    // down inside every encode.
+    CODEC_CAP_REUSES_CONTEXTS = 1 << 8,
+    CODEC_CAP_LOADABLE        = 1 << 9   // Lives in a module loaded on first use
+} CodecCapability;
+
+typedef struct {
+    ImageFormat format;
+    const char* name;                   // "JPG"; also the output extension
+    const char* const* extensions;      // Recognized file extensions, NULL-terminated
+    unsigned capabilities;              // CodecCapability flags
+    unsigned scale_factors;             // Bit n set if decode_scaled() takes factor n
+
+    // True if the first size bytes of a file are in this format; NULL if
+    // only the extension tells
+    bool (*probe)(const unsigned char* header, size_t size);
+    // Pixel size from the header, without decoding
+    bool (*read_dimensions)(const unsigned char* data, size_t size, size_t* width, size_t* height);
+
+    // Decoders return upright images; crop them unless CODEC_CAP_DECODE_CROPPED
+    ImageData* (*decode)(const char* filepath, const ConversionOptions* options);
+    // From a file already read; name is only used in messages
+    ImageData* (*decode_memory)(const char* name, const unsigned char* data, size_t size,
+                                const ConversionOptions* options);
+    // At 1/factor of the full size, sides rounded up; NULL without CODEC_CAP_DECODE_SCALED
+    ImageData* (*decode_scaled)(const char* filepath, size_t factor, const ConversionOptions* options);
+
+    bool (*encode)(const char* filepath, const ImageData* img, const ConversionOptions* options);
+    // True if encoding with options reproduces the pixels exactly; options
+    // may be NULL for the defaults
+    bool (*is_lossless)(const ConversionOptions* options);
+    // True if options leave a quality setting to tune; false for NULL options
+    bool (*has_quality)(const ConversionOptions* options);
+
+    // Stream hooks, working on files rather than decoded images; NULL
+    // without the matching capability
+    bool (*transcode)(const char* input_path, const char* output_path,
+                      const ConversionOptions* options);
+    bool (*is_animated)(const char* filepath);
+
+    // Limits one decode or encode to threads where options leave it to all
+    // cores; NULL without a CODEC_CAP_THREADED_* capability
+    void (*limit_threads)(ConversionOptions* options, int threads);
+} Codec;
+
+// Codec of format; NULL for FORMAT_UNKNOWN
+const Codec* codec_for_format(ImageFormat format);
+
+// Codec whose extensions include ext (without the dot, any case)
+const Codec* codec_for_extension(const char* ext);
+
+// Codec whose probe accepts the header
+const Codec* codec_probe(const unsigned char* header, size_t size);
+
+// All codecs, for listing them
+size_t codec_count(void);
+const Codec* codec_at(size_t index);
+
+// True if format's codec has every capability in capabilities
+bool codec_has(ImageFormat format, unsigned capabilities);
+
+// Limits every threaded codec to threads per call, for callers that run
+// several conversions at once
+void codec_limit_threads(ConversionOptions* options, int threads);
+
+// Largest factor decode_scaled() takes that divides wanted; 1 if none
+size_t codec_scale_factor(const Codec* codec, size_t wanted);
+
+// Built-in PNG and JPEG codecs, in converter.c
+
+ImageData* load_png_memory(const char* name, const unsigned char* data, size_t size,
+                           const ConversionOptions* options);
+ImageData* load_jpeg_memory(const char* name, const unsigned char* data, size_t size,
+                            const ConversionOptions* options);
+// Decodes through libjpeg's DCT scaling, so most of the work is skipped
+ImageData* load_jpeg_scaled(const char* filepath, size_t factor, const ConversionOptions* options);
+bool read_png_dimensions(const unsigned char* data, size_t size, size_t* width, size_t* height);
+bool read_jpeg_dimensions(const unsigned char* data, size_t size, size_t* width, size_t* height);
+
+#endif // MEDIA_PROCESSOR_CODEC_H
@@ -0,0 +1,108 @@
+#ifndef MEDIA_PROCESSOR_CODEC_BACKEND_H
+#define MEDIA_PROCESSOR_CODEC_BACKEND_H
+
+#include "converter.h"
+
+// WebP, AVIF and HEIC support lives in modules loaded the first time their
+// format is read or written, so a run only maps the libraries it needs: a
+// PNG to JPEG conversion never pays for the AV1 and HEVC stacks behind
+// libavif and libheif. PNG and JPEG are built in.
+//
+// A module exports CODEC_BACKEND_ENTRY, returning its CodecBackend. Modules
+// call back into the executable for image buffers, metadata and threads.
+
+// What each format can do is described by its Codec entry (codec.h), so it
+// is known without loading the module.
+#define CODEC_BACKEND_ABI_VERSION 2
+#define CODEC_BACKEND_ENTRY "media_processor_codec_backend"
+
+typedef struct AnimationDecoder AnimationDecoder;
+typedef struct AnimationEncoder AnimationEncoder;
+
+typedef struct {
+    size_t width;                   // Canvas size
+    size_t height;
+    size_t frame_count;
+    int loop_count;                 // Times played, 0 = forever
+} AnimationInfo;
+
+// One frame on its way from the decoder to the encoder
+typedef struct {
+    size_t index;
+    ImageData* image;               // RGBA; NULL while the frame awaits convert_frame
+    void* pending;                  // Decoded frame in the codec's own layout
+    int duration_ms;                // 0 if the file gives none
+} AnimationFrame;
+
+typedef struct {
+    int abi_version;                // CODEC_BACKEND_ABI_VERSION
+    ImageFormat format;
+    const char* name;
+
+    ImageData* (*load)(const char* filepath, const ConversionOptions* options);
+    // data only has to outlive the call
+    ImageData* (*load_memory)(const char* name, const unsigned char* data, size_t size,
+                              const ConversionOptions* options);
+    // From the container headers, without decoding
+    bool (*read_dimensions)(const unsigned char* data, size_t size, size_t* width, size_t* height);
+    bool (*save)(const char* filepath, const ImageData* img, const ConversionOptions* options);
+
+    // Animations; all NULL for formats without them
+    bool (*is_animated)(const char* filepath);
+    AnimationDecoder* (*open_animation)(const char* filepath, const ConversionOptions* options,
+                                        AnimationInfo* info);
+    // Next frame in order; false once all are read or on error (*failed)
+    bool (*read_frame)(AnimationDecoder* decoder, AnimationFrame* frame, bool* failed);
+    // Turns frame->pending into frame->image; safe to run for several frames
+    // at once. NULL if frames are read as RGBA.
+    bool (*convert_frame)(AnimationFrame* frame);
+    void (*free_pending_frame)(void* pending);
+    void (*close_animation)(AnimationDecoder* decoder);
+
+    AnimationEncoder* (*start_animation)(const ImageData* first, int loop_count,
+                                         const ConversionOptions* options);
+    bool (*add_frame)(AnimationEncoder* encoder, const ImageData* frame, int duration_ms);
+    bool (*finish_animation)(AnimationEncoder* encoder, const char* filepath);
+    void (*close_animation_encoder)(AnimationEncoder* encoder);
+} CodecBackend;
+
+typedef const CodecBackend* (*CodecBackendEntry)(void);
+
+// Defined by each module, under the name CODEC_BACKEND_ENTRY
+const CodecBackend* media_processor_codec_backend(void);
+
+// Where and how a module was loaded
+typedef struct {
+    const char* name;               // Module name, like "heic"
+    bool loaded;
+    char path[4096];                // Module file, or the last one tried
+    double load_ms;                 // dlopen and relocation time
+    char error[256];                // Why it is unavailable
+} CodecModuleInfo;
+
+// The backend for format, loading its module on first use. NULL for PNG,
+// JPEG and unknown formats, and when the module is missing; the latter is
+// reported once per run.
+const CodecBackend* codec_backend(ImageFormat format);
+
+// Loads format's module without reporting failures, and describes it;
+// false if format is built in
+bool codec_module_info(ImageFormat format, CodecModuleInfo* info);
+
+// Core helpers the backends use
+
+// Buffer for a decoder to fill; mapped from a temporary file if too large
+ImageData* create_decoded_image(size_t width, size_t height, const ConversionOptions* options);
+
+// Stores an EXIF blob, dropping the "Exif\0\0" prefix some containers keep
+void set_exif_metadata(ImageData* img, const unsigned char* data, size_t size);
+
+// Rotates a freshly loaded image upright and resets its orientation tag.
+// On failure the unrotated image is returned with its tag untouched.
+ImageData* apply_exif_orientation(ImageData* img, const ConversionOptions* options);
+
+// Narrows a loaded image to options->crop; NULL (img freed) if the region
+// lies outside it
+ImageData* apply_crop(ImageData* img, const ConversionOptions* options);
+
+#endif // MEDIA_PROCESSOR_CODEC_BACKEND_H
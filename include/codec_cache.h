@@ -0,0 +1,54 @@
+#ifndef MEDIA_PROCESSOR_CODEC_CACHE_H
+#define MEDIA_PROCESSOR_CODEC_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CODEC_CONTEXT_KEY_MAX 128
+
+// Codec objects worth keeping between images
+typedef enum {
+    CODEC_CONTEXT_JPEG_DECODER,     // jpeg_decompress_struct
+    CODEC_CONTEXT_JPEG_ENCODER,     // jpeg_compress_struct
+    CODEC_CONTEXT_HEIC_ENCODER,     // heif_encoder (the plugin handle, not x265's)
+    CODEC_CONTEXT_COUNT
+} CodecContextKind;
+
+typedef void (*CodecContextDestroy)(void* object);
+
+// Process-wide counts since startup
+typedef struct {
+    uint64_t created[CODEC_CONTEXT_COUNT];
+    uint64_t reused[CODEC_CONTEXT_COUNT];
+    uint64_t create_ns[CODEC_CONTEXT_COUNT];   // Time spent creating them
+} CodecContextStats;
+
+// Every thread keeps one idle context of each kind, made with the settings
+// named by key. A worker converting many files thus sets up its codecs once;
+// the cache is freed when the thread exits.
+
+// The calling thread's idle context of this kind made with key, or NULL if
+// the caller has to create one
+void* codec_context_take(CodecContextKind kind, const char* key);
+
+// Counts a context the caller had to create, which took ns
+void codec_context_created(CodecContextKind kind, uint64_t ns);
+
+// Returns a context after use. It is kept for the thread's next take() if
+// reusable (back in its initial state), and destroyed otherwise.
+void codec_context_give(CodecContextKind kind, const char* key, void* object, bool reusable,
+                        CodecContextDestroy destroy);
+
+// Destroys the calling thread's idle contexts
+void codec_contexts_release(void);
+
+void codec_context_stats(CodecContextStats* stats);
+
+// Setup time the reuses between two snapshots saved, at the average time
+// creating a context of each kind took; *reused receives their number.
+// Only the creation the cache skips is counted, so for HEIC this is the
+// encoder lookup and not x265's per-image startup.
+double codec_context_saved_ns(const CodecContextStats* start, const CodecContextStats* end,
+                              uint64_t* reused);
+
+#endif // MEDIA_PROCESSOR_CODEC_CACHE_H
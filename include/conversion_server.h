@@ -0,0 +1,36 @@
+#ifndef MEDIA_PROCESSOR_CONVERSION_SERVER_H
+#define MEDIA_PROCESSOR_CONVERSION_SERVER_H
+
+#include "converter.h"
+
+// A long-running process converting images for clients on a Unix socket, so
+// each conversion skips process startup and library loading.
+//
+// Requests and replies are lines of tab-separated fields. A connection may
+// send any number of requests, each answered before the next is read:
+//
+//   CONVERT <target> <input path> <output path> [quality]
+//       Files opened by the server (relative to its working directory); the
+//       output is replaced atomically. Reply: OK
+//   CONVERT-FD <input format> <target> [quality]
+//       Sent with two descriptors (SCM_RIGHTS): the input, open for reading,
+//       and the output, open for writing. Reply: OK
+//   CONVERT-DATA <input format> <target> <size> [quality]
+//       Followed by size bytes of input. Reply: OK <size>, then the output
+//
+// Formats are names like "webp"; quality overrides the server's for one
+// request. Failures are answered with ERROR <message>.
+
+// Serves conversions on socket_path until SIGINT or SIGTERM, converting up
+// to `workers` requests at once (0 = all cores). Every request uses options.
+bool run_conversion_server(const char* socket_path, const ConversionOptions* options,
+                           int workers);
+
+// Converts through the server at socket_path: the files are opened here and
+// handed over, and the output is committed like a local conversion. The
+// target comes from output_path's extension; quality < 0 keeps the server's.
+bool convert_with_server(const char* socket_path, const char* input_path,
+                         const char* output_path, const ConversionOptions* options,
+                         int quality);
+
+#endif // MEDIA_PROCESSOR_CONVERSION_SERVER_H
@@ -14,37 +14,144 @@ typedef enum {
     FORMAT_AVIF
 } ImageFormat;
 
+// Most formats one conversion can fan out to (each format once)
+#define MAX_TARGET_FORMATS 5
+
+// Called when the last image referencing storage it does not own is freed
+typedef void (*ImageReleaseFunc)(void* release_ctx);
+
+// Reference-counted pixel storage shared between an image and its views
+typedef struct ImageStorage ImageStorage;
+
+typedef enum {
+    IMAGE_METADATA_EXIF,           // TIFF header onwards (no "Exif\0\0" prefix)
+    IMAGE_METADATA_ICC,            // ICC color profile
+    IMAGE_METADATA_XMP,            // XMP packet
+    IMAGE_METADATA_COUNT
+} ImageMetadataKind;
+
+// Metadata bytes borrowed from the image's storage (NULL/0 if absent)
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+} ImageBlob;
+
 typedef struct {
-    unsigned char* data;
+    unsigned char* data;           // First pixel of the image (or view)
     size_t width;
     size_t height;
     size_t channels;
-    size_t size;
+    size_t size;                   // Bytes spanned from data to the end of the last row
+    size_t stride;                 // Bytes between the starts of two rows
+    ImageStorage* storage;
+    ImageBlob metadata[IMAGE_METADATA_COUNT];
 } ImageData;
 
+// PNG is lossless, so instead of quality it trades encode time for size
+typedef enum {
+    PNG_EFFORT_FAST,      // SUB filter, zlib RLE strategy, level 1
+    PNG_EFFORT_DEFAULT,   // Adaptive filters, zlib level 6
+    PNG_EFFORT_MAX        // Adaptive filters, level 9, strategy picked by trial
+} PngEffort;
+
+// Content presets for the WebP encoder's filtering/segmentation tuning
+typedef enum {
+    WEBP_CONTENT_DEFAULT,
+    WEBP_CONTENT_PHOTO,     // Outdoor photograph, natural lighting
+    WEBP_CONTENT_PICTURE,   // Indoor photo, portrait
+    WEBP_CONTENT_DRAWING    // Drawing, high-contrast details
+} WebPContentPreset;
+
+// When written files are flushed to disk
+typedef enum {
+    OUTPUT_SYNC_NONE,       // Leave write-back to the kernel
+    OUTPUT_SYNC_FILE,       // fsync each file and its directory entry
+    OUTPUT_SYNC_BATCH       // One syncfs() once a batch is done
+} OutputSyncPolicy;
+
+// Instead of using `quality` as is, search it per image
+typedef enum {
+    QUALITY_TARGET_NONE,
+    QUALITY_TARGET_SIZE,    // Highest quality whose output fits max_bytes
+    QUALITY_TARGET_SSIM     // Lowest quality whose output reaches min_ssim
+} QualityTargetKind;
+
 typedef struct {
     int quality;        // 0-100
-    bool maintain_exif; // whether to preserve EXIF data
+    bool maintain_exif; // whether to preserve EXIF/ICC/XMP metadata
+    bool apply_orientation; // rotate pixels to the EXIF orientation and reset the tag
+    struct {
+        size_t x;
+        size_t y;
+        size_t width;      // 0 = whole image
+        size_t height;
+    } crop;             // Region of the upright image to load (tiled HEICs decode only its tiles)
+    size_t spill_threshold; // Decoded images above this many bytes are kept in a mapped
+                            // temporary file (0 = a quarter of the memory limit, SIZE_MAX = never)
     struct {
         bool progressive;  // For JPEG progressive encoding
         int optimization;  // For JPEG optimization level
+        bool lossless_transcode; // JPEG->JPEG rewrites coefficients instead of re-encoding
     } jpeg_options;
+    struct {
+        int threads;      // Threads for PNG compression (0 = all cores, 1 = libpng only)
+        PngEffort effort; // Compression effort
+        bool reduce_colors; // Write RGB for opaque images and a palette for <= 256 colors
+    } png_options;
     struct {
         bool lossless;    // For WebP lossless mode
         bool exact;       // For WebP exact preservation of RGB values
+        int method;       // Speed/size trade-off: 0 (fastest) - 6 (smallest)
+        bool thread_level; // Use multi-threaded encoding
+        WebPContentPreset preset;
+        int near_lossless; // 0-100, below 100 enables near-lossless preprocessing
+        bool decode_threads;  // Decode with libwebp's worker thread
+        int decode_width;     // Scale while decoding (0 = keep aspect / native)
+        int decode_height;
     } webp_options;
     struct {
         int speed;        // For AVIF encoding speed (0-10)
         bool lossless;    // For AVIF lossless mode
+        int threads;      // Threads libavif may use per image (0 = all cores)
     } avif_options;
+    struct {
+        int decoder_threads;  // Max HEVC decoding threads; grid tiles are decoded on as many (0 = all cores)
+        const char* preset;   // x265 preset, e.g. "ultrafast".."placebo" (NULL = encoder default)
+        const char* tune;     // x265 tune, e.g. "ssim", "psnr", "grain" (NULL = encoder default)
+        const char* chroma;   // "420", "422" or "444" (NULL = encoder default)
+        bool lossless;        // For HEIC lossless mode
+    } heic_options;
+    struct {
+        QualityTargetKind kind;
+        size_t max_bytes;     // Byte budget for QUALITY_TARGET_SIZE
+        double min_ssim;      // SSIM floor (0-1) for QUALITY_TARGET_SSIM
+        int threads;          // Parallel trial encodes (0 = all cores)
+    } quality_target;
+    OutputSyncPolicy sync;  // durability of written files
 } ConversionOptions;
 
-// Format-specific loading functions
-ImageData* load_png(const char* filepath);
-ImageData* load_jpeg(const char* filepath);
-ImageData* load_webp(const char* filepath);
-ImageData* load_avif(const char* filepath);
-ImageData* load_heic(const char* filepath);
+// Format-specific loading functions (options may be NULL for defaults)
+ImageData* load_png(const char* filepath, const ConversionOptions* options);
+ImageData* load_jpeg(const char* filepath, const ConversionOptions* options);
+ImageData* load_webp(const char* filepath, const ConversionOptions* options);
+ImageData* load_avif(const char* filepath, const ConversionOptions* options);
+ImageData* load_heic(const char* filepath, const ConversionOptions* options);
+
+// Loads any supported file, picking the loader by extension
+ImageData* load_image(const char* filepath, const ConversionOptions* options);
+
+// Loads a file known to be in format, whatever its name
+ImageData* load_image_as(const char* filepath, ImageFormat format,
+                         const ConversionOptions* options);
+
+// Decodes an already read file; name is only used in messages
+ImageData* load_image_from_memory(const char* name, ImageFormat format,
+                                  const unsigned char* data, size_t size,
+                                  const ConversionOptions* options);
+
+// Pixel size of an encoded file, read from its header without decoding
+bool read_image_dimensions(ImageFormat format, const unsigned char* data, size_t size,
+                           size_t* width, size_t* height);
 
 // Format-specific saving functions
 bool save_png(const char* filepath, const ImageData* img, const ConversionOptions* options);
@@ -53,20 +160,84 @@ bool save_webp(const char* filepath, const ImageData* img, const ConversionOptio
 bool save_avif(const char* filepath, const ImageData* img, const ConversionOptions* options);
 bool save_heic(const char* filepath, const ImageData* img, const ConversionOptions* options);
 
+// Saves in the given format, searching the quality first if a target is set
+bool save_image(const char* filepath, ImageFormat format, const ImageData* img,
+                const ConversionOptions* options);
+
 // Core functions
 bool convert_image(const char* input_path, 
                   const char* output_path,
                   ImageFormat target_format,
                   const ConversionOptions* options);
 
+// Converts input_path, read as input_format, writing straight to output_path
+// rather than through a temporary file; for outputs that are already open,
+// such as /proc/self/fd/N
+bool convert_image_as(const char* input_path, ImageFormat input_format,
+                      const char* output_path, ImageFormat target_format,
+                      const ConversionOptions* options);
+
+// Converts input_path to every listed format, decoding it only once; the
+// encoders share the decoded image and run on up to `threads` threads
+// (0 = all cores). Outputs are named output_base with each format's
+// extension. True if every output was written.
+bool convert_image_to_formats(const char* input_path, const char* output_base,
+                              const ImageFormat* formats, size_t count,
+                              const ConversionOptions* options, int threads);
+
+// True if input_format to target_format is done by transcode_jpeg()
+bool is_jpeg_transcode(ImageFormat input_format, ImageFormat target_format,
+                       const ConversionOptions* options);
+
+// Rewrites a JPEG's entropy coding (progressive/optimized Huffman tables) and
+// optionally its metadata without decoding pixels; quality is left untouched
+bool transcode_jpeg(const char* input_path, const char* output_path,
+                    const ConversionOptions* options);
+
+// WebP and AVIF can hold animations; single-image targets get the first frame
+bool format_supports_animation(ImageFormat format);
+// True if the WebP or AVIF file has more than one frame
+bool is_animated_image(const char* filepath, ImageFormat format);
+// Converts every frame, keeping durations and the loop count. Frames are
+// decoded, converted to RGBA and encoded on separate threads, with only a
+// few of them in memory at once. Metadata comes from the first frame.
+bool convert_animation(const char* input_path, ImageFormat input_format,
+                       const char* output_path, ImageFormat target_format,
+                       const ConversionOptions* options);
+
 ImageFormat detect_format(const char* filepath);
 
 // Utility functions
 const char* format_to_string(ImageFormat format);
+bool string_to_png_effort(const char* str, PngEffort* effort);
+bool string_to_webp_preset(const char* str, WebPContentPreset* preset);
+bool string_to_sync_policy(const char* str, OutputSyncPolicy* policy);
 ImageFormat string_to_format(const char* str);
-void init_conversion_options(ConversionOptions* options);  // New utility function
+// Parses a comma-separated list such as "avif,webp,jpg"; false on unknown
+// or repeated formats
+bool string_to_format_list(const char* str, ImageFormat* formats, size_t* count);
+// path with its extension (if any) replaced by the format's; free() the result
+char* format_output_path(const char* path, ImageFormat format);
+void init_conversion_options(ConversionOptions* options);
 
 // Memory management
+ImageData* create_image_data(size_t width, size_t height);
+ImageData* wrap_image_data(unsigned char* data, size_t width, size_t height, size_t stride,
+                           ImageReleaseFunc release, void* release_ctx);
+// Zero-copy view of a region of src; shares (and keeps alive) src's storage
+ImageData* create_image_view(const ImageData* src, size_t x, size_t y,
+                             size_t width, size_t height);
+// Copies a metadata blob (NUL-terminated after size) into the image's storage;
+// call before creating views, which share the stored copy
+bool set_image_metadata(ImageData* img, ImageMetadataKind kind, const void* data, size_t size);
+bool copy_image_metadata(ImageData* dst, const ImageData* src);
+bool image_is_borrowed_from(const ImageData* img, ImageReleaseFunc release);
+void* image_release_ctx(const ImageData* img);
 void free_image_data(ImageData* img);
 
+// Pointer to the first RGBA pixel of row y
+static inline unsigned char* image_row(const ImageData* img, size_t y) {
+    return img->data + y * img->stride;
+}
+
 #endif // MEDIA_PROCESSOR_CONVERTER_H
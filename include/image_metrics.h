@@ -0,0 +1,27 @@
+#ifndef MEDIA_PROCESSOR_IMAGE_METRICS_H
+#define MEDIA_PROCESSOR_IMAGE_METRICS_H
+
+#include "converter.h"
+
+// The metrics compare two images of the same size. SSIM works on the luma
+// planes over 8x8 windows spaced 4 pixels apart; PSNR covers the RGB channels.
+
+typedef struct {
+    double psnr;        // dB; INFINITY for identical images
+    double ssim;        // 1.0 = identical
+    double ms_ssim;     // Five-scale MS-SSIM (fewer scales for small images)
+} ImageQuality;
+
+// All metrics, on up to `threads` threads (0 = all cores)
+bool compare_images(const ImageData* a, const ImageData* b, int threads, ImageQuality* quality);
+
+// Loads both files upright with load_image() and compares them
+bool compare_image_files(const char* path_a, const char* path_b, int threads,
+                         ImageQuality* quality);
+
+// Single-threaded, for callers that are parallel already; negative if the
+// sizes differ or memory runs out
+double image_ssim(const ImageData* a, const ImageData* b);
+double image_psnr(const ImageData* a, const ImageData* b);
+
+#endif // MEDIA_PROCESSOR_IMAGE_METRICS_H
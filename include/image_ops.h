@@ -0,0 +1,53 @@
+#ifndef MEDIA_PROCESSOR_IMAGE_OPS_H
+#define MEDIA_PROCESSOR_IMAGE_OPS_H
+
+#include "converter.h"
+#include <stdint.h>
+
+// The automatic spill threshold is the memory limit divided by this
+#define SPILL_MEMORY_SHARE 4
+
+// EXIF orientation values (TIFF tag 0x0112)
+#define EXIF_ORIENTATION_NORMAL 1
+
+// Orientation stored in a TIFF-header EXIF blob, or EXIF_ORIENTATION_NORMAL
+int exif_get_orientation(const unsigned char* exif, size_t size);
+
+// Rewrites the orientation tag in place; false if the blob has none
+bool exif_set_orientation(unsigned char* exif, size_t size, int orientation);
+
+// size bytes of an unlinked temporary file (under $TMPDIR or /var/tmp, with
+// the space reserved up front) mapped into memory, so the kernel can write
+// pages back to disk instead of holding them in RAM; NULL on failure
+void* map_temp_buffer(size_t size);
+void unmap_temp_buffer(void* buffer, size_t size);
+
+// Image whose pixels are a mapped temporary buffer
+ImageData* create_mapped_image_data(size_t width, size_t height);
+bool image_is_mapped(const ImageData* img);
+
+// True if a decoded width x height image is above options' spill threshold
+// and should be created with create_mapped_image_data()
+bool image_should_spill(size_t width, size_t height, const ConversionOptions* options);
+
+// Returns a new image with the EXIF orientation applied to the pixels
+// (rotations/transposes swap width and height), mapped if src is. Metadata
+// is not copied.
+ImageData* orient_image(const ImageData* src, int orientation);
+
+// Returns a copy of img shrunk by an integer factor so that neither side
+// exceeds max_side. Box filtered, or point sampled to keep exact colors.
+// Metadata is not copied.
+ImageData* shrink_image(const ImageData* img, size_t max_side, bool point_sample);
+
+// Factor shrink_image() divides a width x height image's sides by
+size_t shrink_factor(size_t width, size_t height, size_t max_side);
+
+// Likewise with the factor given; sides are rounded down
+ImageData* shrink_image_by(const ImageData* img, size_t factor, bool point_sample);
+
+// 64-bit checksum of the pixels. The color of fully transparent pixels is
+// ignored, since lossless encoders are free to change it.
+uint64_t image_checksum(const ImageData* img);
+
+#endif // MEDIA_PROCESSOR_IMAGE_OPS_H
@@ -0,0 +1,33 @@
+#ifndef MEDIA_PROCESSOR_IO_BACKEND_H
+#define MEDIA_PROCESSOR_IO_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    IO_BACKEND_SYNC,    // Blocking reads on a small thread pool
+    IO_BACKEND_URING    // io_uring; falls back to IO_BACKEND_SYNC if unavailable
+} IoBackend;
+
+bool string_to_io_backend(const char* str, IoBackend* backend);
+const char* io_backend_to_string(IoBackend backend);
+
+// Reads a list of files into memory in the background, in list order and
+// at most `depth` files ahead of what has been taken
+typedef struct FilePrefetcher FilePrefetcher;
+
+// paths must stay valid until the prefetcher is destroyed
+FilePrefetcher* file_prefetcher_create(IoBackend backend, const char* const* paths,
+                                       size_t count, size_t depth);
+
+// Backend actually in use after any fallback
+IoBackend file_prefetcher_backend(const FilePrefetcher* prefetcher);
+
+// Waits for file `index` and hands over its contents (free() when done).
+// Every index must be taken exactly once so the window keeps moving.
+// Returns NULL with errno set if the file could not be read.
+unsigned char* file_prefetcher_take(FilePrefetcher* prefetcher, size_t index, size_t* size);
+
+void file_prefetcher_destroy(FilePrefetcher* prefetcher);
+
+#endif // MEDIA_PROCESSOR_IO_BACKEND_H
@@ -0,0 +1,41 @@
+#ifndef MEDIA_PROCESSOR_MEMORY_BUDGET_H
+#define MEDIA_PROCESSOR_MEMORY_BUDGET_H
+
+#include "converter.h"
+#include <pthread.h>
+
+typedef struct MemoryWaiter MemoryWaiter;
+
+// Admits concurrent tasks while their estimated memory fits a limit. Waiting
+// tasks are admitted oldest first; smaller ones may go ahead of one that does
+// not fit yet, but only a bounded number of times so it cannot starve.
+typedef struct {
+    size_t limit;
+    size_t used;
+    size_t peak;                // Most bytes admitted at once
+    unsigned overtakes;         // Admissions ahead of the oldest waiter
+    MemoryWaiter* waiters;      // Oldest first
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} MemoryBudget;
+
+// Memory this process may use: its cgroup limit, or physical RAM without one
+size_t memory_limit_default(void);
+
+void memory_budget_init(MemoryBudget* budget, size_t limit);
+void memory_budget_destroy(MemoryBudget* budget);
+
+// Blocks until bytes fit the budget; a task larger than the whole budget
+// is admitted once nothing else is running
+void memory_budget_acquire(MemoryBudget* budget, size_t bytes);
+void memory_budget_release(MemoryBudget* budget, size_t bytes);
+
+// Peak memory of converting a width x height image: the file, the decoded
+// pixels and the codecs' working sets. All targets are counted as encoding
+// at once if parallel_targets; no targets means any format (--auto).
+size_t estimate_conversion_memory(size_t width, size_t height, size_t file_size,
+                                  ImageFormat input_format, const ImageFormat* targets,
+                                  size_t target_count, bool parallel_targets,
+                                  const ConversionOptions* options);
+
+#endif // MEDIA_PROCESSOR_MEMORY_BUDGET_H
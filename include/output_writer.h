@@ -0,0 +1,67 @@
+#ifndef MEDIA_PROCESSOR_OUTPUT_WRITER_H
+#define MEDIA_PROCESSOR_OUTPUT_WRITER_H
+
+#include "converter.h"
+#include <limits.h>
+#include <stdio.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifndef NAME_MAX
+#define NAME_MAX 255
+#endif
+
+// An output file that only appears under its final name once complete.
+// Encoders write to `path`; the file is then linked or renamed into place,
+// atomically replacing any existing file of that name.
+typedef struct {
+    int dir_fd;                     // Directory receiving the file
+    int fd;                         // The file being written
+    bool anonymous;                 // O_TMPFILE: unnamed until committed
+    OutputSyncPolicy sync;
+    char path[PATH_MAX];            // /proc/self/fd/N, or the named temp file
+    char name[NAME_MAX + 1];        // Final entry name inside dir_fd
+    char temp_name[NAME_MAX + 1];   // Temp entry name inside dir_fd, if any
+} OutputFile;
+
+// Prepares an output for final_path in the same directory
+bool output_file_open(OutputFile* out, const char* final_path, OutputSyncPolicy sync);
+
+// Publishes the written file under its final name
+bool output_file_commit(OutputFile* out);
+
+// Drops the written data; final_path is left untouched
+void output_file_discard(OutputFile* out);
+
+// Commits if written is true, discards otherwise; true if the file is in place
+bool output_file_finish(OutputFile* out, bool written);
+
+// Flushes the filesystem holding dir (OUTPUT_SYNC_BATCH)
+bool output_sync_filesystem(const char* dir);
+
+// An in-memory file encoders can write to through its path, for trial
+// encodes that should never reach the disk
+typedef struct {
+    int fd;
+    char path[32];                  // /proc/self/fd/N
+} MemoryOutput;
+
+bool memory_output_open(MemoryOutput* out);
+
+// Bytes written by the last encoder
+size_t memory_output_size(const MemoryOutput* out);
+
+// Copy of the contents in a new buffer (free() when done); NULL on failure
+unsigned char* memory_output_read(const MemoryOutput* out, size_t* size);
+
+void memory_output_close(MemoryOutput* out);
+
+// Writes a complete encoded file to filepath
+bool write_file_data(const char* filepath, const unsigned char* data, size_t size);
+
+// Reserves size bytes for data about to be written to fp (best effort)
+void output_preallocate(FILE* fp, size_t size);
+
+#endif // MEDIA_PROCESSOR_OUTPUT_WRITER_H
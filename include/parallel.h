@@ -0,0 +1,16 @@
+#ifndef MEDIA_PROCESSOR_PARALLEL_H
+#define MEDIA_PROCESSOR_PARALLEL_H
+
+#include <stddef.h>
+
+// Work item for parallel_for(); index runs from 0 to count - 1
+typedef void (*ParallelTask)(void* ctx, size_t index);
+
+// Number of online CPUs (at least 1)
+int parallel_cpu_count(void);
+
+// Runs task for every index on up to `threads` threads (0 = all cores).
+// The calling thread takes part; returns once every index has completed.
+void parallel_for(size_t count, int threads, ParallelTask task, void* ctx);
+
+#endif // MEDIA_PROCESSOR_PARALLEL_H
@@ -0,0 +1,33 @@
+#ifndef MEDIA_PROCESSOR_PNG_WRITER_H
+#define MEDIA_PROCESSOR_PNG_WRITER_H
+
+#include <png.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    int level;      // zlib compression level (0-9)
+    int strategy;   // zlib strategy (Z_FILTERED, Z_RLE, ...)
+    int filters;    // Mask of PNG_FILTER_* values; several bits = pick per row
+    int threads;    // Worker threads (0 = all cores)
+} PngWriterParams;
+
+// Trial-compresses a sample of filtered rows with the candidate zlib
+// strategies and returns the one that produced the smallest output
+int png_writer_choose_strategy(const unsigned char* rows, size_t stride, size_t row_bytes,
+                               size_t bpp, size_t height, const PngWriterParams* params);
+
+// True if the image is big enough for band-parallel compression to pay off
+bool png_writer_should_parallelize(size_t row_bytes, size_t height, int threads);
+
+// Filters and deflates independent bands of rows on worker threads and writes
+// them as a single zlib stream split over consecutive IDAT chunks. Bands are
+// written as they finish, so memory use does not grow with the image.
+// Rows must already be packed in the pixel format declared in IHDR
+// (8 bits per sample, bpp bytes per pixel). Call after png_write_info();
+// the caller writes IEND afterwards instead of calling png_write_end().
+bool png_write_idat_parallel(png_structp png, const unsigned char* rows, size_t stride,
+                             size_t row_bytes, size_t bpp, size_t height,
+                             const PngWriterParams* params);
+
+#endif // MEDIA_PROCESSOR_PNG_WRITER_H
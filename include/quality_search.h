@@ -0,0 +1,31 @@
+#ifndef MEDIA_PROCESSOR_QUALITY_SEARCH_H
+#define MEDIA_PROCESSOR_QUALITY_SEARCH_H
+
+#include "converter.h"
+
+#define QUALITY_SEARCH_PROXY_SIDE 512     // Longest side of the coarse search proxy
+#define QUALITY_SEARCH_REFINE_SPAN 8      // Qualities around the proxy result retried at full size
+#define QUALITY_SEARCH_MAX_PARALLEL 8     // Trial encodes per round at most
+
+typedef struct {
+    int quality;          // Quality to encode with
+    bool met;             // False if no quality reaches the target (closest one is used)
+    int trials;           // Trial encodes run, including those on the proxy
+    int rounds;           // Rounds of parallel trials
+    double seconds;       // Time spent searching
+    size_t size;          // Encoded size at `quality`, if met
+    double ssim;          // SSIM at `quality`, if met with an SSIM target
+    unsigned char* data;  // Full-size encoding at `quality` if met (free() when done)
+} QualitySearchResult;
+
+// True if format has a quality setting to tune under these options
+bool quality_search_supported(ImageFormat format, const ConversionOptions* options);
+
+// Finds the encoder quality that meets options->quality_target: the highest
+// fitting the size budget, or the lowest reaching the SSIM floor. Each round
+// bisects the remaining range with parallel trial encodes held in memory;
+// large images are searched on a proxy first and refined at full size.
+bool quality_search(ImageFormat format, const ImageData* img,
+                    const ConversionOptions* options, QualitySearchResult* result);
+
+#endif // MEDIA_PROCESSOR_QUALITY_SEARCH_H
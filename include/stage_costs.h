@@ -0,0 +1,47 @@
+#ifndef MEDIA_PROCESSOR_STAGE_COSTS_H
+#define MEDIA_PROCESSOR_STAGE_COSTS_H
+
+#include "converter.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define STAGE_COST_FORMATS (FORMAT_AVIF + 1)
+
+typedef enum {
+    STAGE_DECODE,           // From the input format to RGBA
+    STAGE_ENCODE,           // From RGBA to the target format
+    STAGE_TRANSCODE,        // JPEG coefficient rewrite (FORMAT_JPG only)
+    STAGE_COUNT
+} ConversionStage;
+
+// Processing time per pixel of each stage and format, learned from earlier
+// batches and kept in ~/.cache/media-processor/stage-costs
+typedef struct {
+    double ns_per_pixel[STAGE_COUNT][STAGE_COST_FORMATS];
+} StageCosts;
+
+// Stage times measured during a batch, summed per format
+typedef struct {
+    atomic_uint_fast64_t ns[STAGE_COUNT][STAGE_COST_FORMATS];
+    atomic_uint_fast64_t pixels[STAGE_COUNT][STAGE_COST_FORMATS];
+} StageSamples;
+
+// Built-in estimates, overridden by whatever earlier runs saved
+void stage_costs_load(StageCosts* costs);
+
+// Moves the costs towards the rates measured in samples
+void stage_costs_learn(StageCosts* costs, StageSamples* samples);
+
+bool stage_costs_save(const StageCosts* costs);
+
+void stage_samples_init(StageSamples* samples);
+void stage_samples_add(StageSamples* samples, ConversionStage stage, ImageFormat format,
+                       uint64_t ns, size_t pixels);
+
+// Estimated time (ns) of converting an image of `pixels` pixels to every
+// target; no targets means any format may be picked (--auto)
+double estimate_conversion_cost(const StageCosts* costs, ImageFormat input_format, size_t pixels,
+                                const ImageFormat* targets, size_t target_count,
+                                const ConversionOptions* options);
+
+#endif // MEDIA_PROCESSOR_STAGE_COSTS_H
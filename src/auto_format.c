@@ -0,0 +1,268 @@
+#include "../include/auto_format.h"
+#include "../include/codec_backend.h"
+#include "../include/image_metrics.h"
+#include "../include/quality_search.h"
+#include "../include/image_ops.h"
+#include "../include/output_writer.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define AUTO_MAX_COUNTED_COLORS 256
+#define AUTO_COLOR_TABLE_SIZE 1024         // Power of two, well above the colors counted
+#define AUTO_SAMPLED_PIXELS (1u << 20)     // Larger images only have every n-th row analyzed
+#define AUTO_EDGE_THRESHOLD 48             // Channel difference that counts as a hard edge
+#define AUTO_FLAT_GRAPHIC 0.6              // Flat share that alone means graphics...
+#define AUTO_FLAT_MIXED 0.3                // ...or this much next to enough hard edges
+#define AUTO_EDGE_MIXED 0.05
+
+typedef struct {
+    ImageFormat format;
+    bool lossless;
+} AutoCandidate;
+
+// Graphics compress best losslessly; photos need a lossy codec
+static const AutoCandidate graphic_candidates[] = {
+    { FORMAT_PNG, true },
+    { FORMAT_WEBP, true }
+};
+static const AutoCandidate photo_candidates[] = {
+    { FORMAT_AVIF, false },
+    { FORMAT_WEBP, false }
+};
+
+// Built in, so tried when none of the candidates' modules is available
+static const AutoCandidate graphic_fallback = { FORMAT_PNG, true };
+static const AutoCandidate photo_fallback = { FORMAT_JPG, false };
+
+// Largest difference over the four channels
+static inline int pixel_distance(const unsigned char* a, const unsigned char* b) {
+    int max = 0;
+    for (int c = 0; c < 4; c++) {
+        int d = a[c] > b[c] ? a[c] - b[c] : b[c] - a[c];
+        if (d > max) max = d;
+    }
+    return max;
+}
+
+static void count_color(uint64_t* table, size_t* colors, uint32_t color) {
+    // The marker bit keeps color 0 apart from empty slots
+    uint64_t key = (uint64_t)color | (1ull << 32);
+    size_t slot = (color * 2654435761u) & (AUTO_COLOR_TABLE_SIZE - 1);
+    while (table[slot] && table[slot] != key) {
+        slot = (slot + 1) & (AUTO_COLOR_TABLE_SIZE - 1);
+    }
+    if (!table[slot]) {
+        table[slot] = key;
+        (*colors)++;
+    }
+}
+
+void analyze_image_content(const ImageData* img, ImageContentStats* stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(*stats));
+    if (!img || !img->data || img->width == 0 || img->height == 0) return;
+
+    size_t pixels = img->width * img->height;
+    size_t row_step = (pixels + AUTO_SAMPLED_PIXELS - 1) / AUTO_SAMPLED_PIXELS;
+    if (row_step < 1) row_step = 1;
+
+    uint64_t table[AUTO_COLOR_TABLE_SIZE] = {0};
+    size_t pairs = 0;
+    size_t flat = 0;
+    size_t edges = 0;
+
+    for (size_t y = 0; y < img->height; y += row_step) {
+        const unsigned char* row = image_row(img, y);
+        const unsigned char* below = y + 1 < img->height ? image_row(img, y + 1) : NULL;
+
+        for (size_t x = 0; x < img->width; x++) {
+            const unsigned char* p = row + x * 4;
+            if (p[3] != 255) stats->has_alpha = true;
+            if (stats->colors <= AUTO_MAX_COUNTED_COLORS) {
+                count_color(table, &stats->colors,
+                            (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+            }
+
+            // Compare with the right and lower neighbors
+            const unsigned char* neighbors[2] = {
+                x + 1 < img->width ? p + 4 : NULL,
+                below ? below + x * 4 : NULL
+            };
+            for (int n = 0; n < 2; n++) {
+                if (!neighbors[n]) continue;
+                int distance = pixel_distance(p, neighbors[n]);
+                pairs++;
+                if (distance == 0) flat++;
+                else if (distance >= AUTO_EDGE_THRESHOLD) edges++;
+            }
+        }
+    }
+
+    if (pairs > 0) {
+        stats->flat_ratio = (double)flat / pairs;
+        stats->edge_density = (double)edges / pairs;
+    }
+
+    // Drawings and screenshots have few colors, or large flat areas with
+    // sharp edges between them; camera noise leaves photos with neither
+    stats->graphic = stats->colors <= AUTO_MAX_COUNTED_COLORS ||
+                     stats->flat_ratio >= AUTO_FLAT_GRAPHIC ||
+                     (stats->flat_ratio >= AUTO_FLAT_MIXED &&
+                      stats->edge_density >= AUTO_EDGE_MIXED);
+}
+
+static void apply_candidate(ConversionOptions* options, const AutoCandidate* candidate) {
+    switch (candidate->format) {
+        case FORMAT_PNG:
+            options->png_options.reduce_colors = true;
+            break;
+        case FORMAT_WEBP:
+            options->webp_options.lossless = candidate->lossless;
+            // Near-lossless would switch the encoder back to lossless mode
+            if (!candidate->lossless) options->webp_options.near_lossless = 100;
+            break;
+        case FORMAT_AVIF:
+            options->avif_options.lossless = candidate->lossless;
+            break;
+        default:
+            break;
+    }
+}
+
+// Built in, or its module loads; unlike codec_backend() a missing module
+// is not reported, since another candidate takes its place
+static bool candidate_available(const AutoCandidate* candidate) {
+    CodecModuleInfo info;
+    return !codec_module_info(candidate->format, &info) || info.loaded;
+}
+
+// SSIM the photo candidates must reach on the proxy: the caller's SSIM
+// target, or what JPEG reaches at the requested quality, as -q follows the
+// JPEG scale. Negative if it cannot be measured.
+static double photo_ssim_floor(const ImageData* proxy, const ConversionOptions* base,
+                               MemoryOutput* out) {
+    if (base->quality_target.kind == QUALITY_TARGET_SSIM) return base->quality_target.min_ssim;
+
+    ConversionOptions reference = *base;
+    reference.quality_target.kind = QUALITY_TARGET_NONE;
+    reference.maintain_exif = false;
+    if (!save_image(out->path, FORMAT_JPG, proxy, &reference)) return -1.0;
+
+    size_t size = 0;
+    unsigned char* data = memory_output_read(out, &size);
+    if (!data) return -1.0;
+
+    // The proxy is cropped and upright already
+    ConversionOptions decode;
+    init_conversion_options(&decode);
+    decode.maintain_exif = false;
+    ImageData* decoded = load_image_from_memory("auto format proxy", FORMAT_JPG, data, size, &decode);
+    free(data);
+    if (!decoded) return -1.0;
+
+    double ssim = image_ssim(proxy, decoded);
+    free_image_data(decoded);
+    free(decoded);
+    return ssim;
+}
+
+// Encoded size of the proxy in a candidate's format, 0 on failure. With
+// min_ssim > 0 the quality is searched for the lowest reaching it and
+// stored in *quality; 0 if none does.
+static size_t trial_encode(const ImageData* proxy, const ConversionOptions* base,
+                           const AutoCandidate* candidate, double min_ssim,
+                           MemoryOutput* out, int* quality) {
+    ConversionOptions trial = *base;
+    apply_candidate(&trial, candidate);
+    trial.png_options.threads = 1;  // The proxy is too small to split
+    trial.quality_target.kind = QUALITY_TARGET_NONE;
+    *quality = trial.quality;
+
+    if (min_ssim > 0.0 && quality_search_supported(candidate->format, &trial)) {
+        trial.quality_target.kind = QUALITY_TARGET_SSIM;
+        trial.quality_target.min_ssim = min_ssim;
+
+        QualitySearchResult result;
+        if (!quality_search(candidate->format, proxy, &trial, &result)) return 0;
+        free(result.data);
+        *quality = result.quality;
+        return result.met ? result.size : 0;
+    }
+
+    return save_image(out->path, candidate->format, proxy, &trial) ? memory_output_size(out) : 0;
+}
+
+// Keeps the candidate encoding the proxy smallest in choice
+static void rank_candidates(AutoFormatChoice* choice, const ConversionOptions* base,
+                            const ImageData* proxy, const AutoCandidate* const* candidates,
+                            size_t count, double min_ssim, MemoryOutput* out) {
+    for (size_t i = 0; i < count; i++) {
+        int quality;
+        size_t size = trial_encode(proxy, base, candidates[i], min_ssim, out, &quality);
+        if (size > 0 && (choice->proxy_size == 0 || size < choice->proxy_size)) {
+            choice->format = candidates[i]->format;
+            choice->options = *base;
+            apply_candidate(&choice->options, candidates[i]);
+            // A caller's own quality target is searched again at full size
+            if (base->quality_target.kind == QUALITY_TARGET_NONE) choice->options.quality = quality;
+            choice->proxy_size = size;
+        }
+    }
+}
+
+bool choose_auto_format(const ImageData* img, bool animated, const ConversionOptions* base,
+                        AutoFormatChoice* choice) {
+    if (!img || !img->data || !choice) return false;
+
+    ConversionOptions defaults;
+    if (!base) {
+        init_conversion_options(&defaults);
+        base = &defaults;
+    }
+
+    analyze_image_content(img, &choice->content);
+    bool graphic = choice->content.graphic;
+    const AutoCandidate* listed = graphic ? graphic_candidates : photo_candidates;
+    size_t listed_count = graphic ?
+        sizeof(graphic_candidates) / sizeof(graphic_candidates[0]) :
+        sizeof(photo_candidates) / sizeof(photo_candidates[0]);
+
+    const AutoCandidate* candidates[4];
+    size_t count = 0;
+    for (size_t i = 0; i < listed_count; i++) {
+        // A still-only format would keep just the first frame
+        if (animated && !format_supports_animation(listed[i].format)) continue;
+        if (candidate_available(&listed[i])) candidates[count++] = &listed[i];
+    }
+    if (count == 0 && !animated) candidates[count++] = graphic ? &graphic_fallback : &photo_fallback;
+    if (count == 0) return false;
+
+    choice->proxy_size = 0;
+
+    // Trial outputs never touch the disk
+    MemoryOutput trial_output;
+    if (!memory_output_open(&trial_output)) return false;
+
+    ImageData* proxy = shrink_image(img, AUTO_PROXY_MAX_SIDE, graphic);
+    if (!proxy) {
+        memory_output_close(&trial_output);
+        return false;
+    }
+
+    // Lossy quality scales differ between codecs, so photo candidates are
+    // compared by their size at the quality where they look the same
+    double min_ssim = graphic ? 0.0 : photo_ssim_floor(proxy, base, &trial_output);
+
+    rank_candidates(choice, base, proxy, candidates, count, min_ssim, &trial_output);
+    // Nothing reached the floor: compare at the requested quality instead
+    if (choice->proxy_size == 0 && min_ssim > 0.0) {
+        rank_candidates(choice, base, proxy, candidates, count, 0.0, &trial_output);
+    }
+
+    free_image_data(proxy);
+    free(proxy);
+    memory_output_close(&trial_output);
+    // No candidate could encode the proxy
+    return choice->proxy_size > 0;
+}
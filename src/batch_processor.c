@@ -1,26 +1,37 @@
 #include "batch_processor.h"
+#include "auto_format.h"
+#include "codec.h"
+#include "codec_cache.h"
+#include "image_metrics.h"
+#include "image_ops.h"
+#include "io_backend.h"
+#include "memory_budget.h"
+#include "output_writer.h"
+#include "parallel.h"
+#include "stage_costs.h"
+#include <fcntl.h>
 #include <limits.h>  // For PATH_MAX
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>  // For getcwd
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096  // Common value for most UNIX systems
 #endif
 
+#define VERIFY_PROXY_SIDE 256      // Lossy outputs are compared at this size
+#define VERIFY_MIN_PSNR 20.0       // Below this (dB) a lossy output counts as damaged
+#define VERIFY_WORKERS_PER_ENCODER 4  // One verifier per this many encoders
+#define PLAN_PROBE_BYTES (256 * 1024)  // Read from each file to find its pixel size
+#define PLAN_PIXELS_PER_BYTE 4         // Guess for files whose header could not be parsed
+
 bool is_supported_image(const char* filename) {
     ImageFormat format = detect_format(filename);
     return format != FORMAT_UNKNOWN;
 }
 
-char* get_temp_filename(const char* original_filename) {
-    const char* temp_suffix = ".tmp";
-    size_t len = strlen(original_filename) + strlen(temp_suffix) + 1;
-    char* temp_filename = (char*)malloc(len);
-    if (!temp_filename) return NULL;
-    
-    snprintf(temp_filename, len, "%s%s", original_filename, temp_suffix);
-    return temp_filename;
-}
-
 char* get_output_filename(const char* input_filename, ImageFormat target_format) {
     // Find the last dot in the filename
     const char* last_dot = strrchr(input_filename, '.');
@@ -45,11 +56,670 @@ char* get_output_filename(const char* input_filename, ImageFormat target_format)
     return output_filename;
 }
 
+// A converted file whose output is checked before it is published
+typedef struct {
+    size_t index;
+    OutputFile output;
+    ImageFormat format;
+    bool transcode;             // Compare with the decoded original instead
+    bool exact;                 // Lossless: the pixel checksum must match
+    size_t width;               // Expected size
+    size_t height;
+    uint64_t checksum;
+    ImageData* reference;       // Lossy: shrunk source to compare against
+} VerifyJob;
+
+// Bounded hand-off from the encoders to the verifiers; encoders only wait
+// when verification falls this far behind
+typedef struct {
+    VerifyJob** jobs;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} VerifyQueue;
+
+// Progress of one source file over its outputs
+typedef struct {
+    atomic_int pending;                 // Outputs not finished yet
+    atomic_bool failed;                 // Some output was not written
+    bool overwritten;                   // An output took the source's own name
+    size_t reserved;                    // Memory budget held until the file is done
+    size_t width;                       // From the header when planning (0 if unknown)
+    size_t height;
+    char detail[64];                    // Appended to the success message
+} BatchFileState;
+
+// Shared state of the batch workers
+typedef struct {
+    const BatchProcessingOptions* options;
+    ConversionOptions conversion;       // Codec settings used by the workers
+    char** names;
+    BatchFileState* files;
+    int target_threads;                 // Encoders working on one file's targets
+    bool* converted;                    // Originals whose removal was deferred
+    bool defer_removal;
+    FilePrefetcher* prefetcher;
+    VerifyQueue verify_queue;
+    int verifiers;                      // Verifier threads running (0 = verify inline)
+    MemoryBudget memory;                // Admits files whose estimated memory fits
+    StageSamples samples;               // Per-format stage times for the cost model
+    atomic_int processed_count;
+    atomic_int error_count;
+    atomic_uint_fast64_t read_wait_ns;  // Stage times, summed over workers
+    atomic_uint_fast64_t decode_ns;
+    atomic_uint_fast64_t analyze_ns;    // Format selection in auto mode
+    atomic_uint_fast64_t encode_ns;
+    atomic_uint_fast64_t verify_ns;
+    atomic_uint_fast64_t memory_wait_ns;
+} BatchContext;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static bool verify_queue_init(VerifyQueue* queue, size_t capacity) {
+    memset(queue, 0, sizeof(*queue));
+    queue->jobs = (VerifyJob**)calloc(capacity, sizeof(VerifyJob*));
+    if (!queue->jobs) return false;
+
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return true;
+}
+
+static void verify_queue_destroy(VerifyQueue* queue) {
+    if (!queue->jobs) return;
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->jobs);
+    queue->jobs = NULL;
+}
+
+static void verify_queue_push(VerifyQueue* queue, VerifyJob* job) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Next job, or NULL once the queue is closed and drained
+static VerifyJob* verify_queue_pop(VerifyQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    VerifyJob* job = NULL;
+    if (queue->count > 0) {
+        job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+static void verify_queue_close(VerifyQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Lets waiting files use the memory this one no longer needs
+static void release_batch_memory(BatchContext* batch, BatchFileState* file) {
+    memory_budget_release(&batch->memory, file->reserved);
+    file->reserved = 0;
+}
+
+// Retires the original once all of its outputs are in place
+static void finish_batch_file(BatchContext* batch, size_t index) {
+    BatchFileState* file = &batch->files[index];
+    const char* name = batch->names[index];
+
+    release_batch_memory(batch, file);
+
+    if (atomic_load(&file->failed)) {
+        printf("Error: Failed to convert %s\n", name);
+        atomic_fetch_add(&batch->error_count, 1);
+        return;
+    }
+
+    // An output written under the source's name (-r) has already replaced it
+    if (!file->overwritten) {
+        if (batch->defer_removal) {
+            batch->converted[index] = true;
+        } else {
+            // If not replacing, but conversion succeeded, delete the original
+            if (remove(name) != 0) {
+                printf("Warning: Could not remove original file %s\n", name);
+                // Don't count this as an error since conversion succeeded
+            }
+        }
+    }
+    atomic_fetch_add(&batch->processed_count, 1);
+    printf("Successfully converted: %s%s\n", name, file->detail);
+}
+
+// Publishes one output of a file (output is NULL if it could not be opened);
+// whoever finishes the file's last output retires the original
+static void finish_batch_output(BatchContext* batch, size_t index, OutputFile* output,
+                                ImageFormat format, bool success) {
+    BatchFileState* file = &batch->files[index];
+
+    // A replaced original is swapped in one rename
+    success = output && output_file_finish(output, success);
+    if (!success) {
+        if (batch->options->target_count > 1) {
+            printf("Error: Could not write %s output of %s\n", format_to_string(format),
+                   batch->names[index]);
+        }
+        atomic_store(&file->failed, true);
+    }
+
+    if (atomic_fetch_sub(&file->pending, 1) == 1) {
+        finish_batch_file(batch, index);
+    }
+}
+
+// Reads the start of a file for its pixel size; file_size is set regardless
+static bool probe_image_file(const char* name, ImageFormat format,
+                             size_t* width, size_t* height, size_t* file_size) {
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    *file_size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    size_t wanted = *file_size < PLAN_PROBE_BYTES ? *file_size : PLAN_PROBE_BYTES;
+
+    unsigned char* header = (unsigned char*)malloc(wanted ? wanted : 1);
+    size_t got = 0;
+    while (header && got < wanted) {
+        ssize_t n = pread(fd, header + got, wanted - got, (off_t)got);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fd);
+
+    bool found = header && read_image_dimensions(format, header, got, width, height);
+    free(header);
+    return found;
+}
+
+// Decodes a lossy output at 1/scale of its size, for codecs that shrink
+// while decoding; NULL unless the output is the expected size and came back
+// scaled, in which case the full decode reports what is wrong
+static ImageData* load_scaled_output(const VerifyJob* job, size_t scale,
+                                     const ConversionOptions* options) {
+    size_t width, height, file_size;
+    if (!probe_image_file(job->output.path, job->format, &width, &height, &file_size) ||
+        width != job->width || height != job->height) {
+        return NULL;
+    }
+
+    // Animations, for one, decode their first frame at full size
+    ImageData* decoded = codec_for_format(job->format)->decode_scaled(job->output.path, scale, options);
+    if (decoded && (decoded->width != (width + scale - 1) / scale ||
+                    decoded->height != (height + scale - 1) / scale)) {
+        free_image_data(decoded);
+        free(decoded);
+        decoded = NULL;
+    }
+    return decoded;
+}
+
+// Shrinks a decoded lossy output to the size of job->reference and returns
+// its PSNR against it; scale is what the decoder already shrank it by
+static double verify_proxy_psnr(const VerifyJob* job, const ImageData* decoded, size_t scale) {
+    size_t factor = shrink_factor(job->width, job->height, VERIFY_PROXY_SIDE);
+    ImageData* shrunk = shrink_image_by(decoded, factor / scale, false);
+    if (!shrunk) return -1.0;
+
+    // Sides rounded up by the decoder can leave one extra row or column
+    double psnr = -1.0;
+    if (shrunk->width >= job->reference->width && shrunk->height >= job->reference->height) {
+        ImageData* view = create_image_view(shrunk, 0, 0, job->reference->width,
+                                            job->reference->height);
+        if (view) {
+            psnr = image_psnr(job->reference, view);
+            free_image_data(view);
+            free(view);
+        }
+    }
+    free_image_data(shrunk);
+    free(shrunk);
+    return psnr;
+}
+
+// Decodes the written output and compares it with what was encoded
+static bool verify_output(const BatchContext* batch, VerifyJob* job) {
+    const char* name = batch->names[job->index];
+    ConversionOptions decode_options = batch->conversion;
+    decode_options.maintain_exif = false;
+    decode_options.crop.width = 0;      // The output is cropped already
+
+    if (job->transcode) {
+        // Both sides as stored; the transcode may have dropped the orientation
+        decode_options.apply_orientation = false;
+        ImageData* original = load_image(name, &decode_options);
+        if (!original) {
+            printf("Error: Could not decode %s to verify it\n", name);
+            return false;
+        }
+        job->width = original->width;
+        job->height = original->height;
+        job->checksum = image_checksum(original);
+        free_image_data(original);
+        free(original);
+    }
+
+    // Lossy outputs are only compared shrunk, so let the decoder do part of
+    // the shrinking where it can
+    size_t scale = 1;
+    ImageData* decoded = NULL;
+    if (!job->exact) {
+        scale = codec_scale_factor(codec_for_format(job->format),
+                                   shrink_factor(job->width, job->height, VERIFY_PROXY_SIDE));
+        if (scale > 1) decoded = load_scaled_output(job, scale, &decode_options);
+        if (!decoded) scale = 1;
+    }
+    if (!decoded) {
+        decoded = load_image_as(job->output.path, job->format, &decode_options);
+    }
+    if (!decoded) {
+        printf("Error: Verification failed for %s: output does not decode\n", name);
+        return false;
+    }
+
+    bool success = scale > 1 || (decoded->width == job->width && decoded->height == job->height);
+    if (!success) {
+        printf("Error: Verification failed for %s: output is %zux%zu instead of %zux%zu\n",
+               name, decoded->width, decoded->height, job->width, job->height);
+    } else if (job->exact) {
+        success = image_checksum(decoded) == job->checksum;
+        if (!success) {
+            printf("Error: Verification failed for %s: lossless output differs\n", name);
+        }
+    } else {
+        // Shrinking both sides averages out coding noise but not damage
+        double psnr = verify_proxy_psnr(job, decoded, scale);
+        success = psnr >= VERIFY_MIN_PSNR;
+        if (!success) {
+            printf("Error: Verification failed for %s: output deviates from source (%.1f dB)\n",
+                   name, psnr);
+        }
+    }
+
+    free_image_data(decoded);
+    free(decoded);
+    return success;
+}
+
+static void free_verify_job(VerifyJob* job) {
+    if (job->reference) {
+        free_image_data(job->reference);
+        free(job->reference);
+    }
+    free(job);
+}
+
+static void* verify_worker(void* arg) {
+    BatchContext* batch = (BatchContext*)arg;
+    VerifyJob* job;
+    while ((job = verify_queue_pop(&batch->verify_queue)) != NULL) {
+        uint64_t start = now_ns();
+        bool success = verify_output(batch, job);
+        atomic_fetch_add(&batch->verify_ns, now_ns() - start);
+
+        finish_batch_output(batch, job->index, &job->output, job->format, success);
+        free_verify_job(job);
+    }
+    return NULL;
+}
+
+// Captures what the verifier needs from the source before it is freed
+static VerifyJob* create_verify_job(size_t index, const OutputFile* output, ImageFormat format,
+                                    const ImageData* img, const ConversionOptions* conversion) {
+    VerifyJob* job = (VerifyJob*)calloc(1, sizeof(VerifyJob));
+    if (!job) return NULL;
+
+    job->index = index;
+    job->output = *output;
+    job->format = format;
+
+    if (!img) {
+        job->transcode = true;
+        job->exact = true;
+    } else {
+        job->width = img->width;
+        job->height = img->height;
+        job->exact = codec_for_format(format)->is_lossless(conversion);
+        if (job->exact) {
+            job->checksum = image_checksum(img);
+        } else {
+            job->reference = shrink_image(img, VERIFY_PROXY_SIDE, false);
+            if (!job->reference) {
+                free(job);
+                return NULL;
+            }
+        }
+    }
+    return job;
+}
+
+// One decoded source fanned out to its target formats
+typedef struct {
+    BatchContext* batch;
+    size_t index;
+    const ImageData* img;               // Shared read-only by the encoders
+    const ConversionOptions* conversion;
+    ImageFormat input_format;
+    const ImageFormat* formats;
+    char* output_names[MAX_TARGET_FORMATS];
+    bool transcode[MAX_TARGET_FORMATS]; // Rewritten from the file, without img
+    bool animated[MAX_TARGET_FORMATS];  // Every frame converted from the file;
+                                        // img (the first) is only for verification
+} BatchFanOut;
+
+// Writes one target of a file; runs on the file's worker or its helpers
+static void encode_batch_target(void* ctx, size_t target) {
+    BatchFanOut* fan = (BatchFanOut*)ctx;
+    BatchContext* batch = fan->batch;
+    const ConversionOptions* conversion = fan->conversion;
+    const char* name = batch->names[fan->index];
+    ImageFormat format = fan->formats[target];
+
+    OutputFile output;
+    if (!output_file_open(&output, fan->output_names[target], conversion->sync)) {
+        finish_batch_output(batch, fan->index, NULL, format, false);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    bool save_success;
+    if (fan->transcode[target]) {
+        save_success = codec_for_format(format)->transcode(name, output.path, conversion);
+    } else if (fan->animated[target]) {
+        save_success = convert_animation(name, fan->input_format, output.path, format, conversion);
+    } else {
+        save_success = save_image(output.path, format, fan->img, conversion);
+    }
+    uint64_t elapsed = now_ns() - start;
+    atomic_fetch_add(&batch->encode_ns, elapsed);
+
+    // Per-pixel rates of whole animations would skew the learned costs
+    if (save_success && !fan->animated[target]) {
+        const BatchFileState* file = &batch->files[fan->index];
+        size_t pixels = fan->img ? fan->img->width * fan->img->height : file->width * file->height;
+        stage_samples_add(&batch->samples, fan->transcode[target] ? STAGE_TRANSCODE : STAGE_ENCODE,
+                          format, elapsed, pixels);
+    }
+
+    // Hand the output to the verifiers; it is published once checked
+    VerifyJob* job = NULL;
+    if (save_success && batch->options->verify) {
+        job = create_verify_job(fan->index, &output, format,
+                                fan->transcode[target] ? NULL : fan->img, conversion);
+        if (!job) {
+            printf("Error: Could not prepare verification of %s\n", name);
+            save_success = false;
+        }
+    }
+
+    if (job && batch->verifiers > 0) {
+        verify_queue_push(&batch->verify_queue, job);
+    } else if (job) {
+        start = now_ns();
+        save_success = verify_output(batch, job);
+        atomic_fetch_add(&batch->verify_ns, now_ns() - start);
+        finish_batch_output(batch, fan->index, &job->output, format, save_success);
+        free_verify_job(job);
+    } else {
+        finish_batch_output(batch, fan->index, &output, format, save_success);
+    }
+}
+
+// Converts one file of the batch to all targets; runs on a worker thread
+static void convert_batch_file(void* ctx, size_t index) {
+    BatchContext* batch = (BatchContext*)ctx;
+    const BatchProcessingOptions* options = batch->options;
+    BatchFileState* file = &batch->files[index];
+    const char* name = batch->names[index];
+
+    // Always take the prefetched file, even if unused, so the window moves on
+    uint64_t start = now_ns();
+    size_t size = 0;
+    unsigned char* data = file_prefetcher_take(batch->prefetcher, index, &size);
+    int read_error = errno;
+    atomic_fetch_add(&batch->read_wait_ns, now_ns() - start);
+
+    BatchFanOut fan = {
+        .batch = batch,
+        .index = index,
+        .conversion = &batch->conversion,
+        .formats = options->target_formats
+    };
+    size_t target_count = options->target_count;
+    ImageFormat input_format = detect_format(name);
+    fan.input_format = input_format;
+    AutoFormatChoice choice;
+    ImageData* img = NULL;
+
+    // Wait until the file's estimated peak memory fits the budget; the
+    // header gives its pixel size without decoding anything
+    if (file->width == 0 && data) {
+        read_image_dimensions(input_format, data, size, &file->width, &file->height);
+    }
+    if (file->width > 0) {
+        file->reserved = estimate_conversion_memory(
+            file->width, file->height, size, input_format,
+            options->auto_format ? NULL : options->target_formats,
+            options->auto_format ? 0 : target_count,
+            batch->target_threads > 1, fan.conversion);
+    } else {
+        file->reserved = size;
+    }
+    start = now_ns();
+    memory_budget_acquire(&batch->memory, file->reserved);
+    atomic_fetch_add(&batch->memory_wait_ns, now_ns() - start);
+
+    // JPEG to JPEG only needs new entropy coding, and animations are converted
+    // frame by frame; the prefetch has already pulled the file into the page
+    // cache. Every other target shares one decode, which for an animation is
+    // its first frame.
+    bool decode = options->auto_format;
+    bool animated = is_animated_image(name, input_format);
+    for (size_t i = 0; !options->auto_format && i < target_count; i++) {
+        fan.transcode[i] = is_jpeg_transcode(input_format, fan.formats[i], fan.conversion);
+        fan.animated[i] = animated && format_supports_animation(fan.formats[i]);
+        if (!fan.transcode[i] && (!fan.animated[i] || options->verify)) decode = true;
+    }
+
+    if (!decode) {
+        free(data);
+    } else {
+        // Decode from the prefetched buffer
+        if (data) {
+            start = now_ns();
+            img = load_image_from_memory(name, input_format, data, size, fan.conversion);
+            uint64_t elapsed = now_ns() - start;
+            atomic_fetch_add(&batch->decode_ns, elapsed);
+            if (img) {
+                stage_samples_add(&batch->samples, STAGE_DECODE, input_format, elapsed,
+                                  img->width * img->height);
+            }
+            free(data);
+        } else {
+            printf("Error: Could not read %s: %s\n", name, strerror(read_error));
+        }
+
+        if (!img) {
+            printf("Error: Could not load image %s\n", name);
+            release_batch_memory(batch, file);
+            atomic_fetch_add(&batch->error_count, 1);
+            return;
+        }
+        fan.img = img;
+
+        // Let the content pick the format and its settings
+        if (options->auto_format) {
+            start = now_ns();
+            if (choose_auto_format(img, animated, fan.conversion, &choice)) {
+                fan.formats = &choice.format;
+                fan.conversion = &choice.options;
+                fan.animated[0] = animated && format_supports_animation(choice.format);
+                target_count = 1;
+                snprintf(file->detail, sizeof(file->detail), " -> %s (%s)",
+                         format_to_string(choice.format),
+                         choice.content.graphic ? "graphic" : "photo");
+            }
+            atomic_fetch_add(&batch->analyze_ns, now_ns() - start);
+        }
+    }
+
+    if (target_count == 0) {
+        printf("Error: No target format for %s\n", name);
+        free_image_data(img);
+        free(img);
+        release_batch_memory(batch, file);
+        atomic_fetch_add(&batch->error_count, 1);
+        return;
+    }
+
+    // Get the output filenames; replaced files keep their name and are
+    // swapped atomically once the new data is complete
+    bool named = true;
+    for (size_t i = 0; i < target_count; i++) {
+        if (options->replace_originals) {
+            fan.output_names[i] = strdup(name);
+        } else {
+            fan.output_names[i] = get_output_filename(name, fan.formats[i]);
+        }
+        if (!fan.output_names[i]) {
+            named = false;
+        } else if (strcmp(fan.output_names[i], name) == 0) {
+            file->overwritten = true;
+        }
+        if (target_count > 1) {
+            size_t used = strlen(file->detail);
+            snprintf(file->detail + used, sizeof(file->detail) - used, "%s%s",
+                     i == 0 ? " -> " : ", ", format_to_string(fan.formats[i]));
+        }
+    }
+
+    if (named) {
+        // The source is retired by whichever output finishes last
+        atomic_store(&file->pending, (int)target_count);
+        parallel_for(target_count, batch->target_threads, encode_batch_target, &fan);
+    } else {
+        printf("Error: Could not create output filename for %s\n", name);
+        release_batch_memory(batch, file);
+        atomic_fetch_add(&batch->error_count, 1);
+    }
+
+    // Cleanup; verifiers keep what they need of the image
+    for (size_t i = 0; i < target_count; i++) {
+        free(fan.output_names[i]);
+    }
+    if (img) {
+        free_image_data(img);
+        free(img);
+    }
+}
+
+// A file's place in the batch
+typedef struct {
+    char* name;
+    size_t width;
+    size_t height;
+    double cost;                        // Estimated ns of work
+} PlannedFile;
+
+typedef struct {
+    PlannedFile* files;
+    const BatchProcessingOptions* options;
+    const ConversionOptions* conversion;
+    const StageCosts* costs;
+} BatchPlan;
+
+static void plan_batch_file(void* ctx, size_t index) {
+    BatchPlan* plan = (BatchPlan*)ctx;
+    PlannedFile* file = &plan->files[index];
+    ImageFormat format = detect_format(file->name);
+
+    size_t file_size = 0;
+    if (!probe_image_file(file->name, format, &file->width, &file->height, &file_size)) {
+        file->width = 0;
+        file->height = 0;
+    }
+    size_t pixels = file->width > 0 ? file->width * file->height : file_size * PLAN_PIXELS_PER_BYTE;
+
+    const BatchProcessingOptions* options = plan->options;
+    file->cost = estimate_conversion_cost(plan->costs, format, pixels,
+                                          options->auto_format ? NULL : options->target_formats,
+                                          options->auto_format ? 0 : options->target_count,
+                                          plan->conversion);
+}
+
+// Most expensive first; by name among equals so runs are repeatable
+static int compare_planned_files(const void* a, const void* b) {
+    const PlannedFile* fa = (const PlannedFile*)a;
+    const PlannedFile* fb = (const PlannedFile*)b;
+    if (fa->cost != fb->cost) return fa->cost > fb->cost ? -1 : 1;
+    return strcmp(fa->name, fb->name);
+}
+
+// Orders the batch longest job first, so the batch does not end with one
+// large file converting while the other workers sit idle
+static bool plan_batch(BatchContext* batch, size_t count, int threads, const StageCosts* costs) {
+    PlannedFile* files = (PlannedFile*)calloc(count, sizeof(PlannedFile));
+    if (!files) return false;
+
+    for (size_t i = 0; i < count; i++) {
+        files[i].name = batch->names[i];
+    }
+    BatchPlan plan = {
+        .files = files,
+        .options = batch->options,
+        .conversion = &batch->conversion,
+        .costs = costs
+    };
+    parallel_for(count, threads, plan_batch_file, &plan);
+    qsort(files, count, sizeof(PlannedFile), compare_planned_files);
+
+    for (size_t i = 0; i < count; i++) {
+        batch->names[i] = files[i].name;
+        batch->files[i].width = files[i].width;
+        batch->files[i].height = files[i].height;
+    }
+    free(files);
+    return true;
+}
+
 int process_directory(const BatchProcessingOptions* options) {
-    if (!options || !options->input_dir) {
+    if (!options || !options->input_dir || options->target_count > MAX_TARGET_FORMATS ||
+        (!options->auto_format && options->target_count == 0)) {
         printf("Error: Invalid batch processing options\n");
         return -1;
     }
+    if (options->replace_originals && !options->auto_format && options->target_count > 1) {
+        printf("Error: Replacing originals needs a single target format\n");
+        return -1;
+    }
 
     DIR* dir = opendir(options->input_dir);
     if (!dir) {
@@ -58,10 +728,6 @@ int process_directory(const BatchProcessingOptions* options) {
         return -1;
     }
 
-    struct dirent* entry;
-    int processed_count = 0;
-    int error_count = 0;
-
     // Change to the input directory
     char original_dir[PATH_MAX];
     if (getcwd(original_dir, sizeof(original_dir)) == NULL) {
@@ -77,7 +743,12 @@ int process_directory(const BatchProcessingOptions* options) {
         return -1;
     }
 
-    // Process each file in the directory
+    // Collect the work list first, so outputs written meanwhile are never
+    // picked up as inputs
+    struct dirent* entry;
+    char** names = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
     while ((entry = readdir(dir)) != NULL) {
         if (entry->d_type != DT_REG) continue; // Skip if not a regular file
         
@@ -92,132 +763,184 @@ int process_directory(const BatchProcessingOptions* options) {
             continue;
         }
 
-        // Get the output filename
-        char* output_filename = NULL;
-        if (options->replace_originals) {
-            output_filename = get_temp_filename(entry->d_name);
-        } else {
-            output_filename = get_output_filename(entry->d_name, 
-                                                options->target_format);
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char** grown = (char**)realloc(names, capacity * sizeof(char*));
+            if (!grown) break;
+            names = grown;
         }
+        names[count] = strdup(entry->d_name);
+        if (names[count]) count++;
+    }
+    closedir(dir);
 
-        if (!output_filename) {
-            printf("Error: Could not create output filename for %s\n", 
-                   entry->d_name);
-            error_count++;
-            continue;
+    BatchContext batch = {
+        .options = options,
+        .conversion = options->options,
+        .names = names,
+        .files = (BatchFileState*)calloc(count ? count : 1, sizeof(BatchFileState)),
+        .converted = (bool*)calloc(count ? count : 1, sizeof(bool)),
+        // With a batch flush, originals are only deleted once their
+        // conversions are on disk
+        .defer_removal = options->options.sync == OUTPUT_SYNC_BATCH &&
+                         !options->replace_originals
+    };
+    atomic_init(&batch.processed_count, 0);
+    atomic_init(&batch.error_count, 0);
+    atomic_init(&batch.read_wait_ns, 0);
+    atomic_init(&batch.decode_ns, 0);
+    atomic_init(&batch.analyze_ns, 0);
+    atomic_init(&batch.encode_ns, 0);
+    atomic_init(&batch.verify_ns, 0);
+    atomic_init(&batch.memory_wait_ns, 0);
+    stage_samples_init(&batch.samples);
+    memory_budget_init(&batch.memory, options->mem_limit > 0 ? options->mem_limit
+                                                             : memory_limit_default());
+    if (options->mem_limit > 0 && batch.conversion.spill_threshold == 0) {
+        batch.conversion.spill_threshold = options->mem_limit / SPILL_MEMORY_SHARE;
+    }
+
+    // Files are converted in parallel while the next ones are read ahead
+    int threads = options->threads > 0 ? options->threads : parallel_cpu_count();
+    if ((size_t)threads > count) threads = count > 0 ? (int)count : 1;
+
+    // Cores left over by a small batch encode a file's targets side by side
+    int cores = options->threads > 0 ? options->threads : parallel_cpu_count();
+    size_t targets = options->auto_format ? 1 : options->target_count;
+    batch.target_threads = cores / threads;
+    if (batch.target_threads < 1) batch.target_threads = 1;
+    if ((size_t)batch.target_threads > targets) batch.target_threads = (int)targets;
+
+    // Workers already keep every core busy, so neither the threaded codecs
+    // nor the quality search need to split their work across cores as well
+    int encoders = threads * batch.target_threads;
+    if (encoders > 1) {
+        codec_limit_threads(&batch.conversion, 1);
+    }
+    if (encoders > 1 && batch.conversion.quality_target.threads == 0) {
+        batch.conversion.quality_target.threads = 1;
+    }
+
+    // Probe every file and start with the longest jobs, using the stage
+    // costs measured by earlier batches
+    StageCosts costs;
+    stage_costs_load(&costs);
+    uint64_t start = now_ns();
+    bool planned = count > 1 && batch.files && plan_batch(&batch, count, threads, &costs);
+    double plan_seconds = (now_ns() - start) / 1e9;
+
+    // Verification runs alongside the encoders, which move on to the next
+    // file as soon as an output is written
+    int wanted = encoders / VERIFY_WORKERS_PER_ENCODER + 1;
+    pthread_t* verifier_threads = options->verify && count > 0 ?
+        (pthread_t*)malloc(wanted * sizeof(pthread_t)) : NULL;
+    if (verifier_threads && verify_queue_init(&batch.verify_queue, (size_t)encoders * 2)) {
+        while (batch.verifiers < wanted &&
+               pthread_create(&verifier_threads[batch.verifiers], NULL, verify_worker, &batch) == 0) {
+            batch.verifiers++;
         }
+    }
 
-        // Load and convert the image
-        ImageFormat input_format = detect_format(entry->d_name);
-        ImageData* img = NULL;
-
-        switch (input_format) {
-            case FORMAT_PNG:
-                img = load_png(entry->d_name);
-                break;
-            case FORMAT_WEBP:
-                img = load_webp(entry->d_name);
-                break;
-            case FORMAT_JPG:
-                img = load_jpeg(entry->d_name);
-                break;
-            case FORMAT_AVIF:
-                img = load_avif(entry->d_name);
-                break;
-            case FORMAT_HEIC:
-                img = load_heic(entry->d_name);
-                break;
-            default:
-                printf("Skipping unsupported format: %s\n", entry->d_name);
-                free(output_filename);
-                continue;
+    IoBackend backend = options->io_backend;
+    CodecContextStats codecs_before;
+    codec_context_stats(&codecs_before);
+    start = now_ns();
+    if (count > 0 && batch.files && batch.converted) {
+        batch.prefetcher = file_prefetcher_create(options->io_backend,
+                                                  (const char* const*)names, count,
+                                                  (size_t)threads * 2);
+        if (batch.prefetcher) {
+            backend = file_prefetcher_backend(batch.prefetcher);
+            parallel_for(count, threads, convert_batch_file, &batch);
+            file_prefetcher_destroy(batch.prefetcher);
+        } else {
+            printf("Error: Could not start reading files\n");
         }
+    }
 
-        if (!img) {
-            printf("Error: Could not load image %s\n", entry->d_name);
-            free(output_filename);
-            error_count++;
-            continue;
+    if (batch.verify_queue.jobs) {
+        verify_queue_close(&batch.verify_queue);
+        for (int i = 0; i < batch.verifiers; i++) {
+            pthread_join(verifier_threads[i], NULL);
         }
+        verify_queue_destroy(&batch.verify_queue);
+    }
+    free(verifier_threads);
+    double wall = (now_ns() - start) / 1e9;
 
-        // Save in new format
-        bool save_success = false;
-        switch (options->target_format) {
-            case FORMAT_PNG:
-                save_success = save_png(output_filename, img, &options->options);
-                break;
-            case FORMAT_WEBP:
-                save_success = save_webp(output_filename, img, &options->options);
-                break;
-            case FORMAT_JPG:
-                save_success = save_jpeg(output_filename, img, &options->options);
-                break;
-            case FORMAT_AVIF:
-                save_success = save_avif(output_filename, img, &options->options);
-                break;
-            case FORMAT_HEIC:
-                save_success = save_heic(output_filename, img, &options->options);
-                break;
-            default:
-                printf("Error: Unsupported output format\n");
-                save_success = false;
-                break;
-        }
-
-        // Cleanup image data
-        free_image_data(img);
-        free(img);
+    // Workers' codec contexts went with their threads; this one took part too
+    codec_contexts_release();
+    CodecContextStats codecs_after;
+    codec_context_stats(&codecs_after);
+    uint64_t codecs_reused;
+    double codec_saved_ns = codec_context_saved_ns(&codecs_before, &codecs_after, &codecs_reused);
 
-        if (save_success) {
-            if (options->replace_originals) {
-                // Remove original and rename temp file
-                if (remove(entry->d_name) != 0) {
-                    printf("Error: Could not remove original file %s\n", 
-                           entry->d_name);
-                    remove(output_filename); // Clean up temp file
-                    free(output_filename);
-                    error_count++;
-                    continue;
-                }
-                if (rename(output_filename, entry->d_name) != 0) {
-                    printf("Error: Could not rename temp file %s\n", 
-                           output_filename);
-                    free(output_filename);
-                    error_count++;
-                    continue;
-                }
-            } else {
-                // If not replacing, but conversion succeeded, delete the original
-                if (remove(entry->d_name) != 0) {
-                    printf("Warning: Could not remove original file %s\n", 
-                           entry->d_name);
-                    // Don't count this as an error since conversion succeeded
-                }
-            }
-            processed_count++;
-            printf("Successfully converted: %s\n", entry->d_name);
-        } else {
-            printf("Error: Failed to convert %s\n", entry->d_name);
-            if (options->replace_originals) {
-                remove(output_filename); // Clean up temp file
-            }
-            error_count++;
+    int processed_count = atomic_load(&batch.processed_count);
+    int error_count = atomic_load(&batch.error_count);
+
+    // Later batches are planned with what this one measured
+    if (processed_count > 0) {
+        stage_costs_learn(&costs, &batch.samples);
+        stage_costs_save(&costs);
+    }
+
+    // One filesystem flush covers every file written above
+    bool flushed = true;
+    if (options->options.sync == OUTPUT_SYNC_BATCH && processed_count > 0) {
+        flushed = output_sync_filesystem(".");
+        if (!flushed) {
+            printf("Warning: Could not flush converted files to disk: %s\n", strerror(errno));
         }
+    }
 
-        free(output_filename);
+    for (size_t i = 0; i < count; i++) {
+        if (batch.converted && batch.converted[i]) {
+            if (!flushed) {
+                printf("Warning: Keeping original file %s\n", names[i]);
+            } else if (remove(names[i]) != 0) {
+                printf("Warning: Could not remove original file %s\n", names[i]);
+            }
+        }
+        free(names[i]);
     }
+    free(names);
+    free(batch.files);
+    free(batch.converted);
+    memory_budget_destroy(&batch.memory);
 
     // Change back to original directory
     if (chdir(original_dir) != 0) {
         printf("Warning: Could not change back to original directory\n");
     }
 
-    closedir(dir);
-
     printf("\nBatch processing complete:\n");
     printf("Successfully processed: %d files\n", processed_count);
     printf("Errors encountered: %d files\n", error_count);
+    if (batch.target_threads > 1) {
+        printf("Workers: %d, %d encoders per file, I/O: %s\n", threads, batch.target_threads,
+               io_backend_to_string(backend));
+    } else {
+        printf("Workers: %d, I/O: %s\n", threads, io_backend_to_string(backend));
+    }
+    printf("Time: %.2fs (summed over workers: read wait %.2fs, decode %.2fs, encode %.2fs)\n",
+           wall, atomic_load(&batch.read_wait_ns) / 1e9,
+           atomic_load(&batch.decode_ns) / 1e9, atomic_load(&batch.encode_ns) / 1e9);
+    if (planned) {
+        printf("Plan: %zu files probed in %.2fs, largest first\n", count, plan_seconds);
+    }
+    printf("Memory: limit %.0f MiB, peak %.1f MiB estimated in flight, waited %.2fs\n",
+           batch.memory.limit / 1048576.0, batch.memory.peak / 1048576.0,
+           atomic_load(&batch.memory_wait_ns) / 1e9);
+    if (codecs_reused > 0) {
+        printf("Codec contexts: %llu reused across files, ~%.1f ms of setup saved\n",
+               (unsigned long long)codecs_reused, codec_saved_ns / 1e6);
+    }
+    if (options->auto_format) {
+        printf("Format selection: %.2fs\n", atomic_load(&batch.analyze_ns) / 1e9);
+    }
+    if (options->verify) {
+        printf("Verification: %.2fs\n", atomic_load(&batch.verify_ns) / 1e9);
+    }
 
     return processed_count;
 }
@@ -0,0 +1,318 @@
+#include "../include/codec.h"
+#include "../include/codec_backend.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// Factors libjpeg's DCT scaling decodes to (N/8 for N = 1, 2, 4 and 8)
+#define JPEG_SCALE_FACTORS ((1u << 1) | (1u << 2) | (1u << 4) | (1u << 8))
+// libwebp's rescaler takes any size
+#define ANY_SCALE_FACTOR (~1u)
+// Bytes decode_scaled() reads for the WebP header
+#define WEBP_HEADER_BYTES 64
+
+static const char* const png_extensions[] = { "png", NULL };
+static const char* const jpeg_extensions[] = { "jpg", "jpeg", NULL };
+static const char* const webp_extensions[] = { "webp", NULL };
+static const char* const avif_extensions[] = { "avif", NULL };
+static const char* const heic_extensions[] = { "heic", NULL };
+
+static bool probe_png(const unsigned char* header, size_t size) {
+    return size >= 8 && memcmp(header, "\x89PNG\r\n\x1a\n", 8) == 0;
+}
+
+static bool probe_jpeg(const unsigned char* header, size_t size) {
+    return size >= 8 && header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF;
+}
+
+static bool probe_webp(const unsigned char* header, size_t size) {
+    return size >= 12 && memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WEBP", 4) == 0;
+}
+
+// An 'ftyp' box with the avif (still) or avis (sequence) brand
+static bool probe_avif(const unsigned char* header, size_t size) {
+    if (size < 32) return false;
+    for (size_t i = 0; i < size - 8; i++) {
+        if (memcmp(header + i, "ftyp", 4) == 0 &&
+            (memcmp(header + i + 4, "avif", 4) == 0 || memcmp(header + i + 4, "avis", 4) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool png_is_lossless(const ConversionOptions* options) {
+    (void)options;
+    return true;
+}
+
+static bool webp_is_lossless(const ConversionOptions* options) {
+    return options && options->webp_options.lossless && options->webp_options.near_lossless >= 100;
+}
+
+// JPEG is always lossy, and AVIF and HEIC go through YCbCr even in their
+// lossless modes
+static bool never_lossless(const ConversionOptions* options) {
+    (void)options;
+    return false;
+}
+
+static bool jpeg_has_quality(const ConversionOptions* options) {
+    return options != NULL;
+}
+
+static bool webp_has_quality(const ConversionOptions* options) {
+    return options && !options->webp_options.lossless && options->webp_options.near_lossless >= 100;
+}
+
+static bool avif_has_quality(const ConversionOptions* options) {
+    return options && !options->avif_options.lossless;
+}
+
+static bool heic_has_quality(const ConversionOptions* options) {
+    return options && !options->heic_options.lossless;
+}
+
+static void limit_png_threads(ConversionOptions* options, int threads) {
+    if (options->png_options.threads == 0) options->png_options.threads = threads;
+}
+
+// libwebp can only add one worker thread to a call, so that is all there is
+// to turn off
+static void limit_webp_threads(ConversionOptions* options, int threads) {
+    if (threads > 1) return;
+    options->webp_options.thread_level = false;
+    options->webp_options.decode_threads = false;
+}
+
+static void limit_avif_threads(ConversionOptions* options, int threads) {
+    if (options->avif_options.threads == 0) options->avif_options.threads = threads;
+}
+
+// The x265 pool behind the HEIC encoder is left as it is; only decoding is limited
+static void limit_heic_threads(ConversionOptions* options, int threads) {
+    if (options->heic_options.decoder_threads == 0) options->heic_options.decoder_threads = threads;
+}
+
+// WebP, AVIF and HEIC forward to their modules
+
+static ImageData* backend_load_memory(ImageFormat format, const char* name,
+                                      const unsigned char* data, size_t size,
+                                      const ConversionOptions* options) {
+    const CodecBackend* backend = codec_backend(format);
+    return backend ? backend->load_memory(name, data, size, options) : NULL;
+}
+
+static bool backend_read_dimensions(ImageFormat format, const unsigned char* data, size_t size,
+                                    size_t* width, size_t* height) {
+    const CodecBackend* backend = codec_backend(format);
+    return backend && backend->read_dimensions(data, size, width, height);
+}
+
+static bool backend_is_animated(ImageFormat format, const char* filepath) {
+    const CodecBackend* backend = codec_backend(format);
+    return backend && backend->is_animated && backend->is_animated(filepath);
+}
+
+static ImageData* load_webp_memory(const char* name, const unsigned char* data, size_t size,
+                                   const ConversionOptions* options) {
+    return backend_load_memory(FORMAT_WEBP, name, data, size, options);
+}
+
+static bool read_webp_dimensions(const unsigned char* data, size_t size,
+                                 size_t* width, size_t* height) {
+    return backend_read_dimensions(FORMAT_WEBP, data, size, width, height);
+}
+
+static bool is_webp_animated(const char* filepath) {
+    return backend_is_animated(FORMAT_WEBP, filepath);
+}
+
+// Has the WebP decoder's rescaler produce the smaller size directly
+static ImageData* load_webp_scaled(const char* filepath, size_t factor,
+                                   const ConversionOptions* options) {
+    unsigned char header[WEBP_HEADER_BYTES];
+    FILE* fp = fopen(filepath, "rb");
+    if (!fp) {
+        printf("Error: Could not open WebP file %s\n", filepath);
+        return NULL;
+    }
+    size_t got = fread(header, 1, sizeof(header), fp);
+    fclose(fp);
+
+    size_t width, height;
+    if (!read_webp_dimensions(header, got, &width, &height)) return NULL;
+
+    ConversionOptions scaled;
+    if (options) {
+        scaled = *options;
+    } else {
+        init_conversion_options(&scaled);
+    }
+    scaled.webp_options.decode_width = (int)((width + factor - 1) / factor);
+    scaled.webp_options.decode_height = (int)((height + factor - 1) / factor);
+    return load_webp(filepath, &scaled);
+}
+
+static ImageData* load_avif_memory(const char* name, const unsigned char* data, size_t size,
+                                   const ConversionOptions* options) {
+    return backend_load_memory(FORMAT_AVIF, name, data, size, options);
+}
+
+static bool read_avif_dimensions(const unsigned char* data, size_t size,
+                                 size_t* width, size_t* height) {
+    return backend_read_dimensions(FORMAT_AVIF, data, size, width, height);
+}
+
+static bool is_avif_animated(const char* filepath) {
+    return backend_is_animated(FORMAT_AVIF, filepath);
+}
+
+static ImageData* load_heic_memory(const char* name, const unsigned char* data, size_t size,
+                                   const ConversionOptions* options) {
+    return backend_load_memory(FORMAT_HEIC, name, data, size, options);
+}
+
+static bool read_heic_dimensions(const unsigned char* data, size_t size,
+                                 size_t* width, size_t* height) {
+    return backend_read_dimensions(FORMAT_HEIC, data, size, width, height);
+}
+
+// In the order signatures are probed
+static const Codec codecs[] = {
+    {
+        .format = FORMAT_PNG,
+        .name = "PNG",
+        .extensions = png_extensions,
+        .capabilities = CODEC_CAP_STREAMS_DECODE | CODEC_CAP_STREAMS_ENCODE |
+                        CODEC_CAP_THREADED_ENCODE,
+        .probe = probe_png,
+        .read_dimensions = read_png_dimensions,
+        .decode = load_png,
+        .decode_memory = load_png_memory,
+        .encode = save_png,
+        .is_lossless = png_is_lossless,
+        .limit_threads = limit_png_threads
+    },
+    {
+        .format = FORMAT_JPG,
+        .name = "JPG",
+        .extensions = jpeg_extensions,
+        .capabilities = CODEC_CAP_DECODE_SCALED | CODEC_CAP_STREAMS_ENCODE | CODEC_CAP_TRANSCODE |
+                        CODEC_CAP_REUSES_CONTEXTS,
+        .scale_factors = JPEG_SCALE_FACTORS,
+        .probe = probe_jpeg,
+        .read_dimensions = read_jpeg_dimensions,
+        .decode = load_jpeg,
+        .decode_memory = load_jpeg_memory,
+        .decode_scaled = load_jpeg_scaled,
+        .encode = save_jpeg,
+        .is_lossless = never_lossless,
+        .has_quality = jpeg_has_quality,
+        .transcode = transcode_jpeg
+    },
+    {
+        .format = FORMAT_WEBP,
+        .name = "WEBP",
+        .extensions = webp_extensions,
+        .capabilities = CODEC_CAP_DECODE_SCALED | CODEC_CAP_THREADED_DECODE |
+                        CODEC_CAP_THREADED_ENCODE | CODEC_CAP_ANIMATION | CODEC_CAP_LOADABLE,
+        .scale_factors = ANY_SCALE_FACTOR,
+        .probe = probe_webp,
+        .read_dimensions = read_webp_dimensions,
+        .decode = load_webp,
+        .decode_memory = load_webp_memory,
+        .decode_scaled = load_webp_scaled,
+        .encode = save_webp,
+        .is_lossless = webp_is_lossless,
+        .has_quality = webp_has_quality,
+        .is_animated = is_webp_animated,
+        .limit_threads = limit_webp_threads
+    },
+    {
+        .format = FORMAT_AVIF,
+        .name = "AVIF",
+        .extensions = avif_extensions,
+        .capabilities = CODEC_CAP_THREADED_DECODE | CODEC_CAP_THREADED_ENCODE |
+                        CODEC_CAP_ANIMATION | CODEC_CAP_LOADABLE,
+        .probe = probe_avif,
+        .read_dimensions = read_avif_dimensions,
+        .decode = load_avif,
+        .decode_memory = load_avif_memory,
+        .encode = save_avif,
+        .is_lossless = never_lossless,
+        .has_quality = avif_has_quality,
+        .is_animated = is_avif_animated,
+        .limit_threads = limit_avif_threads
+    },
+    {
+        // Told apart by extension only
+        .format = FORMAT_HEIC,
+        .name = "HEIC",
+        .extensions = heic_extensions,
+        .capabilities = CODEC_CAP_DECODE_CROPPED | CODEC_CAP_THREADED_DECODE |
+                        CODEC_CAP_THREADED_ENCODE | CODEC_CAP_REUSES_CONTEXTS | CODEC_CAP_LOADABLE,
+        .read_dimensions = read_heic_dimensions,
+        .decode = load_heic,
+        .decode_memory = load_heic_memory,
+        .encode = save_heic,
+        .is_lossless = never_lossless,
+        .has_quality = heic_has_quality,
+        .limit_threads = limit_heic_threads
+    }
+};
+
+#define CODEC_COUNT (sizeof(codecs) / sizeof(codecs[0]))
+
+const Codec* codec_for_format(ImageFormat format) {
+    for (size_t i = 0; i < CODEC_COUNT; i++) {
+        if (codecs[i].format == format) return &codecs[i];
+    }
+    return NULL;
+}
+
+const Codec* codec_for_extension(const char* ext) {
+    if (!ext) return NULL;
+    for (size_t i = 0; i < CODEC_COUNT; i++) {
+        for (const char* const* known = codecs[i].extensions; *known; known++) {
+            if (strcasecmp(ext, *known) == 0) return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+const Codec* codec_probe(const unsigned char* header, size_t size) {
+    for (size_t i = 0; i < CODEC_COUNT; i++) {
+        if (codecs[i].probe && codecs[i].probe(header, size)) return &codecs[i];
+    }
+    return NULL;
+}
+
+size_t codec_count(void) {
+    return CODEC_COUNT;
+}
+
+const Codec* codec_at(size_t index) {
+    return index < CODEC_COUNT ? &codecs[index] : NULL;
+}
+
+bool codec_has(ImageFormat format, unsigned capabilities) {
+    const Codec* codec = codec_for_format(format);
+    return codec && (codec->capabilities & capabilities) == capabilities;
+}
+
+void codec_limit_threads(ConversionOptions* options, int threads) {
+    for (size_t i = 0; i < CODEC_COUNT; i++) {
+        if (codecs[i].capabilities & (CODEC_CAP_THREADED_DECODE | CODEC_CAP_THREADED_ENCODE)) {
+            codecs[i].limit_threads(options, threads);
+        }
+    }
+}
+
+size_t codec_scale_factor(const Codec* codec, size_t wanted) {
+    if (!codec || !(codec->capabilities & CODEC_CAP_DECODE_SCALED)) return 1;
+    for (size_t factor = wanted < 31 ? wanted : 31; factor > 1; factor--) {
+        if ((codec->scale_factors & (1u << factor)) && wanted % factor == 0) return factor;
+    }
+    return 1;
+}
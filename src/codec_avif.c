@@ -0,0 +1,465 @@
+#include "../include/codec_backend.h"
+#include "../include/output_writer.h"
+#include "../include/parallel.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avif/avif.h>
+
+// libavif's thread limit for one image or sequence
+static int avif_threads(const ConversionOptions* options) {
+    return options && options->avif_options.threads > 0 ? options->avif_options.threads
+                                                        : parallel_cpu_count();
+}
+
+// Decodes the primary image from a decoder whose IO is already set up
+static ImageData* read_avif(avifDecoder* decoder, const ConversionOptions* options) {
+    // Parse image
+    avifResult result = avifDecoderParse(decoder);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not parse AVIF file: %s\n", avifResultToString(result));
+        return NULL;
+    }
+
+    // Read image
+    result = avifDecoderNextImage(decoder);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not decode AVIF image: %s\n", avifResultToString(result));
+        return NULL;
+    }
+
+    // Allocate our image structure
+    ImageData* img = create_decoded_image(decoder->image->width, decoder->image->height, options);
+    if (!img) {
+        return NULL;
+    }
+
+    // Convert AVIF to RGBA
+    avifRGBImage rgb;
+    avifRGBImageSetDefaults(&rgb, decoder->image);
+    rgb.format = AVIF_RGB_FORMAT_RGBA;
+    rgb.depth = 8;
+    rgb.pixels = img->data;
+    rgb.rowBytes = img->stride;
+
+    result = avifImageYUVToRGB(decoder->image, &rgb);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not convert AVIF to RGB: %s\n", avifResultToString(result));
+        free_image_data(img);
+        free(img);
+        return NULL;
+    }
+
+    const avifImage* image = decoder->image;
+    if (image->exif.size > 0) {
+        set_exif_metadata(img, image->exif.data, image->exif.size);
+    }
+    if (image->icc.size > 0) {
+        set_image_metadata(img, IMAGE_METADATA_ICC, image->icc.data, image->icc.size);
+    }
+    if (image->xmp.size > 0) {
+        set_image_metadata(img, IMAGE_METADATA_XMP, image->xmp.data, image->xmp.size);
+    }
+
+    return apply_exif_orientation(img, options);
+}
+
+static ImageData* load_avif_file(const char* filepath, const ConversionOptions* options) {
+    // Create decoder
+    avifDecoder* decoder = avifDecoderCreate();
+    if (!decoder) {
+        printf("Error: Could not create AVIF decoder\n");
+        return NULL;
+    }
+
+    decoder->maxThreads = avif_threads(options);
+
+    // Read file
+    avifResult result = avifDecoderSetIOFile(decoder, filepath);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not open AVIF file: %s\n", avifResultToString(result));
+        avifDecoderDestroy(decoder);
+        return NULL;
+    }
+
+    ImageData* img = read_avif(decoder, options);
+
+    // Cleanup decoder
+    avifDecoderDestroy(decoder);
+
+    return img;
+}
+
+static ImageData* load_avif_memory(const char* name, const unsigned char* data, size_t size,
+                                   const ConversionOptions* options) {
+    (void)name;
+    avifDecoder* decoder = avifDecoderCreate();
+    if (!decoder) return NULL;
+    decoder->maxThreads = avif_threads(options);
+
+    ImageData* img = NULL;
+    if (avifDecoderSetIOMemory(decoder, data, size) == AVIF_RESULT_OK) {
+        img = read_avif(decoder, options);
+    }
+    avifDecoderDestroy(decoder);
+    return img;
+}
+
+static bool read_avif_dimensions(const unsigned char* data, size_t size,
+                                 size_t* width, size_t* height) {
+    // Parsing reads the container only; nothing is decoded yet
+    avifDecoder* decoder = avifDecoderCreate();
+    if (!decoder) return false;
+    bool parsed = avifDecoderSetIOMemory(decoder, data, size) == AVIF_RESULT_OK &&
+                  avifDecoderParse(decoder) == AVIF_RESULT_OK;
+    if (parsed) {
+        *width = decoder->image->width;
+        *height = decoder->image->height;
+    }
+    avifDecoderDestroy(decoder);
+    return parsed;
+}
+
+static void configure_avif_encoder(avifEncoder* encoder, const ConversionOptions* options) {
+    encoder->maxThreads = avif_threads(options);
+    if (options) {
+        encoder->speed = options->avif_options.speed;
+        encoder->minQuantizer = encoder->maxQuantizer = 
+            options->avif_options.lossless ? AVIF_QUANTIZER_LOSSLESS : 
+            (63 - ((options->quality * 63) / 100));
+    } else {
+        encoder->speed = 6; // Default speed
+        encoder->minQuantizer = encoder->maxQuantizer = 25; // ~90% quality
+    }
+}
+
+// Converts RGBA pixels to a YUV 4:4:4 image for the encoder, with the
+// metadata (if not NULL) attached
+static avifImage* create_avif_image(const ImageData* img, const ImageBlob* metadata) {
+    avifImage* avifImg = avifImageCreate(img->width, img->height, 8, AVIF_PIXEL_FORMAT_YUV444);
+    if (!avifImg) {
+        printf("Error: Could not create AVIF image\n");
+        return NULL;
+    }
+
+    // Set color profile
+    avifImg->colorPrimaries = AVIF_COLOR_PRIMARIES_BT709;
+    avifImg->transferCharacteristics = AVIF_TRANSFER_CHARACTERISTICS_SRGB;
+    avifImg->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_BT709;
+
+    // Metadata is attached before encoding so it lands in the container
+    if (metadata) {
+        const ImageBlob* exif = &metadata[IMAGE_METADATA_EXIF];
+        const ImageBlob* icc = &metadata[IMAGE_METADATA_ICC];
+        const ImageBlob* xmp = &metadata[IMAGE_METADATA_XMP];
+        if ((exif->data && avifImageSetMetadataExif(avifImg, exif->data, exif->size) != AVIF_RESULT_OK) ||
+            (icc->data && avifImageSetProfileICC(avifImg, icc->data, icc->size) != AVIF_RESULT_OK) ||
+            (xmp->data && avifImageSetMetadataXMP(avifImg, xmp->data, xmp->size) != AVIF_RESULT_OK)) {
+            printf("Warning: Could not attach metadata to AVIF image\n");
+        }
+    }
+
+    // Set pixel format and depth
+    avifImg->yuvFormat = AVIF_PIXEL_FORMAT_YUV444;
+    avifImg->depth = 8;
+
+    // Set up RGB conversion
+    avifRGBImage rgb;
+    avifRGBImageSetDefaults(&rgb, avifImg);
+    rgb.format = AVIF_RGB_FORMAT_RGBA;
+    rgb.depth = 8;
+    rgb.pixels = img->data;
+    rgb.rowBytes = img->stride;
+
+    // Convert RGBA to YUV
+    avifResult result = avifImageRGBToYUV(avifImg, &rgb);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not convert RGB to YUV: %s\n", avifResultToString(result));
+        avifImageDestroy(avifImg);
+        return NULL;
+    }
+    return avifImg;
+}
+
+static bool write_avif_file(const char* filepath, const avifRWData* output) {
+    FILE* f = fopen(filepath, "wb");
+    if (!f) {
+        printf("Error: Could not open output file: %s\n", filepath);
+        return false;
+    }
+
+    output_preallocate(f, output->size);
+    size_t bytesWritten = fwrite(output->data, 1, output->size, f);
+    if (fclose(f) != 0) {
+        bytesWritten = 0;
+    }
+
+    if (bytesWritten != output->size) {
+        printf("Error: Failed to write all data to file\n");
+        return false;
+    }
+    return true;
+}
+
+static bool save_avif_file(const char* filepath, const ImageData* img, const ConversionOptions* options) {
+    if (!img || !img->data || !filepath) {
+        printf("Error: Invalid input parameters\n");
+        return false;
+    }
+
+    // Create encoder
+    avifEncoder* encoder = avifEncoderCreate();
+    if (!encoder) {
+        printf("Error: Could not create AVIF encoder\n");
+        return false;
+    }
+
+    // Configure encoder based on options
+    configure_avif_encoder(encoder, options);
+
+    // Create image
+    printf("Converting RGBA to YUV...\n");
+    avifImage* avifImg = create_avif_image(img, (!options || options->maintain_exif) ?
+                                                img->metadata : NULL);
+    if (!avifImg) {
+        avifEncoderDestroy(encoder);
+        return false;
+    }
+
+    // Encode image
+    printf("Encoding AVIF...\n");
+    avifRWData output = AVIF_DATA_EMPTY;
+    avifResult result = avifEncoderWrite(encoder, avifImg, &output);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not encode AVIF: %s\n", avifResultToString(result));
+        avifImageDestroy(avifImg);
+        avifEncoderDestroy(encoder);
+        return false;
+    }
+
+    // Write to file
+    printf("Writing AVIF file...\n");
+    if (!write_avif_file(filepath, &output)) {
+        avifRWDataFree(&output);
+        avifImageDestroy(avifImg);
+        avifEncoderDestroy(encoder);
+        return false;
+    }
+
+    // Cleanup
+    avifRWDataFree(&output);
+    avifImageDestroy(avifImg);
+    avifEncoderDestroy(encoder);
+
+    printf("Successfully encoded and saved AVIF file\n");
+    return true;
+}
+
+
+// Frames of an AVIF sequence, decoded one at a time
+struct AnimationDecoder {
+    avifDecoder* decoder;
+    size_t next_index;
+};
+
+static void close_avif_animation(AnimationDecoder* decoder) {
+    if (!decoder) return;
+    if (decoder->decoder) avifDecoderDestroy(decoder->decoder);
+    free(decoder);
+}
+
+static AnimationDecoder* open_avif_animation(const char* filepath, const ConversionOptions* options,
+                                             AnimationInfo* info) {
+    AnimationDecoder* decoder = (AnimationDecoder*)calloc(1, sizeof(AnimationDecoder));
+    if (!decoder) return NULL;
+    decoder->decoder = avifDecoderCreate();
+    if (!decoder->decoder) {
+        printf("Error: Could not create AVIF decoder\n");
+        close_avif_animation(decoder);
+        return NULL;
+    }
+    decoder->decoder->maxThreads = avif_threads(options);
+
+    avifResult result = avifDecoderSetIOFile(decoder->decoder, filepath);
+    if (result == AVIF_RESULT_OK) result = avifDecoderParse(decoder->decoder);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not parse AVIF file: %s\n", avifResultToString(result));
+        close_avif_animation(decoder);
+        return NULL;
+    }
+
+    info->width = decoder->decoder->image->width;
+    info->height = decoder->decoder->image->height;
+    info->frame_count = (size_t)decoder->decoder->imageCount;
+    info->loop_count = 0;
+#if AVIF_VERSION >= 1000000
+    // AVIF counts repetitions after the first play
+    int repetitions = decoder->decoder->repetitionCount;
+    info->loop_count = repetitions >= 0 ? repetitions + 1 : 0;
+#endif
+    return decoder;
+}
+
+// Frames stay YUV here, so converting them can be spread over threads
+static bool read_avif_frame(AnimationDecoder* decoder, AnimationFrame* frame, bool* failed) {
+    memset(frame, 0, sizeof(*frame));
+    frame->index = decoder->next_index;
+    *failed = false;
+
+    avifResult result = avifDecoderNextImage(decoder->decoder);
+    if (result == AVIF_RESULT_NO_IMAGES_REMAINING) return false;
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not decode AVIF frame %zu: %s\n", frame->index + 1,
+               avifResultToString(result));
+        *failed = true;
+        return false;
+    }
+    frame->duration_ms = (int)(decoder->decoder->imageTiming.duration * 1000.0 + 0.5);
+
+    // The decoder reuses its image for the next frame, so it is copied out
+    avifImage* yuv = avifImageCreateEmpty();
+    if (!yuv || avifImageCopy(yuv, decoder->decoder->image, AVIF_PLANES_ALL) != AVIF_RESULT_OK) {
+        if (yuv) avifImageDestroy(yuv);
+        *failed = true;
+        return false;
+    }
+    frame->pending = yuv;
+    decoder->next_index++;
+    return true;
+}
+
+static void free_avif_frame(void* pending) {
+    avifImageDestroy((avifImage*)pending);
+}
+
+// Turns a decoded frame into RGBA; the first frame keeps the metadata
+static bool convert_avif_frame(AnimationFrame* frame) {
+    const avifImage* yuv = (const avifImage*)frame->pending;
+    frame->image = create_image_data(yuv->width, yuv->height);
+    bool converted = frame->image != NULL;
+    if (converted) {
+        avifRGBImage rgb;
+        avifRGBImageSetDefaults(&rgb, yuv);
+        rgb.format = AVIF_RGB_FORMAT_RGBA;
+        rgb.depth = 8;
+        rgb.pixels = frame->image->data;
+        rgb.rowBytes = frame->image->stride;
+        avifResult result = avifImageYUVToRGB(yuv, &rgb);
+        if (result != AVIF_RESULT_OK) {
+            printf("Error: Could not convert AVIF frame %zu to RGB: %s\n", frame->index + 1,
+                   avifResultToString(result));
+            free_image_data(frame->image);
+            free(frame->image);
+            frame->image = NULL;
+            converted = false;
+        }
+    }
+
+    if (converted && frame->index == 0) {
+        if (yuv->exif.size > 0) set_exif_metadata(frame->image, yuv->exif.data, yuv->exif.size);
+        if (yuv->icc.size > 0) {
+            set_image_metadata(frame->image, IMAGE_METADATA_ICC, yuv->icc.data, yuv->icc.size);
+        }
+        if (yuv->xmp.size > 0) {
+            set_image_metadata(frame->image, IMAGE_METADATA_XMP, yuv->xmp.data, yuv->xmp.size);
+        }
+    }
+
+    free_avif_frame(frame->pending);
+    frame->pending = NULL;
+    return converted;
+}
+
+static bool is_avif_animated(const char* filepath) {
+    avifDecoder* decoder = avifDecoderCreate();
+    if (!decoder) return false;
+    bool animated = avifDecoderSetIOFile(decoder, filepath) == AVIF_RESULT_OK &&
+                    avifDecoderParse(decoder) == AVIF_RESULT_OK && decoder->imageCount > 1;
+    avifDecoderDestroy(decoder);
+    return animated;
+}
+
+// Frames encoded into an AVIF sequence in memory
+struct AnimationEncoder {
+    avifEncoder* encoder;
+    bool keep_metadata;             // For the first frame; libavif takes it from there
+};
+
+static void close_avif_animation_encoder(AnimationEncoder* encoder) {
+    if (!encoder) return;
+    if (encoder->encoder) avifEncoderDestroy(encoder->encoder);
+    free(encoder);
+}
+
+static AnimationEncoder* start_avif_animation(const ImageData* first, int loop_count,
+                                              const ConversionOptions* options) {
+    (void)first;
+    AnimationEncoder* encoder = (AnimationEncoder*)calloc(1, sizeof(AnimationEncoder));
+    if (!encoder) return NULL;
+    encoder->encoder = avifEncoderCreate();
+    if (!encoder->encoder) {
+        printf("Error: Could not create AVIF encoder\n");
+        close_avif_animation_encoder(encoder);
+        return NULL;
+    }
+    configure_avif_encoder(encoder->encoder, options);
+    encoder->encoder->timescale = 1000;     // Durations in milliseconds
+#if AVIF_VERSION >= 1000000
+    encoder->encoder->repetitionCount = loop_count > 0 ? loop_count - 1
+                                                       : AVIF_REPETITION_COUNT_INFINITE;
+#else
+    (void)loop_count;
+#endif
+    encoder->keep_metadata = !options || options->maintain_exif;
+    return encoder;
+}
+
+static bool add_avif_frame(AnimationEncoder* encoder, const ImageData* frame, int duration_ms) {
+    avifImage* image = create_avif_image(frame, encoder->keep_metadata ? frame->metadata : NULL);
+    encoder->keep_metadata = false;
+    if (!image) return false;
+
+    avifResult result = avifEncoderAddImage(encoder->encoder, image, (uint64_t)duration_ms,
+                                            AVIF_ADD_IMAGE_FLAG_NONE);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not encode AVIF frame: %s\n", avifResultToString(result));
+    }
+    avifImageDestroy(image);
+    return result == AVIF_RESULT_OK;
+}
+
+static bool finish_avif_animation(AnimationEncoder* encoder, const char* filepath) {
+    avifRWData output = AVIF_DATA_EMPTY;
+    avifResult result = avifEncoderFinish(encoder->encoder, &output);
+    bool written = result == AVIF_RESULT_OK && write_avif_file(filepath, &output);
+    if (result != AVIF_RESULT_OK) {
+        printf("Error: Could not encode AVIF sequence: %s\n", avifResultToString(result));
+    }
+    avifRWDataFree(&output);
+    return written;
+}
+
+static const CodecBackend avif_backend = {
+    .abi_version = CODEC_BACKEND_ABI_VERSION,
+    .format = FORMAT_AVIF,
+    .name = "avif",
+    .load = load_avif_file,
+    .load_memory = load_avif_memory,
+    .read_dimensions = read_avif_dimensions,
+    .save = save_avif_file,
+    .is_animated = is_avif_animated,
+    .open_animation = open_avif_animation,
+    .read_frame = read_avif_frame,
+    .convert_frame = convert_avif_frame,
+    .free_pending_frame = free_avif_frame,
+    .close_animation = close_avif_animation,
+    .start_animation = start_avif_animation,
+    .add_frame = add_avif_frame,
+    .finish_animation = finish_avif_animation,
+    .close_animation_encoder = close_avif_animation_encoder
+};
+
+const CodecBackend* media_processor_codec_backend(void) {
+    return &avif_backend;
+}
@@ -0,0 +1,129 @@
+#include "../include/codec_cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    void* object;
+    CodecContextDestroy destroy;
+    bool busy;                      // Taken and not given back yet
+    char key[CODEC_CONTEXT_KEY_MAX];
+} CodecSlot;
+
+typedef struct {
+    CodecSlot slots[CODEC_CONTEXT_COUNT];
+} CodecCache;
+
+static atomic_uint_fast64_t created_count[CODEC_CONTEXT_COUNT];
+static atomic_uint_fast64_t reused_count[CODEC_CONTEXT_COUNT];
+static atomic_uint_fast64_t create_ns_total[CODEC_CONTEXT_COUNT];
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static bool cache_key_ready;
+
+static void destroy_idle_contexts(CodecCache* cache) {
+    for (int kind = 0; kind < CODEC_CONTEXT_COUNT; kind++) {
+        CodecSlot* slot = &cache->slots[kind];
+        if (slot->object && !slot->busy) {
+            slot->destroy(slot->object);
+            slot->object = NULL;
+        }
+    }
+}
+
+// Runs as a thread exits
+static void destroy_cache(void* arg) {
+    CodecCache* cache = arg;
+    destroy_idle_contexts(cache);
+    free(cache);
+}
+
+static void create_cache_key(void) {
+    cache_key_ready = pthread_key_create(&cache_key, destroy_cache) == 0;
+}
+
+// The calling thread's cache; NULL if it can't have one
+static CodecCache* thread_cache(void) {
+    pthread_once(&cache_key_once, create_cache_key);
+    if (!cache_key_ready) return NULL;
+
+    CodecCache* cache = pthread_getspecific(cache_key);
+    if (!cache) {
+        cache = calloc(1, sizeof(CodecCache));
+        if (cache && pthread_setspecific(cache_key, cache) != 0) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+void* codec_context_take(CodecContextKind kind, const char* key) {
+    CodecCache* cache = thread_cache();
+    if (!cache) return NULL;
+
+    CodecSlot* slot = &cache->slots[kind];
+    if (!slot->object || slot->busy || strcmp(slot->key, key) != 0) return NULL;
+
+    slot->busy = true;
+    atomic_fetch_add(&reused_count[kind], 1);
+    return slot->object;
+}
+
+void codec_context_created(CodecContextKind kind, uint64_t ns) {
+    atomic_fetch_add(&created_count[kind], 1);
+    atomic_fetch_add(&create_ns_total[kind], ns);
+}
+
+void codec_context_give(CodecContextKind kind, const char* key, void* object, bool reusable,
+                        CodecContextDestroy destroy) {
+    if (!object) return;
+
+    CodecCache* cache = thread_cache();
+    CodecSlot* slot = cache ? &cache->slots[kind] : NULL;
+    if (slot && slot->object == object) {
+        slot->busy = false;
+        if (reusable) return;
+        slot->object = NULL;
+    } else if (slot && reusable && !slot->busy && strlen(key) < sizeof(slot->key)) {
+        // Takes the place of an idle context made with other settings
+        if (slot->object) slot->destroy(slot->object);
+        slot->object = object;
+        slot->destroy = destroy;
+        strcpy(slot->key, key);
+        return;
+    }
+    destroy(object);
+}
+
+void codec_contexts_release(void) {
+    pthread_once(&cache_key_once, create_cache_key);
+    CodecCache* cache = cache_key_ready ? pthread_getspecific(cache_key) : NULL;
+    if (cache) {
+        destroy_idle_contexts(cache);
+    }
+}
+
+void codec_context_stats(CodecContextStats* stats) {
+    for (int kind = 0; kind < CODEC_CONTEXT_COUNT; kind++) {
+        stats->created[kind] = atomic_load(&created_count[kind]);
+        stats->reused[kind] = atomic_load(&reused_count[kind]);
+        stats->create_ns[kind] = atomic_load(&create_ns_total[kind]);
+    }
+}
+
+double codec_context_saved_ns(const CodecContextStats* start, const CodecContextStats* end,
+                              uint64_t* reused) {
+    double saved = 0.0;
+    *reused = 0;
+    for (int kind = 0; kind < CODEC_CONTEXT_COUNT; kind++) {
+        uint64_t count = end->reused[kind] - start->reused[kind];
+        *reused += count;
+        if (end->created[kind] > 0) {
+            saved += (double)count * (double)end->create_ns[kind] / (double)end->created[kind];
+        }
+    }
+    return saved;
+}
@@ -0,0 +1,574 @@
+#include "../include/codec_backend.h"
+#include "../include/codec_cache.h"
+#include "../include/image_ops.h"
+#include "../include/output_writer.h"
+#include "../include/parallel.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libheif/heif.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Copies EXIF, XMP and the ICC profile attached to a HEIF image item
+static void read_heic_metadata(const struct heif_image_handle* handle, ImageData* img) {
+    heif_item_id ids[16];
+    int count = heif_image_handle_get_list_of_metadata_block_IDs(handle, NULL, ids, 16);
+    for (int i = 0; i < count; i++) {
+        const char* type = heif_image_handle_get_metadata_type(handle, ids[i]);
+        const char* content_type = heif_image_handle_get_metadata_content_type(handle, ids[i]);
+        bool is_exif = type && strcmp(type, "Exif") == 0;
+        bool is_xmp = content_type && strcmp(content_type, "application/rdf+xml") == 0;
+        if (!is_exif && !is_xmp) continue;
+
+        size_t size = heif_image_handle_get_metadata_size(handle, ids[i]);
+        unsigned char* data = size > 0 ? (unsigned char*)malloc(size) : NULL;
+        if (!data) continue;
+
+        struct heif_error error = heif_image_handle_get_metadata(handle, ids[i], data);
+        if (error.code == heif_error_Ok && is_exif && size >= 4) {
+            // Exif items start with a big-endian offset to the TIFF header
+            size_t offset = 4 + ((size_t)data[0] << 24 | (size_t)data[1] << 16 |
+                                 (size_t)data[2] << 8 | data[3]);
+            if (offset < size) {
+                // libheif already applied irot/imir, so the pixels are upright
+                exif_set_orientation(data + offset, size - offset, EXIF_ORIENTATION_NORMAL);
+                set_exif_metadata(img, data + offset, size - offset);
+            }
+        } else if (error.code == heif_error_Ok && is_xmp) {
+            set_image_metadata(img, IMAGE_METADATA_XMP, data, size);
+        }
+        free(data);
+    }
+
+    size_t icc_size = heif_image_handle_get_raw_color_profile_size(handle);
+    if (icc_size > 0) {
+        unsigned char* icc = (unsigned char*)malloc(icc_size);
+        if (icc && heif_image_handle_get_raw_color_profile(handle, icc).code == heif_error_Ok) {
+            set_image_metadata(img, IMAGE_METADATA_ICC, icc, icc_size);
+        }
+        free(icc);
+    }
+}
+
+// libheif hands over the finished file in one piece, so its size is known
+// before the first byte is written
+static struct heif_error write_heif_to_file(struct heif_context* ctx, const void* data,
+                                            size_t size, void* userdata) {
+    (void)ctx;
+    FILE* fp = (FILE*)userdata;
+    struct heif_error error = { heif_error_Ok, heif_suberror_Unspecified, "Success" };
+
+    output_preallocate(fp, size);
+    if (fwrite(data, 1, size, fp) != size) {
+        error.code = heif_error_Encoding_error;
+        error.subcode = heif_suberror_Cannot_write_output_data;
+        error.message = "Could not write output file";
+    }
+    return error;
+}
+
+static void release_heif_image(void* release_ctx) {
+    heif_image_release((const struct heif_image*)release_ctx);
+}
+
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+// The tiles of a grid image that are decoded into one ImageData
+typedef struct {
+    const struct heif_image_handle* handle;
+    struct heif_image_tiling tiling;
+    ImageData* output;
+    int64_t region_x;               // Output origin within the image
+    int64_t region_y;
+    uint32_t first_column;
+    uint32_t first_row;
+    uint32_t columns;               // Tiles per row that intersect the region
+    atomic_bool failed;
+} HeicTileJob;
+
+static void decode_heic_tile(void* ctx, size_t index) {
+    HeicTileJob* job = (HeicTileJob*)ctx;
+    if (atomic_load(&job->failed)) return;
+
+    uint32_t column = job->first_column + (uint32_t)(index % job->columns);
+    uint32_t row = job->first_row + (uint32_t)(index / job->columns);
+
+    struct heif_image* tile;
+    struct heif_error error = heif_image_handle_decode_image_tile(
+        job->handle, &tile, heif_colorspace_RGB, heif_chroma_interleaved_RGBA, NULL, column, row);
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not decode HEIC tile %u,%u: %s\n", column, row, error.message);
+        atomic_store(&job->failed, true);
+        return;
+    }
+
+    int stride;
+    const uint8_t* plane = heif_image_get_plane_readonly(tile, heif_channel_interleaved, &stride);
+    if (!plane) {
+        atomic_store(&job->failed, true);
+        heif_image_release(tile);
+        return;
+    }
+
+    // The grid may start above and left of the image, and its last tiles
+    // may reach past it; only the overlap with the region is copied
+    int64_t tile_x = (int64_t)column * job->tiling.tile_width - job->tiling.top_offset_x;
+    int64_t tile_y = (int64_t)row * job->tiling.tile_height - job->tiling.top_offset_y;
+    int64_t x0 = tile_x > job->region_x ? tile_x : job->region_x;
+    int64_t y0 = tile_y > job->region_y ? tile_y : job->region_y;
+    int64_t x1 = tile_x + heif_image_get_width(tile, heif_channel_interleaved);
+    int64_t y1 = tile_y + heif_image_get_height(tile, heif_channel_interleaved);
+    int64_t region_x1 = job->region_x + (int64_t)job->output->width;
+    int64_t region_y1 = job->region_y + (int64_t)job->output->height;
+    if (x1 > region_x1) x1 = region_x1;
+    if (y1 > region_y1) y1 = region_y1;
+
+    for (int64_t y = y0; y < y1 && x0 < x1; y++) {
+        memcpy(image_row(job->output, (size_t)(y - job->region_y)) + (x0 - job->region_x) * 4,
+               plane + (y - tile_y) * stride + (x0 - tile_x) * 4, (size_t)(x1 - x0) * 4);
+    }
+    heif_image_release(tile);
+}
+#endif
+
+// Decodes a grid image tile by tile on a thread pool, straight into the
+// output; with a crop, only the tiles it touches are decoded. Leaves *tiled
+// false (and returns NULL) if the image is not a grid or libheif is too old.
+static ImageData* read_heic_tiles(const struct heif_image_handle* handle,
+                                  const ConversionOptions* options, bool* tiled, bool* cropped) {
+    *tiled = false;
+    *cropped = false;
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+    // Tiling of the image as displayed, after irot/imir
+    HeicTileJob job = { .handle = handle };
+    if (heif_image_handle_get_image_tiling(handle, 1, &job.tiling).code != heif_error_Ok ||
+        (uint64_t)job.tiling.num_columns * job.tiling.num_rows < 2 ||
+        job.tiling.tile_width == 0 || job.tiling.tile_height == 0) {
+        return NULL;
+    }
+
+    int threads = options && options->heic_options.decoder_threads > 0 ?
+                  options->heic_options.decoder_threads : 0;
+    bool crop = options && options->crop.width > 0 && options->crop.height > 0 &&
+                options->crop.x < job.tiling.image_width && options->crop.y < job.tiling.image_height;
+    // A single decoding thread gains nothing over libheif's own assembly,
+    // unless the image is to be spilled: libheif assembles it in RAM
+    if (threads == 1 && !crop &&
+        !image_should_spill(job.tiling.image_width, job.tiling.image_height, options)) {
+        return NULL;
+    }
+    *tiled = true;
+
+    uint64_t region_width = job.tiling.image_width;
+    uint64_t region_height = job.tiling.image_height;
+    if (crop) {
+        job.region_x = (int64_t)options->crop.x;
+        job.region_y = (int64_t)options->crop.y;
+        region_width -= options->crop.x;
+        region_height -= options->crop.y;
+        if (options->crop.width < region_width) region_width = options->crop.width;
+        if (options->crop.height < region_height) region_height = options->crop.height;
+    }
+
+    job.output = create_decoded_image((size_t)region_width, (size_t)region_height, options);
+    if (!job.output) {
+        printf("Error: Could not allocate HEIC image\n");
+        return NULL;
+    }
+    atomic_init(&job.failed, false);
+
+    // Tiles overlapping the region
+    uint64_t last_x = (uint64_t)job.region_x + region_width - 1 + job.tiling.top_offset_x;
+    uint64_t last_y = (uint64_t)job.region_y + region_height - 1 + job.tiling.top_offset_y;
+    uint32_t last_column = (uint32_t)(last_x / job.tiling.tile_width);
+    uint32_t last_row = (uint32_t)(last_y / job.tiling.tile_height);
+    if (last_column >= job.tiling.num_columns) last_column = job.tiling.num_columns - 1;
+    if (last_row >= job.tiling.num_rows) last_row = job.tiling.num_rows - 1;
+    job.first_column = (uint32_t)(((uint64_t)job.region_x + job.tiling.top_offset_x) / job.tiling.tile_width);
+    job.first_row = (uint32_t)(((uint64_t)job.region_y + job.tiling.top_offset_y) / job.tiling.tile_height);
+    job.columns = last_column - job.first_column + 1;
+    size_t count = (size_t)job.columns * (last_row - job.first_row + 1);
+
+    parallel_for(count, threads, decode_heic_tile, &job);
+
+    if (atomic_load(&job.failed)) {
+        free_image_data(job.output);
+        free(job.output);
+        return NULL;
+    }
+    *cropped = crop;
+    return job.output;
+#else
+    (void)handle;
+    (void)options;
+    return NULL;
+#endif
+}
+
+// Decodes the primary image of a context that has already read its input
+static ImageData* read_heic(struct heif_context* ctx, const ConversionOptions* options) {
+    // Allow the HEVC decoder to use more threads for large/grid images
+    if (options && options->heic_options.decoder_threads > 0) {
+        heif_context_set_max_decoding_threads(ctx, options->heic_options.decoder_threads);
+    }
+
+    // Get handle to primary image
+    struct heif_image_handle* handle;
+    struct heif_error error = heif_context_get_primary_image_handle(ctx, &handle);
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not get primary image handle: %s\n", error.message);
+        return NULL;
+    }
+
+    // Grid images (iPhone photos are 512x512 tiles) are decoded tile-parallel
+    bool tiled;
+    bool cropped;
+    ImageData* output = read_heic_tiles(handle, options, &tiled, &cropped);
+    if (tiled && !output) {
+        heif_image_handle_release(handle);
+        return NULL;
+    }
+
+    if (!tiled) {
+        // Decode the image
+        struct heif_image* img;
+        error = heif_decode_image(handle, &img, heif_colorspace_RGB, heif_chroma_interleaved_RGBA, NULL);
+        if (error.code != heif_error_Ok) {
+            printf("Error: Could not decode image: %s\n", error.message);
+            heif_image_handle_release(handle);
+            return NULL;
+        }
+
+        // Get image dimensions
+        int width = heif_image_get_width(img, heif_channel_interleaved);
+        int height = heif_image_get_height(img, heif_channel_interleaved);
+
+        // Get the image data
+        int stride;
+        const uint8_t* data = heif_image_get_plane_readonly(img, heif_channel_interleaved, &stride);
+        if (!data) {
+            heif_image_release(img);
+            heif_image_handle_release(handle);
+            return NULL;
+        }
+
+        // Borrow the decoded plane instead of copying it; the heif_image outlives
+        // the context and is released together with the ImageData
+        output = wrap_image_data((unsigned char*)data, width, height, stride,
+                                 release_heif_image, img);
+        if (!output) {
+            heif_image_release(img);
+            heif_image_handle_release(handle);
+            return NULL;
+        }
+    }
+
+    read_heic_metadata(handle, output);
+
+    // Cleanup HEIF objects
+    heif_image_handle_release(handle);
+
+    // libheif has applied irot/imir and the EXIF tag was reset, so the crop
+    // region is in the same upright coordinates as the tiles
+    output = apply_exif_orientation(output, options);
+    return cropped ? output : apply_crop(output, options);
+}
+
+static ImageData* load_heic_file(const char* filepath, const ConversionOptions* options) {
+    struct heif_context* ctx = heif_context_alloc();
+    if (!ctx) {
+        printf("Error: Could not create HEIF context\n");
+        return NULL;
+    }
+
+    // Read HEIC file
+    struct heif_error error = heif_context_read_from_file(ctx, filepath, NULL);
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not read HEIF file: %s\n", error.message);
+        heif_context_free(ctx);
+        return NULL;
+    }
+
+    ImageData* img = read_heic(ctx, options);
+    heif_context_free(ctx);
+    return img;
+}
+
+static ImageData* load_heic_memory(const char* name, const unsigned char* data, size_t size,
+                                   const ConversionOptions* options) {
+    // Decoded planes are copies, so the buffer may go away after this
+    struct heif_context* ctx = heif_context_alloc();
+    if (!ctx) return NULL;
+
+    ImageData* img = NULL;
+    struct heif_error error = heif_context_read_from_memory_without_copy(ctx, data, size, NULL);
+    if (error.code == heif_error_Ok) {
+        img = read_heic(ctx, options);
+    } else {
+        printf("Error: Could not read HEIF file %s: %s\n", name, error.message);
+    }
+    heif_context_free(ctx);
+    return img;
+}
+
+static bool read_heic_dimensions(const unsigned char* data, size_t size,
+                                 size_t* width, size_t* height) {
+    struct heif_context* ctx = heif_context_alloc();
+    if (!ctx) return false;
+    struct heif_image_handle* handle = NULL;
+    bool parsed =
+        heif_context_read_from_memory_without_copy(ctx, data, size, NULL).code == heif_error_Ok &&
+        heif_context_get_primary_image_handle(ctx, &handle).code == heif_error_Ok;
+    if (parsed) {
+        *width = (size_t)heif_image_handle_get_width(handle);
+        *height = (size_t)heif_image_handle_get_height(handle);
+        heif_image_handle_release(handle);
+    }
+    heif_context_free(ctx);
+    return parsed;
+}
+
+// Encoder parameters are plugin specific; an unknown name or value is not fatal
+static void set_heic_encoder_parameter(struct heif_encoder* encoder,
+                                       const char* name, const char* value) {
+    if (!value || !*value) return;
+
+    struct heif_error error = heif_encoder_set_parameter_string(encoder, name, value);
+    if (error.code != heif_error_Ok) {
+        printf("Warning: Could not set HEIC encoder %s=%s: %s\n", name, value, error.message);
+    }
+}
+
+static void destroy_heic_encoder(void* object) {
+    heif_encoder_release((struct heif_encoder*)object);
+}
+
+// Settings an encoder is set up with once, naming it in the codec cache
+static void heic_encoder_key(const ConversionOptions* options, char* key, size_t size) {
+    if (!options) {
+        snprintf(key, size, "default");
+        return;
+    }
+    snprintf(key, size, "%d|%s|%s|%s", options->heic_options.lossless,
+             options->heic_options.preset ? options->heic_options.preset : "",
+             options->heic_options.tune ? options->heic_options.tune : "",
+             options->heic_options.chroma ? options->heic_options.chroma : "");
+}
+
+// Returns the heif_image backing img if img covers the whole decoded plane
+static struct heif_image* borrowed_heif_image(const ImageData* img) {
+    struct heif_image* heif_img = (struct heif_image*)image_release_ctx(img);
+    int stride;
+    const uint8_t* plane = heif_image_get_plane_readonly(heif_img, heif_channel_interleaved, &stride);
+    if (plane != img->data || (size_t)stride != img->stride ||
+        (size_t)heif_image_get_width(heif_img, heif_channel_interleaved) != img->width ||
+        (size_t)heif_image_get_height(heif_img, heif_channel_interleaved) != img->height) {
+        return NULL;
+    }
+    return heif_img;
+}
+
+static struct heif_image* copy_to_heif_image(const ImageData* img) {
+    struct heif_image* heif_img;
+    struct heif_error error = heif_image_create(img->width, img->height,
+                                              heif_colorspace_RGB,
+                                              heif_chroma_interleaved_RGBA,
+                                              &heif_img);
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not create HEIF image: %s\n", error.message);
+        return NULL;
+    }
+
+    // Add image plane
+    error = heif_image_add_plane(heif_img, heif_channel_interleaved,
+                                img->width, img->height, 8);
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not add image plane: %s\n", error.message);
+        heif_image_release(heif_img);
+        return NULL;
+    }
+
+    // Get plane data
+    int stride;
+    uint8_t* plane = heif_image_get_plane(heif_img, heif_channel_interleaved, &stride);
+    if (!plane) {
+        printf("Error: Could not get image plane\n");
+        heif_image_release(heif_img);
+        return NULL;
+    }
+
+    // Copy image data
+    for (size_t y = 0; y < img->height; y++) {
+        memcpy(plane + y * stride, image_row(img, y), img->width * 4);
+    }
+
+    return heif_img;
+}
+
+// Only release heif images we created; borrowed ones belong to the ImageData
+static void release_heic_source(const ImageData* img, struct heif_image* heif_img) {
+    if (heif_img != image_release_ctx(img)) {
+        heif_image_release(heif_img);
+    }
+}
+
+static bool save_heic_file(const char* filepath, const ImageData* img, const ConversionOptions* options) {
+    if (!img || !img->data || !filepath) {
+        printf("Error: Invalid input parameters\n");
+        return false;
+    }
+
+    // Create encoder
+    struct heif_context* ctx = heif_context_alloc();
+    if (!ctx) {
+        printf("Error: Could not create HEIF context\n");
+        return false;
+    }
+
+    // Images decoded by load_heic still own their heif_image and can be
+    // encoded in place; everything else is copied into a new plane
+    struct heif_image* heif_img = NULL;
+    struct heif_error error;
+    if (image_is_borrowed_from(img, release_heif_image)) {
+        heif_img = borrowed_heif_image(img);
+    }
+    if (!heif_img) {
+        heif_img = copy_to_heif_image(img);
+        if (!heif_img) {
+            heif_context_free(ctx);
+            return false;
+        }
+
+        // Borrowed images still carry the profile they were decoded with
+        const ImageBlob* icc = &img->metadata[IMAGE_METADATA_ICC];
+        if (icc->data && (!options || options->maintain_exif)) {
+            heif_image_set_raw_color_profile(heif_img, "prof", icc->data, icc->size);
+        }
+    }
+
+    // Get encoder; the thread keeps it for the next image with these settings.
+    // This saves libheif's plugin lookup and parameter setup, but the x265
+    // plugin opens a new x265 encoder in every heif_context_encode_image.
+    char encoder_key[CODEC_CONTEXT_KEY_MAX];
+    heic_encoder_key(options, encoder_key, sizeof(encoder_key));
+    struct heif_encoder* encoder = codec_context_take(CODEC_CONTEXT_HEIC_ENCODER, encoder_key);
+    if (!encoder) {
+        uint64_t start = now_ns();
+        error = heif_context_get_encoder_for_format(ctx, heif_compression_HEVC, &encoder);
+        if (error.code != heif_error_Ok) {
+            printf("Error: Could not create encoder: %s\n", error.message);
+            release_heic_source(img, heif_img);
+            heif_context_free(ctx);
+            return false;
+        }
+        codec_context_created(CODEC_CONTEXT_HEIC_ENCODER, now_ns() - start);
+    }
+
+    // Set encoding quality and HEVC encoder parameters
+    if (options) {
+        if (options->heic_options.lossless) {
+            error = heif_encoder_set_lossless(encoder, 1);
+            if (error.code != heif_error_Ok) {
+                printf("Warning: Could not enable lossless mode: %s\n", error.message);
+            }
+        } else {
+            int quality = options->quality;
+            error = heif_encoder_set_lossy_quality(encoder, quality);
+            if (error.code != heif_error_Ok) {
+                printf("Warning: Could not set quality: %s\n", error.message);
+            }
+        }
+
+        // Lossless output is only possible without chroma subsampling
+        const char* chroma = options->heic_options.lossless ? "444" : options->heic_options.chroma;
+        set_heic_encoder_parameter(encoder, "preset", options->heic_options.preset);
+        set_heic_encoder_parameter(encoder, "tune", options->heic_options.tune);
+        set_heic_encoder_parameter(encoder, "chroma", chroma);
+    }
+
+    // Encode image
+    struct heif_image_handle* handle;
+    error = heif_context_encode_image(ctx, heif_img, encoder, NULL, &handle);
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not encode image: %s\n", error.message);
+        codec_context_give(CODEC_CONTEXT_HEIC_ENCODER, encoder_key, encoder, false,
+                           destroy_heic_encoder);
+        release_heic_source(img, heif_img);
+        heif_context_free(ctx);
+        return false;
+    }
+
+    // EXIF and XMP are separate items referencing the encoded image
+    if (!options || options->maintain_exif) {
+        const ImageBlob* exif = &img->metadata[IMAGE_METADATA_EXIF];
+        const ImageBlob* xmp = &img->metadata[IMAGE_METADATA_XMP];
+        if (exif->data) {
+            error = heif_context_add_exif_metadata(ctx, handle, exif->data, (int)exif->size);
+            if (error.code != heif_error_Ok) {
+                printf("Warning: Could not add EXIF metadata: %s\n", error.message);
+            }
+        }
+        if (xmp->data) {
+            error = heif_context_add_XMP_metadata(ctx, handle, xmp->data, (int)xmp->size);
+            if (error.code != heif_error_Ok) {
+                printf("Warning: Could not add XMP metadata: %s\n", error.message);
+            }
+        }
+    }
+    heif_image_handle_release(handle);
+
+    // Write file
+    FILE* fp = fopen(filepath, "wb");
+    if (!fp) {
+        printf("Error: Could not open output file: %s\n", filepath);
+        codec_context_give(CODEC_CONTEXT_HEIC_ENCODER, encoder_key, encoder, true,
+                           destroy_heic_encoder);
+        release_heic_source(img, heif_img);
+        heif_context_free(ctx);
+        return false;
+    }
+
+    struct heif_writer writer = { .writer_api_version = 1, .write = write_heif_to_file };
+    error = heif_context_write(ctx, &writer, fp);
+    if (fclose(fp) != 0 && error.code == heif_error_Ok) {
+        error.code = heif_error_Encoding_error;
+        error.message = "Could not write output file";
+    }
+    if (error.code != heif_error_Ok) {
+        printf("Error: Could not write file: %s\n", error.message);
+        codec_context_give(CODEC_CONTEXT_HEIC_ENCODER, encoder_key, encoder, true,
+                           destroy_heic_encoder);
+        release_heic_source(img, heif_img);
+        heif_context_free(ctx);
+        return false;
+    }
+
+    // Cleanup
+    codec_context_give(CODEC_CONTEXT_HEIC_ENCODER, encoder_key, encoder, true, destroy_heic_encoder);
+    release_heic_source(img, heif_img);
+    heif_context_free(ctx);
+
+    printf("Successfully encoded and saved HEIC file\n");
+    return true;
+}
+
+static const CodecBackend heic_backend = {
+    .abi_version = CODEC_BACKEND_ABI_VERSION,
+    .format = FORMAT_HEIC,
+    .name = "heic",
+    .load = load_heic_file,
+    .load_memory = load_heic_memory,
+    .read_dimensions = read_heic_dimensions,
+    .save = save_heic_file
+};
+
+const CodecBackend* media_processor_codec_backend(void) {
+    return &heic_backend;
+}
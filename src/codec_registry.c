@@ -0,0 +1,144 @@
+#include "../include/codec_backend.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// Overrides where modules are looked for
+#define CODEC_DIR_VARIABLE "MEDIA_PROCESSOR_CODEC_DIR"
+
+typedef struct {
+    const char* name;
+    bool attempted;
+    bool reported;                  // The failure was printed
+    const CodecBackend* backend;
+    char path[PATH_MAX];
+    double load_ms;
+    char error[256];
+} CodecModule;
+
+static CodecModule modules[] = {
+    [FORMAT_WEBP] = { .name = "webp" },
+    [FORMAT_AVIF] = { .name = "avif" },
+    [FORMAT_HEIC] = { .name = "heic" }
+};
+static pthread_mutex_t modules_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double elapsed_ms(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) * 1000.0 +
+           (double)(end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Opens dir/<name>.so and checks its backend; false with module->error set
+static bool open_module(CodecModule* module, ImageFormat format, const char* dir) {
+    snprintf(module->path, sizeof(module->path), "%s/%s.so", dir, module->name);
+    if (access(module->path, F_OK) != 0) {
+        snprintf(module->error, sizeof(module->error), "no module in %s", dir);
+        return false;
+    }
+
+    // RTLD_NOW resolves everything here rather than failing mid-conversion
+    void* handle = dlopen(module->path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        snprintf(module->error, sizeof(module->error), "%s", dlerror());
+        return false;
+    }
+
+    CodecBackendEntry entry;
+    *(void**)&entry = dlsym(handle, CODEC_BACKEND_ENTRY);
+    const CodecBackend* backend = entry ? entry() : NULL;
+    if (!backend || backend->abi_version != CODEC_BACKEND_ABI_VERSION || backend->format != format) {
+        snprintf(module->error, sizeof(module->error), "%s.so is not a module for this version",
+                 module->name);
+        dlclose(handle);
+        return false;
+    }
+
+    // Never closed: cached codec contexts point into the module
+    module->backend = backend;
+    return true;
+}
+
+// Directory of the running executable; false if unknown
+static bool executable_dir(char* dir, size_t size) {
+    ssize_t length = readlink("/proc/self/exe", dir, size - 1);
+    if (length <= 0) return false;
+    dir[length] = '\0';
+
+    char* slash = strrchr(dir, '/');
+    if (!slash) return false;
+    *slash = '\0';
+    return true;
+}
+
+// Tries the override, then codecs/ next to the executable (the build tree),
+// then the install location. Called with modules_lock held.
+static void load_module(CodecModule* module, ImageFormat format) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    module->attempted = true;
+
+    const char* override = getenv(CODEC_DIR_VARIABLE);
+    if (override && *override) {
+        open_module(module, format, override);
+    } else {
+        char dir[PATH_MAX];
+        char codecs[PATH_MAX + 8];
+        bool found = false;
+        if (executable_dir(dir, sizeof(dir))) {
+            snprintf(codecs, sizeof(codecs), "%s/codecs", dir);
+            found = open_module(module, format, codecs);
+        }
+#ifdef MEDIA_PROCESSOR_CODEC_INSTALL_DIR
+        if (!found) found = open_module(module, format, MEDIA_PROCESSOR_CODEC_INSTALL_DIR);
+#endif
+        (void)found;
+    }
+    module->load_ms = elapsed_ms(&start);
+}
+
+static CodecModule* find_module(ImageFormat format) {
+    if (format != FORMAT_WEBP && format != FORMAT_AVIF && format != FORMAT_HEIC) return NULL;
+    CodecModule* module = &modules[format];
+
+    pthread_mutex_lock(&modules_lock);
+    if (!module->attempted) load_module(module, format);
+    pthread_mutex_unlock(&modules_lock);
+    return module;
+}
+
+const CodecBackend* codec_backend(ImageFormat format) {
+    CodecModule* module = find_module(format);
+    if (!module) return NULL;
+    if (module->backend) return module->backend;
+
+    pthread_mutex_lock(&modules_lock);
+    if (!module->reported) {
+        printf("Error: %s support is not available: %s\n", format_to_string(format), module->error);
+        module->reported = true;
+    }
+    pthread_mutex_unlock(&modules_lock);
+    return NULL;
+}
+
+bool codec_module_info(ImageFormat format, CodecModuleInfo* info) {
+    CodecModule* module = find_module(format);
+    if (!module) return false;
+
+    memset(info, 0, sizeof(*info));
+    info->name = module->name;
+    info->loaded = module->backend != NULL;
+    snprintf(info->path, sizeof(info->path), "%s", module->path);
+    info->load_ms = module->load_ms;
+    snprintf(info->error, sizeof(info->error), "%s", module->error);
+    return true;
+}
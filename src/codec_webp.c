@@ -0,0 +1,630 @@
+#include "../include/codec_backend.h"
+#include "../include/output_writer.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <webp/decode.h>
+#include <webp/encode.h>
+#include <webp/mux.h>
+#include <webp/demux.h>
+
+// Size of the reads that feed the incremental WebP decoder
+#define WEBP_READ_CHUNK_SIZE (64 * 1024)
+
+// VP8X feature flags announcing metadata chunks
+#define WEBP_VP8X_ICC_FLAG 0x20
+#define WEBP_VP8X_EXIF_FLAG 0x08
+#define WEBP_VP8X_XMP_FLAG 0x04
+#define WEBP_VP8X_ANIMATION_FLAG 0x02
+
+// Walks the RIFF chunk list for ICCP, EXIF and "XMP " chunks. Only called
+// when the VP8X header announces metadata, so plain files cost nothing.
+static void read_webp_metadata(FILE* fp, ImageData* img) {
+    if (fseek(fp, 12, SEEK_SET) != 0) return;
+
+    unsigned char header[8];
+    while (fread(header, 1, 8, fp) == 8) {
+        uint32_t size = (uint32_t)header[4] | (uint32_t)header[5] << 8 |
+                        (uint32_t)header[6] << 16 | (uint32_t)header[7] << 24;
+        long padded = (long)size + (size & 1);
+
+        int kind = -1;
+        if (memcmp(header, "EXIF", 4) == 0) kind = IMAGE_METADATA_EXIF;
+        else if (memcmp(header, "ICCP", 4) == 0) kind = IMAGE_METADATA_ICC;
+        else if (memcmp(header, "XMP ", 4) == 0) kind = IMAGE_METADATA_XMP;
+
+        if (kind < 0 || size == 0) {
+            if (fseek(fp, padded, SEEK_CUR) != 0) return;
+            continue;
+        }
+
+        unsigned char* data = (unsigned char*)malloc(size);
+        if (!data) return;
+        if (fread(data, 1, size, fp) != size) {
+            free(data);
+            return;
+        }
+        if (kind == IMAGE_METADATA_EXIF) {
+            set_exif_metadata(img, data, size);
+        } else {
+            set_image_metadata(img, (ImageMetadataKind)kind, data, size);
+        }
+        free(data);
+        if ((size & 1) && fseek(fp, 1, SEEK_CUR) != 0) return;
+    }
+}
+
+static ImageData* read_webp_first_frame(FILE* fp, const char* filepath,
+                                        const ConversionOptions* options);
+
+// Decodes a WebP from fp; the caller opens and closes the stream
+static ImageData* read_webp_stream(FILE* fp, const char* filepath, const ConversionOptions* options) {
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config)) {
+        return NULL;
+    }
+
+    uint8_t* chunk = (uint8_t*)malloc(WEBP_READ_CHUNK_SIZE);
+    if (!chunk) {
+        return NULL;
+    }
+
+    // Read until the headers are complete; the same bytes then start decoding
+    size_t chunk_size = 0;
+    VP8StatusCode status = VP8_STATUS_NOT_ENOUGH_DATA;
+    while (status == VP8_STATUS_NOT_ENOUGH_DATA && chunk_size < WEBP_READ_CHUNK_SIZE) {
+        size_t bytes_read = fread(chunk + chunk_size, 1, WEBP_READ_CHUNK_SIZE - chunk_size, fp);
+        if (bytes_read == 0) break;
+        chunk_size += bytes_read;
+        status = WebPGetFeatures(chunk, chunk_size, &config.input);
+    }
+    if (status != VP8_STATUS_OK) {
+        free(chunk);
+        return NULL;
+    }
+
+    // The incremental decoder handles still images only
+    if (config.input.has_animation) {
+        free(chunk);
+        return read_webp_first_frame(fp, filepath, options);
+    }
+
+    // Optional scaling during decode; a single given dimension keeps the aspect ratio
+    int width = config.input.width;
+    int height = config.input.height;
+    if (options) {
+        config.options.use_threads = options->webp_options.decode_threads;
+
+        int target_width = options->webp_options.decode_width;
+        int target_height = options->webp_options.decode_height;
+        if (target_width > 0 && target_height <= 0) {
+            target_height = (int)((int64_t)height * target_width / width);
+        } else if (target_height > 0 && target_width <= 0) {
+            target_width = (int)((int64_t)width * target_height / height);
+        }
+        if (target_width > 0 && target_height > 0 &&
+            (target_width != width || target_height != height)) {
+            config.options.use_scaling = 1;
+            config.options.scaled_width = target_width;
+            config.options.scaled_height = target_height;
+            width = target_width;
+            height = target_height;
+        }
+    }
+
+    // Allocate image data structure (we'll decode to RGBA)
+    ImageData* img = create_decoded_image(width, height, options);
+    if (!img) {
+        free(chunk);
+        return NULL;
+    }
+
+    // The VP8X header, if any, sits in the first chunk of the file
+    bool has_metadata = chunk_size >= 21 && memcmp(chunk + 12, "VP8X", 4) == 0 &&
+        (chunk[20] & (WEBP_VP8X_ICC_FLAG | WEBP_VP8X_EXIF_FLAG | WEBP_VP8X_XMP_FLAG));
+
+    // Decode straight into our buffer
+    config.output.colorspace = MODE_RGBA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = img->data;
+    config.output.u.RGBA.stride = (int)img->stride;
+    config.output.u.RGBA.size = img->size;
+
+    WebPIDecoder* idec = WebPIDecode(NULL, 0, &config);
+    if (!idec) {
+        free(chunk);
+        free_image_data(img);
+        free(img);
+        return NULL;
+    }
+
+    // Feed the decoder as the file streams in
+    status = WebPIAppend(idec, chunk, chunk_size);
+    while (status == VP8_STATUS_SUSPENDED) {
+        chunk_size = fread(chunk, 1, WEBP_READ_CHUNK_SIZE, fp);
+        if (chunk_size == 0) break;
+        status = WebPIAppend(idec, chunk, chunk_size);
+    }
+
+    WebPIDelete(idec);
+    WebPFreeDecBuffer(&config.output);
+    free(chunk);
+
+    if (status == VP8_STATUS_OK && has_metadata) {
+        read_webp_metadata(fp, img);
+    }
+
+    if (status != VP8_STATUS_OK) {
+        printf("Error: Could not decode WebP file %s\n", filepath);
+        free_image_data(img);
+        free(img);
+        return NULL;
+    }
+
+    return apply_exif_orientation(img, options);
+}
+
+static ImageData* load_webp_file(const char* filepath, const ConversionOptions* options) {
+    FILE* fp = fopen(filepath, "rb");
+    if (!fp) {
+        printf("Error: Could not open WebP file %s\n", filepath);
+        return NULL;
+    }
+
+    ImageData* img = read_webp_stream(fp, filepath, options);
+    fclose(fp);
+    return img;
+}
+
+static ImageData* load_webp_memory(const char* name, const unsigned char* data, size_t size,
+                                   const ConversionOptions* options) {
+    // The streaming decoder reads the buffer through a memory stream
+    FILE* fp = fmemopen((void*)data, size, "rb");
+    if (!fp) return NULL;
+    ImageData* img = read_webp_stream(fp, name, options);
+    fclose(fp);
+    return img;
+}
+
+static bool read_webp_dimensions(const unsigned char* data, size_t size,
+                                 size_t* width, size_t* height) {
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK) return false;
+    *width = (size_t)features.width;
+    *height = (size_t)features.height;
+    return true;
+}
+
+// Streams encoded WebP data straight to the output file
+static int write_webp_to_file(const uint8_t* data, size_t data_size, const WebPPicture* picture) {
+    FILE* fp = (FILE*)picture->custom_ptr;
+    return data_size == 0 || fwrite(data, 1, data_size, fp) == data_size;
+}
+
+// Adds the metadata chunks to mux (a still image or an animation) and
+// writes the assembled VP8X container
+static bool write_webp_with_metadata(FILE* fp, WebPMux* mux, const ImageBlob* metadata) {
+    static const char* const fourcc[IMAGE_METADATA_COUNT] = { "EXIF", "ICCP", "XMP " };
+    bool success = true;
+    for (int i = 0; success && i < IMAGE_METADATA_COUNT; i++) {
+        if (!metadata[i].data) continue;
+        WebPData chunk = { metadata[i].data, metadata[i].size };
+        success = WebPMuxSetChunk(mux, fourcc[i], &chunk, 0) == WEBP_MUX_OK;
+    }
+
+    WebPData assembled;
+    WebPDataInit(&assembled);
+    success = success && WebPMuxAssemble(mux, &assembled) == WEBP_MUX_OK;
+    if (success) {
+        output_preallocate(fp, assembled.size);
+        success = fwrite(assembled.bytes, 1, assembled.size, fp) == assembled.size;
+    }
+
+    WebPDataClear(&assembled);
+    return success;
+}
+
+static WebPPreset to_webp_preset(WebPContentPreset preset) {
+    switch (preset) {
+        case WEBP_CONTENT_PHOTO: return WEBP_PRESET_PHOTO;
+        case WEBP_CONTENT_PICTURE: return WEBP_PRESET_PICTURE;
+        case WEBP_CONTENT_DRAWING: return WEBP_PRESET_DRAWING;
+        default: return WEBP_PRESET_DEFAULT;
+    }
+}
+
+// Encoder settings for options (NULL for defaults); false if invalid
+static bool init_webp_config(WebPConfig* config, const ConversionOptions* options) {
+    float quality = options ? (float)options->quality : 90.0f;
+    WebPPreset preset = options ? to_webp_preset(options->webp_options.preset) : WEBP_PRESET_DEFAULT;
+    if (!WebPConfigPreset(config, preset, quality)) {
+        return false;
+    }
+
+    // Configure based on options
+    if (options) {
+        config->method = options->webp_options.method;
+        config->thread_level = options->webp_options.thread_level ? 1 : 0;
+
+        if (options->webp_options.lossless) {
+            config->lossless = 1;
+            config->quality = 100;
+        }
+
+        // Near-lossless preprocessing only applies to the lossless encoder
+        if (options->webp_options.near_lossless < 100) {
+            config->lossless = 1;
+            config->near_lossless = options->webp_options.near_lossless < 0 ?
+                0 : options->webp_options.near_lossless;
+        }
+
+        if (options->webp_options.exact) {
+            config->exact = 1;
+        }
+    }
+
+    return WebPValidateConfig(config);
+}
+
+static bool save_webp_file(const char* filepath, const ImageData* img, const ConversionOptions* options) {
+    if (!img || !img->data || !filepath) {
+        return false;
+    }
+
+    // Set up WebP config
+    WebPConfig config;
+    if (!init_webp_config(&config, options)) {
+        return false;
+    }
+
+    // Set up WebP picture
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture)) {
+        return false;
+    }
+
+    picture.width = img->width;
+    picture.height = img->height;
+    picture.use_argb = 1;
+
+    // Allocate memory for the picture
+    if (!WebPPictureAlloc(&picture)) {
+        return false;
+    }
+
+    // Import RGBA data
+    if (!WebPPictureImportRGBA(&picture, img->data, img->stride)) {
+        WebPPictureFree(&picture);
+        return false;
+    }
+
+    FILE* fp = fopen(filepath, "wb");
+    if (!fp) {
+        printf("Error: Could not open file %s for writing\n", filepath);
+        WebPPictureFree(&picture);
+        return false;
+    }
+
+    // Encoded data is written as it is produced instead of being buffered,
+    // unless metadata chunks have to be muxed around the bitstream
+    bool keep_metadata = !options || options->maintain_exif;
+    bool has_metadata = false;
+    for (int i = 0; keep_metadata && i < IMAGE_METADATA_COUNT; i++) {
+        if (img->metadata[i].data) has_metadata = true;
+    }
+
+    bool success;
+    if (has_metadata) {
+        WebPMemoryWriter writer;
+        WebPMemoryWriterInit(&writer);
+        picture.writer = WebPMemoryWrite;
+        picture.custom_ptr = &writer;
+        success = WebPEncode(&config, &picture);
+        if (success) {
+            // Wraps the bitstream in a VP8X container next to the metadata
+            WebPMux* mux = WebPMuxNew();
+            WebPData image = { writer.mem, writer.size };
+            success = mux && WebPMuxSetImage(mux, &image, 0) == WEBP_MUX_OK &&
+                      write_webp_with_metadata(fp, mux, img->metadata);
+            WebPMuxDelete(mux);
+        }
+        WebPMemoryWriterClear(&writer);
+    } else {
+        picture.writer = write_webp_to_file;
+        picture.custom_ptr = fp;
+        success = WebPEncode(&config, &picture);
+    }
+
+    // Cleanup
+    WebPPictureFree(&picture);
+    if (fclose(fp) != 0) {
+        success = false;
+    }
+
+    return success;
+}
+
+
+// Frames of an animated WebP, composited onto the canvas one at a time
+struct AnimationDecoder {
+    unsigned char* data;            // Whole file; the demuxer indexes it in place
+    size_t size;
+    WebPAnimDecoder* decoder;
+    size_t width;
+    size_t height;
+    int timestamp;                  // End of the previous frame
+    size_t next_index;
+};
+
+// Reads fp from its start to the end into memory
+static unsigned char* read_stream(FILE* fp, size_t* size) {
+    if (fseek(fp, 0, SEEK_END) != 0) return NULL;
+    long length = ftell(fp);
+    if (length <= 0 || fseek(fp, 0, SEEK_SET) != 0) return NULL;
+
+    unsigned char* data = (unsigned char*)malloc((size_t)length);
+    if (!data) return NULL;
+    if (fread(data, 1, (size_t)length, fp) != (size_t)length) {
+        free(data);
+        return NULL;
+    }
+    *size = (size_t)length;
+    return data;
+}
+
+static void close_webp_animation(AnimationDecoder* decoder) {
+    if (!decoder) return;
+    if (decoder->decoder) WebPAnimDecoderDelete(decoder->decoder);
+    free(decoder->data);
+    free(decoder);
+}
+
+// Takes ownership of data, the whole file, and frees it on failure
+static AnimationDecoder* open_webp_animation_data(unsigned char* data, size_t size,
+                                                  const ConversionOptions* options,
+                                                  AnimationInfo* info) {
+    AnimationDecoder* decoder = (AnimationDecoder*)calloc(1, sizeof(AnimationDecoder));
+    if (!decoder) {
+        free(data);
+        return NULL;
+    }
+    decoder->data = data;
+    decoder->size = size;
+
+    WebPAnimDecoderOptions decoder_options;
+    if (!WebPAnimDecoderOptionsInit(&decoder_options)) {
+        close_webp_animation(decoder);
+        return NULL;
+    }
+    decoder_options.color_mode = MODE_RGBA;
+    decoder_options.use_threads = options && options->webp_options.decode_threads;
+
+    WebPData webp_data = { data, size };
+    decoder->decoder = WebPAnimDecoderNew(&webp_data, &decoder_options);
+    WebPAnimInfo anim_info;
+    if (!decoder->decoder || !WebPAnimDecoderGetInfo(decoder->decoder, &anim_info)) {
+        printf("Error: Could not parse animated WebP\n");
+        close_webp_animation(decoder);
+        return NULL;
+    }
+
+    decoder->width = anim_info.canvas_width;
+    decoder->height = anim_info.canvas_height;
+    info->width = decoder->width;
+    info->height = decoder->height;
+    info->frame_count = anim_info.frame_count;
+    info->loop_count = (int)anim_info.loop_count;
+    return decoder;
+}
+
+static AnimationDecoder* open_webp_animation(const char* filepath, const ConversionOptions* options,
+                                             AnimationInfo* info) {
+    FILE* fp = fopen(filepath, "rb");
+    if (!fp) {
+        printf("Error: Could not open WebP file %s\n", filepath);
+        return NULL;
+    }
+    size_t size = 0;
+    unsigned char* data = read_stream(fp, &size);
+    fclose(fp);
+    if (!data) {
+        printf("Error: Could not read WebP file %s\n", filepath);
+        return NULL;
+    }
+    return open_webp_animation_data(data, size, options, info);
+}
+
+// Copies the animation's EXIF, ICC and XMP chunks onto img
+static void read_webp_animation_metadata(const AnimationDecoder* decoder, ImageData* img) {
+    static const char* const fourcc[IMAGE_METADATA_COUNT] = { "EXIF", "ICCP", "XMP " };
+    const WebPDemuxer* demux = WebPAnimDecoderGetDemuxer(decoder->decoder);
+
+    for (int i = 0; demux && i < IMAGE_METADATA_COUNT; i++) {
+        WebPChunkIterator chunk;
+        if (!WebPDemuxGetChunk(demux, fourcc[i], 1, &chunk)) continue;
+        if (i == IMAGE_METADATA_EXIF) {
+            set_exif_metadata(img, chunk.chunk.bytes, chunk.chunk.size);
+        } else {
+            set_image_metadata(img, (ImageMetadataKind)i, chunk.chunk.bytes, chunk.chunk.size);
+        }
+        WebPDemuxReleaseChunkIterator(&chunk);
+    }
+}
+
+// Frames come out composited RGBA, so there is nothing left to convert
+static bool read_webp_frame(AnimationDecoder* decoder, AnimationFrame* frame, bool* failed) {
+    memset(frame, 0, sizeof(*frame));
+    frame->index = decoder->next_index;
+    *failed = false;
+    if (!WebPAnimDecoderHasMoreFrames(decoder->decoder)) return false;
+
+    uint8_t* canvas;
+    int timestamp;
+    if (!WebPAnimDecoderGetNext(decoder->decoder, &canvas, &timestamp)) {
+        printf("Error: Could not decode WebP frame %zu\n", frame->index + 1);
+        *failed = true;
+        return false;
+    }
+    frame->duration_ms = timestamp - decoder->timestamp;
+    decoder->timestamp = timestamp;
+
+    // The decoder reuses its canvas for the next frame
+    frame->image = create_image_data(decoder->width, decoder->height);
+    if (!frame->image) {
+        *failed = true;
+        return false;
+    }
+    memcpy(frame->image->data, canvas, decoder->width * decoder->height * 4);
+    if (frame->index == 0) {
+        read_webp_animation_metadata(decoder, frame->image);
+    }
+    decoder->next_index++;
+    return true;
+}
+
+// First frame of an animated WebP, for targets that hold a single image
+static ImageData* read_webp_first_frame(FILE* fp, const char* filepath,
+                                        const ConversionOptions* options) {
+    size_t size = 0;
+    unsigned char* data = read_stream(fp, &size);
+    if (!data) {
+        printf("Error: Could not read WebP file %s\n", filepath);
+        return NULL;
+    }
+
+    AnimationInfo info;
+    AnimationFrame frame = { 0 };
+    bool failed = false;
+    AnimationDecoder* decoder = open_webp_animation_data(data, size, options, &info);
+    if (decoder) {
+        read_webp_frame(decoder, &frame, &failed);
+        close_webp_animation(decoder);
+    }
+    return apply_exif_orientation(frame.image, options);
+}
+
+static bool is_webp_animated(const char* filepath) {
+    // The VP8X header's animation flag
+    unsigned char header[21];
+    FILE* fp = fopen(filepath, "rb");
+    if (!fp) return false;
+    bool animated = fread(header, 1, sizeof(header), fp) == sizeof(header) &&
+                    memcmp(header + 12, "VP8X", 4) == 0 && (header[20] & WEBP_VP8X_ANIMATION_FLAG);
+    fclose(fp);
+    return animated;
+}
+
+// Frames encoded into an animated WebP in memory
+struct AnimationEncoder {
+    WebPAnimEncoder* encoder;
+    WebPConfig config;
+    int timestamp_ms;               // Start of the next frame
+    ImageData* metadata;            // Holds the first frame's metadata for the muxer
+};
+
+static void close_webp_animation_encoder(AnimationEncoder* encoder) {
+    if (!encoder) return;
+    if (encoder->encoder) WebPAnimEncoderDelete(encoder->encoder);
+    if (encoder->metadata) {
+        free_image_data(encoder->metadata);
+        free(encoder->metadata);
+    }
+    free(encoder);
+}
+
+static AnimationEncoder* start_webp_animation(const ImageData* first, int loop_count,
+                                              const ConversionOptions* options) {
+    AnimationEncoder* encoder = (AnimationEncoder*)calloc(1, sizeof(AnimationEncoder));
+    if (!encoder) return NULL;
+
+    WebPAnimEncoderOptions encoder_options;
+    if (!init_webp_config(&encoder->config, options) ||
+        !WebPAnimEncoderOptionsInit(&encoder_options)) {
+        close_webp_animation_encoder(encoder);
+        return NULL;
+    }
+    encoder_options.anim_params.loop_count = loop_count;
+    encoder->encoder = WebPAnimEncoderNew((int)first->width, (int)first->height, &encoder_options);
+    if (!encoder->encoder) {
+        printf("Error: Could not create WebP animation encoder\n");
+        close_webp_animation_encoder(encoder);
+        return NULL;
+    }
+
+    if (!options || options->maintain_exif) {
+        encoder->metadata = create_image_data(1, 1);
+        if (!encoder->metadata || !copy_image_metadata(encoder->metadata, first)) {
+            close_webp_animation_encoder(encoder);
+            return NULL;
+        }
+    }
+    return encoder;
+}
+
+static bool add_webp_frame(AnimationEncoder* encoder, const ImageData* frame, int duration_ms) {
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture)) return false;
+    picture.width = (int)frame->width;
+    picture.height = (int)frame->height;
+    picture.use_argb = 1;
+    bool added = WebPPictureImportRGBA(&picture, frame->data, (int)frame->stride) &&
+                 WebPAnimEncoderAdd(encoder->encoder, &picture, encoder->timestamp_ms, &encoder->config);
+    if (!added) {
+        printf("Error: Could not encode WebP frame: %s\n", WebPAnimEncoderGetError(encoder->encoder));
+    }
+    WebPPictureFree(&picture);
+
+    encoder->timestamp_ms += duration_ms;
+    return added;
+}
+
+static bool finish_webp_animation(AnimationEncoder* encoder, const char* filepath) {
+    // A NULL frame marks where the last one ends
+    WebPData assembled;
+    WebPDataInit(&assembled);
+    if (!WebPAnimEncoderAdd(encoder->encoder, NULL, encoder->timestamp_ms, NULL) ||
+        !WebPAnimEncoderAssemble(encoder->encoder, &assembled)) {
+        printf("Error: Could not assemble WebP animation: %s\n", WebPAnimEncoderGetError(encoder->encoder));
+        return false;
+    }
+
+    FILE* fp = fopen(filepath, "wb");
+    bool written = fp != NULL;
+    if (!fp) {
+        printf("Error: Could not open file %s for writing\n", filepath);
+    } else if (encoder->metadata) {
+        WebPMux* mux = WebPMuxCreate(&assembled, 0);
+        written = mux && write_webp_with_metadata(fp, mux, encoder->metadata->metadata);
+        WebPMuxDelete(mux);
+    } else {
+        output_preallocate(fp, assembled.size);
+        written = fwrite(assembled.bytes, 1, assembled.size, fp) == assembled.size;
+    }
+    if (fp && fclose(fp) != 0) written = false;
+
+    WebPDataClear(&assembled);
+    return written;
+}
+
+static const CodecBackend webp_backend = {
+    .abi_version = CODEC_BACKEND_ABI_VERSION,
+    .format = FORMAT_WEBP,
+    .name = "webp",
+    .load = load_webp_file,
+    .load_memory = load_webp_memory,
+    .read_dimensions = read_webp_dimensions,
+    .save = save_webp_file,
+    .is_animated = is_webp_animated,
+    .open_animation = open_webp_animation,
+    .read_frame = read_webp_frame,
+    .close_animation = close_webp_animation,
+    .start_animation = start_webp_animation,
+    .add_frame = add_webp_frame,
+    .finish_animation = finish_webp_animation,
+    .close_animation_encoder = close_webp_animation_encoder
+};
+
+const CodecBackend* media_processor_codec_backend(void) {
+    return &webp_backend;
+}
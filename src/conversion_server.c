@@ -0,0 +1,542 @@
+#define _GNU_SOURCE
+#include "../include/conversion_server.h"
+#include "../include/codec_backend.h"
+#include "../include/codec.h"
+#include "../include/codec_cache.h"
+#include "../include/output_writer.h"
+#include "../include/parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_BACKLOG 64
+#define SERVER_LINE_MAX (2 * PATH_MAX + 64)     // A CONVERT request with two full paths
+#define SERVER_MAX_FIELDS 6
+#define SERVER_MAX_FDS 2                        // Descriptors accepted with one request
+#define SERVER_MAX_DATA_BYTES (1ull << 30)      // Largest CONVERT-DATA input
+
+typedef struct {
+    int listen_fd;
+    int stop_fd;                    // Becomes readable once the server stops
+    ConversionOptions options;
+} ConversionServer;
+
+// Buffered reads from a socket, keeping the descriptors that came with them
+typedef struct {
+    int fd;
+    int stop_fd;                    // Reads give up once this is readable (-1 = never)
+    char buffer[SERVER_LINE_MAX];
+    size_t length;
+    int fds[SERVER_MAX_FDS];
+    int fd_count;
+} SocketStream;
+
+// Waits for fd to become readable; false if stop_fd did first
+static bool wait_readable(int fd, int stop_fd) {
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN }
+    };
+
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return fds[1].revents == 0;
+}
+
+static void close_received_fds(SocketStream* stream) {
+    for (int i = 0; i < stream->fd_count; i++) {
+        close(stream->fds[i]);
+    }
+    stream->fd_count = 0;
+}
+
+// Appends whatever arrives next to the buffer; false on EOF, errors or stop
+static bool receive_more(SocketStream* stream) {
+    if (stream->length == sizeof(stream->buffer)) return false;
+    if (!wait_readable(stream->fd, stream->stop_fd)) return false;
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * SERVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = stream->buffer + stream->length,
+        .iov_len = sizeof(stream->buffer) - stream->length
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(stream->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) return false;
+    stream->length += (size_t)received;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (stream->fd_count < SERVER_MAX_FDS) {
+                stream->fds[stream->fd_count++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    return true;
+}
+
+// Next line without its newline
+static bool read_line(SocketStream* stream, char* line, size_t size) {
+    while (true) {
+        char* newline = memchr(stream->buffer, '\n', stream->length);
+        if (newline) {
+            size_t length = (size_t)(newline - stream->buffer);
+            if (length >= size) return false;
+
+            memcpy(line, stream->buffer, length);
+            line[length] = '\0';
+            stream->length -= length + 1;
+            memmove(stream->buffer, newline + 1, stream->length);
+            return true;
+        }
+        if (!receive_more(stream)) return false;
+    }
+}
+
+// Exactly size bytes following the last line
+static bool read_payload(SocketStream* stream, unsigned char* data, size_t size) {
+    size_t buffered = stream->length < size ? stream->length : size;
+    memcpy(data, stream->buffer, buffered);
+    stream->length -= buffered;
+    memmove(stream->buffer, stream->buffer + buffered, stream->length);
+
+    size_t done = buffered;
+    while (done < size) {
+        if (!wait_readable(stream->fd, stream->stop_fd)) return false;
+        ssize_t received = recv(stream->fd, data + done, size - done, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        done += (size_t)received;
+    }
+    return true;
+}
+
+// Sends all of data, with fds attached to its first byte
+static bool send_message(int socket_fd, const void* data, size_t size, const int* fds, int fd_count) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * SERVER_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    const unsigned char* bytes = data;
+
+    while (size > 0) {
+        struct iovec iov = { .iov_base = (void*)bytes, .iov_len = size };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if (fd_count > 0) {
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+        }
+
+        ssize_t sent = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= (size_t)sent;
+        fd_count = 0;
+    }
+    return true;
+}
+
+static bool send_reply(int socket_fd, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+
+    if (length < 0) return false;
+    if ((size_t)length > sizeof(line) - 2) length = sizeof(line) - 2;
+    line[length++] = '\n';
+    return send_message(socket_fd, line, (size_t)length, NULL, 0);
+}
+
+// Splits line at tabs, in place
+static size_t split_fields(char* line, char** fields) {
+    size_t count = 0;
+    while (count < SERVER_MAX_FIELDS) {
+        fields[count++] = line;
+        line = strchr(line, '\t');
+        if (!line) break;
+        *line++ = '\0';
+    }
+    return line ? SERVER_MAX_FIELDS + 1 : count;
+}
+
+static bool parse_quality(const char* str, int* quality) {
+    char* end = NULL;
+    long value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || value < 0 || value > 100) return false;
+    *quality = (int)value;
+    return true;
+}
+
+// Runs one request; false if the connection should be dropped
+static bool handle_request(const ConversionServer* server, SocketStream* stream, char* line) {
+    char* fields[SERVER_MAX_FIELDS];
+    size_t count = split_fields(line, fields);
+    ConversionOptions options = server->options;
+    const char* command = fields[0];
+
+    // Arguments before the optional quality
+    size_t arguments;
+    if (strcmp(command, "CONVERT") == 0) {
+        arguments = 4;
+    } else if (strcmp(command, "CONVERT-FD") == 0) {
+        arguments = 3;
+    } else if (strcmp(command, "CONVERT-DATA") == 0) {
+        arguments = 4;
+    } else {
+        return send_reply(stream->fd, "ERROR\tUnknown request %.64s", command);
+    }
+    if (count != arguments && count != arguments + 1) {
+        return send_reply(stream->fd, "ERROR\tWrong number of fields for %s", command);
+    }
+    if (count > arguments && !parse_quality(fields[arguments], &options.quality)) {
+        return send_reply(stream->fd, "ERROR\tInvalid quality");
+    }
+
+    if (strcmp(command, "CONVERT") == 0) {
+        ImageFormat target_format = string_to_format(fields[1]);
+        if (target_format == FORMAT_UNKNOWN) {
+            return send_reply(stream->fd, "ERROR\tUnsupported target format");
+        }
+        bool converted = convert_image(fields[2], fields[3], target_format, &options);
+        return send_reply(stream->fd, converted ? "OK" : "ERROR\tConversion failed");
+    }
+
+    ImageFormat input_format = string_to_format(fields[1]);
+    ImageFormat target_format = string_to_format(fields[2]);
+    if (input_format == FORMAT_UNKNOWN || target_format == FORMAT_UNKNOWN) {
+        return send_reply(stream->fd, "ERROR\tUnsupported format");
+    }
+
+    if (strcmp(command, "CONVERT-FD") == 0) {
+        if (stream->fd_count != 2) {
+            return send_reply(stream->fd, "ERROR\tExpected an input and an output descriptor");
+        }
+
+        // The codecs open files by name, and the client's output may be unnamed
+        char input_path[32];
+        char output_path[32];
+        snprintf(input_path, sizeof(input_path), "/proc/self/fd/%d", stream->fds[0]);
+        snprintf(output_path, sizeof(output_path), "/proc/self/fd/%d", stream->fds[1]);
+        bool converted = convert_image_as(input_path, input_format, output_path, target_format, &options);
+        return send_reply(stream->fd, converted ? "OK" : "ERROR\tConversion failed");
+    }
+
+    // CONVERT-DATA: the input arrives after the request and the output goes back
+    char* end = NULL;
+    unsigned long long size = strtoull(fields[3], &end, 10);
+    if (end == fields[3] || *end != '\0' || size == 0 || size > SERVER_MAX_DATA_BYTES) {
+        // The payload can't be skipped without a valid size
+        send_reply(stream->fd, "ERROR\tInvalid size");
+        return false;
+    }
+
+    unsigned char* data = malloc((size_t)size);
+    if (!data) {
+        send_reply(stream->fd, "ERROR\tOut of memory");
+        return false;
+    }
+    if (!read_payload(stream, data, (size_t)size)) {
+        free(data);
+        return false;
+    }
+
+    // Both sides live in memory files the codecs can open by name
+    MemoryOutput input;
+    MemoryOutput output;
+    size_t output_size = 0;
+    bool converted = false;
+    if (memory_output_open(&input)) {
+        if (write_file_data(input.path, data, (size_t)size) && memory_output_open(&output)) {
+            converted = convert_image_as(input.path, input_format, output.path, target_format, &options);
+            free(data);
+            data = converted ? memory_output_read(&output, &output_size) : NULL;
+            converted = data != NULL;
+            memory_output_close(&output);
+        }
+        memory_output_close(&input);
+    }
+
+    bool sent = converted ? send_reply(stream->fd, "OK\t%zu", output_size) &&
+                            send_message(stream->fd, data, output_size, NULL, 0)
+                          : send_reply(stream->fd, "ERROR\tConversion failed");
+    free(data);
+    return sent;
+}
+
+// Answers requests until the client hangs up or the server stops
+static void serve_connection(const ConversionServer* server, int fd) {
+    SocketStream* stream = calloc(1, sizeof(SocketStream));
+    if (!stream) return;
+    stream->fd = fd;
+    stream->stop_fd = server->stop_fd;
+
+    char line[SERVER_LINE_MAX];
+    bool open = true;
+    while (open && read_line(stream, line, sizeof(line))) {
+        open = handle_request(server, stream, line);
+        close_received_fds(stream);
+    }
+    close_received_fds(stream);
+    free(stream);
+}
+
+static void* server_worker(void* arg) {
+    const ConversionServer* server = arg;
+
+    // Every worker waits on the listening socket; one of them gets each client
+    while (wait_readable(server->listen_fd, server->stop_fd)) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            // Out of descriptors: give running requests time to finish
+            if (errno == EMFILE || errno == ENFILE) usleep(10000);
+            continue;
+        }
+        serve_connection(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static bool fill_socket_address(struct sockaddr_un* address, const char* socket_path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        printf("Error: Socket path too long: %s\n", socket_path);
+        return false;
+    }
+    strcpy(address->sun_path, socket_path);
+    return true;
+}
+
+// Removes a socket left behind by a server that is gone, but not a live one
+static bool remove_stale_socket(const struct sockaddr_un* address) {
+    struct stat st;
+    if (lstat(address->sun_path, &st) != 0) return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode)) {
+        printf("Error: %s exists and is not a socket\n", address->sun_path);
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = fd >= 0 && connect(fd, (const struct sockaddr*)address, sizeof(*address)) == 0;
+    if (fd >= 0) close(fd);
+    if (live) {
+        printf("Error: A server is already listening on %s\n", address->sun_path);
+        return false;
+    }
+    return unlink(address->sun_path) == 0 || errno == ENOENT;
+}
+
+bool run_conversion_server(const char* socket_path, const ConversionOptions* options,
+                           int workers) {
+    struct sockaddr_un address;
+    if (!socket_path || !options || !fill_socket_address(&address, socket_path) ||
+        !remove_stale_socket(&address)) {
+        return false;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        printf("Error: Could not create socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Requests name any file we can reach, so only our user may connect
+    mode_t mask = umask(0177);
+    bool bound = bind(listen_fd, (const struct sockaddr*)&address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listen_fd, SERVER_BACKLOG) != 0) {
+        printf("Error: Could not listen on %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        if (bound) unlink(socket_path);
+        return false;
+    }
+
+    int stop_pipe[2];
+    if (pipe2(stop_pipe, O_CLOEXEC) != 0) {
+        printf("Error: Could not create pipe: %s\n", strerror(errno));
+        close(listen_fd);
+        unlink(socket_path);
+        return false;
+    }
+
+    ConversionServer server = {
+        .listen_fd = listen_fd,
+        .stop_fd = stop_pipe[0],
+        .options = *options
+    };
+    if (workers <= 0) workers = parallel_cpu_count();
+
+    // Codec modules are loaded up front rather than by the first request
+    // needing each; missing ones are reported when a request does
+    for (size_t i = 0; i < codec_count(); i++) {
+        const Codec* codec = codec_at(i);
+        CodecModuleInfo info;
+        if (codec->capabilities & CODEC_CAP_LOADABLE) codec_module_info(codec->format, &info);
+    }
+
+    // Concurrent requests already keep every core busy
+    if (workers > 1) {
+        codec_limit_threads(&server.options, 1);
+    }
+    if (workers > 1 && server.options.quality_target.threads == 0) {
+        server.options.quality_target.threads = 1;
+    }
+
+    // Workers inherit the blocked signals, leaving them to sigwait() below;
+    // clients hanging up mid-reply must not kill the server
+    sigset_t signals;
+    sigset_t previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t* threads = calloc((size_t)workers, sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < workers &&
+           pthread_create(&threads[started], NULL, server_worker, &server) == 0) {
+        started++;
+    }
+
+    if (started > 0) {
+        printf("Serving conversions on %s with %d worker%s\n", socket_path, started,
+               started == 1 ? "" : "s");
+        fflush(stdout);
+
+        int signal_number;
+        sigwait(&signals, &signal_number);
+        printf("Stopping server\n");
+    } else {
+        printf("Error: Could not start server workers\n");
+    }
+
+    // Requests in progress are completed and answered first
+    close(stop_pipe[1]);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (started > 0) {
+        CodecContextStats start;
+        CodecContextStats end;
+        memset(&start, 0, sizeof(start));
+        codec_context_stats(&end);
+        uint64_t reused;
+        double saved_ns = codec_context_saved_ns(&start, &end, &reused);
+        printf("Codec contexts: %llu reused across requests, ~%.1f ms of setup saved\n",
+               (unsigned long long)reused, saved_ns / 1e6);
+    }
+
+    free(threads);
+    close(stop_pipe[0]);
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return started > 0;
+}
+
+bool convert_with_server(const char* socket_path, const char* input_path,
+                         const char* output_path, const ConversionOptions* options,
+                         int quality) {
+    struct sockaddr_un address;
+    if (!socket_path || !input_path || !output_path || !fill_socket_address(&address, socket_path)) {
+        return false;
+    }
+
+    ImageFormat input_format = detect_format(input_path);
+    ImageFormat target_format = detect_format(output_path);
+    if (input_format == FORMAT_UNKNOWN || target_format == FORMAT_UNKNOWN) {
+        printf("Error: Unknown format for %s\n", input_format == FORMAT_UNKNOWN ? input_path : output_path);
+        return false;
+    }
+
+    int input_fd = open(input_path, O_RDONLY | O_CLOEXEC);
+    if (input_fd < 0) {
+        printf("Error: Could not open %s: %s\n", input_path, strerror(errno));
+        return false;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0 || connect(socket_fd, (const struct sockaddr*)&address, sizeof(address)) != 0) {
+        printf("Error: Could not connect to %s: %s\n", socket_path, strerror(errno));
+        if (socket_fd >= 0) close(socket_fd);
+        close(input_fd);
+        return false;
+    }
+
+    OutputFile output;
+    OutputSyncPolicy sync = options ? options->sync : OUTPUT_SYNC_NONE;
+    if (!output_file_open(&output, output_path, sync)) {
+        close(socket_fd);
+        close(input_fd);
+        return false;
+    }
+
+    char request[64];
+    int length = quality >= 0
+        ? snprintf(request, sizeof(request), "CONVERT-FD\t%s\t%s\t%d\n",
+                   format_to_string(input_format), format_to_string(target_format), quality)
+        : snprintf(request, sizeof(request), "CONVERT-FD\t%s\t%s\n",
+                   format_to_string(input_format), format_to_string(target_format));
+    int fds[2] = { input_fd, output.fd };
+
+    SocketStream* reply = calloc(1, sizeof(SocketStream));
+    char line[256] = "";
+    bool converted = reply && send_message(socket_fd, request, (size_t)length, fds, 2);
+    if (converted) {
+        reply->fd = socket_fd;
+        reply->stop_fd = -1;
+        converted = read_line(reply, line, sizeof(line)) && strcmp(line, "OK") == 0;
+        close_received_fds(reply);
+    }
+    free(reply);
+    close(socket_fd);
+    close(input_fd);
+
+    if (!converted) {
+        const char* message = strncmp(line, "ERROR\t", 6) == 0 ? line + 6 : "No reply";
+        printf("Error: Server could not convert %s: %s\n", input_path, message);
+    }
+    return output_file_finish(&output, converted);
+}
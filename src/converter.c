@@ -1,54 +1,95 @@
 #include "../include/converter.h"
+#include "../include/png_writer.h"
+#include "../include/image_ops.h"
+#include "../include/output_writer.h"
+#include "../include/parallel.h"
+#include "../include/quality_search.h"
+#include "../include/codec_cache.h"
+#include "../include/codec_backend.h"
+#include "../include/codec.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <png.h>
+#include <zlib.h>
 #include <jpeglib.h>
 #include <setjmp.h>
-#include <webp/decode.h>
-#include <webp/encode.h>
-#include <avif/avif.h>
-#include <libheif/heif.h>
-
-// Removed 'static' keyword since this is now a public function
-ImageData* load_png(const char* filepath) {
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        printf("Error: Could not open file %s\n", filepath);
-        return NULL;
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Keyword of the iTXt chunk that carries XMP in PNG files
+#define PNG_XMP_KEYWORD "XML:com.adobe.xmp"
+
+static ImageData* read_jpeg_stream(FILE* fp, size_t scale, const ConversionOptions* options);
+
+// Copies eXIf, iCCP and XMP iTXt chunks seen before and after IDAT
+static void read_png_metadata(png_structp png, png_infop info, ImageData* img) {
+    png_uint_32 exif_size = 0;
+    png_bytep exif = NULL;
+    if (png_get_eXIf_1(png, info, &exif_size, &exif) && exif) {
+        set_exif_metadata(img, exif, exif_size);
+    }
+
+    png_charp profile_name;
+    int compression_type;
+    png_bytep profile;
+    png_uint_32 profile_size;
+    if (png_get_iCCP(png, info, &profile_name, &compression_type, &profile, &profile_size)) {
+        set_image_metadata(img, IMAGE_METADATA_ICC, profile, profile_size);
+    }
+
+    png_textp text;
+    int text_count = 0;
+    png_get_text(png, info, &text, &text_count);
+    for (int i = 0; i < text_count; i++) {
+        if (strcmp(text[i].key, PNG_XMP_KEYWORD) == 0 && text[i].text) {
+            size_t length = text[i].compression >= PNG_ITXT_COMPRESSION_NONE ?
+                            text[i].itxt_length : text[i].text_length;
+            set_image_metadata(img, IMAGE_METADATA_XMP, text[i].text, length);
+            break;
+        }
     }
+}
 
+// Decodes a PNG from fp; the caller opens and closes the stream
+static ImageData* read_png_stream(FILE* fp, const ConversionOptions* options) {
     // Read PNG signature
     unsigned char header[8];
     if (fread(header, 1, 8, fp) != 8) {
-        fclose(fp);
         return NULL;
     }
 
     // Verify PNG signature
     if (png_sig_cmp(header, 0, 8)) {
-        fclose(fp);
         return NULL;
     }
 
     // Initialize PNG structs
     png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
-        fclose(fp);
         return NULL;
     }
 
     png_infop info = png_create_info_struct(png);
     if (!info) {
         png_destroy_read_struct(&png, NULL, NULL);
-        fclose(fp);
         return NULL;
     }
 
+    // Freed on a libpng error too, so kept out of registers across setjmp
+    ImageData* volatile img = NULL;
+    png_bytep* volatile row_pointers = NULL;
+
     // Error handling
     if (setjmp(png_jmpbuf(png))) {
+        free(row_pointers);
+        if (img) {
+            free_image_data(img);
+            free(img);
+        }
         png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
         return NULL;
     }
 
@@ -87,151 +128,533 @@ ImageData* load_png(const char* filepath) {
     png_read_update_info(png, info);
 
     // Allocate memory for image data
-    ImageData* img = (ImageData*)malloc(sizeof(ImageData));
+    img = create_decoded_image(width, height, options);
     if (!img) {
         png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
         return NULL;
     }
 
-    img->width = width;
-    img->height = height;
-    img->channels = 4; // RGBA
-    img->size = width * height * 4;
-    img->data = (unsigned char*)malloc(img->size);
-
-    if (!img->data) {
+    // Read image data
+    row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
+    if (!row_pointers) {
+        free_image_data(img);
         free(img);
         png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
         return NULL;
     }
-
-    // Read image data
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
     for (int y = 0; y < height; y++) {
-        row_pointers[y] = img->data + y * width * 4;
+        row_pointers[y] = image_row(img, y);
     }
 
     png_read_image(png, row_pointers);
 
+    // Metadata chunks may also follow the image data
+    png_read_end(png, info);
+    read_png_metadata(png, info, img);
+
     // Cleanup
     free(row_pointers);
     png_destroy_read_struct(&png, &info, NULL);
-    fclose(fp);
 
+    return apply_exif_orientation(img, options);
+}
+
+// Removed 'static' keyword since this is now a public function
+ImageData* load_png(const char* filepath, const ConversionOptions* options) {
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) {
+        printf("Error: Could not open file %s\n", filepath);
+        return NULL;
+    }
+
+    ImageData* img = read_png_stream(fp, options);
+    fclose(fp);
     return img;
 }
 
-// The rest of your functions remain the same
+// Signature first, since extensions lie; files that don't exist yet (outputs)
+// and formats without a signature go by extension
 ImageFormat detect_format(const char* filepath) {
-    // Always check extension first for non-existent (output) files
     const char* ext = strrchr(filepath, '.');
     if (!ext) return FORMAT_UNKNOWN;
-    ext++;
+    const Codec* by_extension = codec_for_extension(ext + 1);
 
-    // For output files, we can only rely on extension
     FILE* fp = fopen(filepath, "rb");
-    if (!fp) {
-        // File doesn't exist (probably an output file), use extension
-        if (strcasecmp(ext, "heic") == 0) return FORMAT_HEIC;
-        if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0) return FORMAT_JPG;
-        if (strcasecmp(ext, "png") == 0) return FORMAT_PNG;
-        if (strcasecmp(ext, "webp") == 0) return FORMAT_WEBP;
-        if (strcasecmp(ext, "avif") == 0) return FORMAT_AVIF;
-        return FORMAT_UNKNOWN;
-    }
+    if (!fp) return by_extension ? by_extension->format : FORMAT_UNKNOWN;
 
-    // For existing files, try signature detection first
     unsigned char header[32];
     size_t bytes_read = fread(header, 1, 32, fp);
     fclose(fp);
 
-    if (bytes_read >= 8) {
-        // Check PNG signature
-        if (png_sig_cmp(header, 0, 8) == 0) {
-            return FORMAT_PNG;
-        }
+    const Codec* codec = codec_probe(header, bytes_read);
+    if (!codec) codec = by_extension;
+    return codec ? codec->format : FORMAT_UNKNOWN;
+}
+
+const char* format_to_string(ImageFormat format) {
+    const Codec* codec = codec_for_format(format);
+    return codec ? codec->name : "UNKNOWN";
+}
+
+ImageFormat string_to_format(const char* str) {
+    const Codec* codec = codec_for_extension(str);
+    return codec ? codec->format : FORMAT_UNKNOWN;
+}
+
+bool string_to_format_list(const char* str, ImageFormat* formats, size_t* count) {
+    if (!str || !formats || !count) return false;
+
+    *count = 0;
+    const char* start = str;
+    while (true) {
+        const char* end = strchr(start, ',');
+        size_t length = end ? (size_t)(end - start) : strlen(start);
 
-        // Check JPEG signature
-        if (header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
-            return FORMAT_JPG;
+        char name[16];
+        if (length == 0 || length >= sizeof(name)) return false;
+        memcpy(name, start, length);
+        name[length] = '\0';
+
+        ImageFormat format = string_to_format(name);
+        if (format == FORMAT_UNKNOWN) return false;
+        for (size_t i = 0; i < *count; i++) {
+            if (formats[i] == format) return false;
         }
+        formats[(*count)++] = format;
+
+        if (!end) return true;
+        start = end + 1;
+    }
+}
+
+char* format_output_path(const char* path, ImageFormat format) {
+    if (!path) return NULL;
+
+    const char* slash = strrchr(path, '/');
+    const char* dot = strrchr(slash ? slash + 1 : path, '.');
+    size_t base_len = dot ? (size_t)(dot - path) : strlen(path);
+    const char* ext = format_to_string(format);
+
+    size_t length = base_len + strlen(ext) + 2;
+    char* output = (char*)malloc(length);
+    if (output) {
+        snprintf(output, length, "%.*s.%s", (int)base_len, path, ext);
+    }
+    return output;
+}
+
+bool string_to_png_effort(const char* str, PngEffort* effort) {
+    if (!str || !effort) return false;
+
+    if (strcasecmp(str, "fast") == 0) *effort = PNG_EFFORT_FAST;
+    else if (strcasecmp(str, "default") == 0) *effort = PNG_EFFORT_DEFAULT;
+    else if (strcasecmp(str, "max") == 0) *effort = PNG_EFFORT_MAX;
+    else return false;
+
+    return true;
+}
+
+bool string_to_webp_preset(const char* str, WebPContentPreset* preset) {
+    if (!str || !preset) return false;
+
+    if (strcasecmp(str, "default") == 0) *preset = WEBP_CONTENT_DEFAULT;
+    else if (strcasecmp(str, "photo") == 0) *preset = WEBP_CONTENT_PHOTO;
+    else if (strcasecmp(str, "picture") == 0) *preset = WEBP_CONTENT_PICTURE;
+    else if (strcasecmp(str, "drawing") == 0) *preset = WEBP_CONTENT_DRAWING;
+    else return false;
+
+    return true;
+}
+
+bool string_to_sync_policy(const char* str, OutputSyncPolicy* policy) {
+    if (!str || !policy) return false;
+
+    if (strcasecmp(str, "none") == 0) *policy = OUTPUT_SYNC_NONE;
+    else if (strcasecmp(str, "file") == 0) *policy = OUTPUT_SYNC_FILE;
+    else if (strcasecmp(str, "batch") == 0) *policy = OUTPUT_SYNC_BATCH;
+    else return false;
+
+    return true;
+}
+
+void init_conversion_options(ConversionOptions* options) {
+    if (!options) return;
+
+    memset(options, 0, sizeof(*options));
+    options->quality = 90;
+    options->maintain_exif = true;
+    options->apply_orientation = true;
+    options->crop.width = 0;              // Whole image
+    options->crop.height = 0;
+    options->spill_threshold = 0;         // A quarter of the memory limit
+    options->jpeg_options.progressive = false;
+    options->jpeg_options.optimization = 0;
+    options->jpeg_options.lossless_transcode = true;
+    options->png_options.threads = 0;     // All cores for large images
+    options->png_options.effort = PNG_EFFORT_DEFAULT;
+    options->png_options.reduce_colors = true;
+    options->webp_options.lossless = false;
+    options->webp_options.exact = false;
+    options->webp_options.method = 4;         // libwebp's default
+    options->webp_options.thread_level = true;
+    options->webp_options.preset = WEBP_CONTENT_DEFAULT;
+    options->webp_options.near_lossless = 100; // Off
+    options->webp_options.decode_threads = true;
+    options->webp_options.decode_width = 0;   // Native size
+    options->webp_options.decode_height = 0;
+    options->avif_options.speed = 6;      // Medium speed
+    options->avif_options.lossless = false;
+    options->avif_options.threads = 0;    // All cores
+    options->heic_options.decoder_threads = 0;  // All cores
+    options->heic_options.preset = NULL;
+    options->heic_options.tune = NULL;
+    options->heic_options.chroma = NULL;
+    options->heic_options.lossless = false;
+    options->quality_target.kind = QUALITY_TARGET_NONE;
+    options->quality_target.threads = 0;  // All cores
+    options->sync = OUTPUT_SYNC_NONE;
+}
+
+struct ImageStorage {
+    unsigned char* data;
+    ImageReleaseFunc release;      // NULL if data was allocated with malloc
+    void* release_ctx;
+    atomic_int refcount;
+    unsigned char* metadata[IMAGE_METADATA_COUNT];  // Owned copies behind ImageData.metadata
+};
+
+static ImageStorage* create_image_storage(unsigned char* data, ImageReleaseFunc release,
+                                          void* release_ctx) {
+    ImageStorage* storage = (ImageStorage*)malloc(sizeof(ImageStorage));
+    if (!storage) return NULL;
+
+    storage->data = data;
+    storage->release = release;
+    storage->release_ctx = release_ctx;
+    atomic_init(&storage->refcount, 1);
+    memset(storage->metadata, 0, sizeof(storage->metadata));
+    return storage;
+}
+
+static void release_image_storage(ImageStorage* storage) {
+    if (!storage || atomic_fetch_sub(&storage->refcount, 1) != 1) return;
+
+    if (storage->release) {
+        storage->release(storage->release_ctx);
+    } else {
+        free(storage->data);
+    }
+    for (int i = 0; i < IMAGE_METADATA_COUNT; i++) {
+        free(storage->metadata[i]);
+    }
+    free(storage);
+}
+
+// Buffer for a decoder to fill; mapped from a temporary file if too large
+ImageData* create_decoded_image(size_t width, size_t height, const ConversionOptions* options) {
+    if (image_should_spill(width, height, options)) {
+        return create_mapped_image_data(width, height);
+    }
+    return create_image_data(width, height);
+}
+
+ImageData* create_image_data(size_t width, size_t height) {
+    unsigned char* data = (unsigned char*)malloc(width * height * 4);
+    if (!data) return NULL;
+
+    ImageData* img = wrap_image_data(data, width, height, width * 4, NULL, NULL);
+    if (!img) {
+        free(data);
+        return NULL;
+    }
+
+    return img;
+}
+
+ImageData* wrap_image_data(unsigned char* data, size_t width, size_t height, size_t stride,
+                           ImageReleaseFunc release, void* release_ctx) {
+    ImageData* img = (ImageData*)malloc(sizeof(ImageData));
+    if (!img) return NULL;
+
+    img->storage = create_image_storage(data, release, release_ctx);
+    if (!img->storage) {
+        free(img);
+        return NULL;
+    }
+
+    img->data = data;
+    img->width = width;
+    img->height = height;
+    img->channels = 4; // RGBA
+    img->stride = stride;
+    img->size = stride * height;
+    memset(img->metadata, 0, sizeof(img->metadata));
+
+    return img;
+}
+
+ImageData* create_image_view(const ImageData* src, size_t x, size_t y,
+                             size_t width, size_t height) {
+    if (!src || !src->data || width == 0 || height == 0 ||
+        x > src->width || width > src->width - x ||
+        y > src->height || height > src->height - y) {
+        return NULL;
+    }
+
+    ImageData* view = (ImageData*)malloc(sizeof(ImageData));
+    if (!view) return NULL;
+
+    atomic_fetch_add(&src->storage->refcount, 1);
+    view->storage = src->storage;
+    view->data = image_row(src, y) + x * 4;
+    view->width = width;
+    view->height = height;
+    view->channels = 4; // RGBA
+    view->stride = src->stride;
+    view->size = (height - 1) * src->stride + width * 4;
+    memcpy(view->metadata, src->metadata, sizeof(view->metadata));
+
+    return view;
+}
+
+bool set_image_metadata(ImageData* img, ImageMetadataKind kind, const void* data, size_t size) {
+    if (!img || !img->storage || kind >= IMAGE_METADATA_COUNT) return false;
 
-        // Check WebP signature (needs 12 bytes)
-        if (bytes_read >= 12 && memcmp(header, "RIFF", 4) == 0 && 
-            memcmp(header + 8, "WEBP", 4) == 0) {
-            return FORMAT_WEBP;
+    // One spare byte keeps text payloads (XMP) usable as C strings
+    unsigned char* copy = NULL;
+    if (data && size > 0) {
+        copy = (unsigned char*)malloc(size + 1);
+        if (!copy) return false;
+        memcpy(copy, data, size);
+        copy[size] = '\0';
+    }
+
+    free(img->storage->metadata[kind]);
+    img->storage->metadata[kind] = copy;
+    img->metadata[kind].data = copy;
+    img->metadata[kind].size = copy ? size : 0;
+    return true;
+}
+
+bool copy_image_metadata(ImageData* dst, const ImageData* src) {
+    if (!dst || !src) return false;
+
+    for (int i = 0; i < IMAGE_METADATA_COUNT; i++) {
+        if (!set_image_metadata(dst, (ImageMetadataKind)i, src->metadata[i].data,
+                                src->metadata[i].size)) {
+            return false;
         }
+    }
+    return true;
+}
 
-        // Check AVIF signature (look for 'ftyp' and 'avif' in the header)
-        if (bytes_read >= 32) {
-            for (size_t i = 0; i < bytes_read - 8; i++) {
-                if (memcmp(header + i, "ftyp", 4) == 0) {
-                    if (memcmp(header + i + 4, "avif", 4) == 0 ||
-                        memcmp(header + i + 4, "avis", 4) == 0) {
-                        return FORMAT_AVIF;
-                    }
-                }
-            }
+// Stores an EXIF blob, dropping the "Exif\0\0" prefix some containers keep
+void set_exif_metadata(ImageData* img, const unsigned char* data, size_t size) {
+    if (size >= 6 && memcmp(data, "Exif\0\0", 6) == 0) {
+        data += 6;
+        size -= 6;
+    }
+    set_image_metadata(img, IMAGE_METADATA_EXIF, data, size);
+}
+
+// Rotates a freshly loaded image upright and resets its orientation tag.
+// On failure the unrotated image is returned with its tag untouched.
+ImageData* apply_exif_orientation(ImageData* img, const ConversionOptions* options) {
+    if (!img || (options && !options->apply_orientation)) return img;
+
+    const ImageBlob* exif = &img->metadata[IMAGE_METADATA_EXIF];
+    int orientation = exif_get_orientation(exif->data, exif->size);
+    if (orientation == EXIF_ORIENTATION_NORMAL) return img;
+
+    ImageData* oriented = orient_image(img, orientation);
+    if (!oriented || !copy_image_metadata(oriented, img)) {
+        if (oriented) {
+            free_image_data(oriented);
+            free(oriented);
         }
+        printf("Warning: Could not apply EXIF orientation %d\n", orientation);
+        return img;
     }
 
-    // Fallback to extension-based detection for existing files
-    if (strcasecmp(ext, "heic") == 0) return FORMAT_HEIC;
-    if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0) return FORMAT_JPG;
-    if (strcasecmp(ext, "png") == 0) return FORMAT_PNG;
-    if (strcasecmp(ext, "webp") == 0) return FORMAT_WEBP;
-    if (strcasecmp(ext, "avif") == 0) return FORMAT_AVIF;
-    
-    return FORMAT_UNKNOWN;
+    exif_set_orientation((unsigned char*)oriented->metadata[IMAGE_METADATA_EXIF].data,
+                         oriented->metadata[IMAGE_METADATA_EXIF].size, EXIF_ORIENTATION_NORMAL);
+    free_image_data(img);
+    free(img);
+    return oriented;
 }
 
-const char* format_to_string(ImageFormat format) {
-    switch (format) {
-        case FORMAT_HEIC: return "HEIC";
-        case FORMAT_JPG: return "JPG";
-        case FORMAT_PNG: return "PNG";
-        case FORMAT_WEBP: return "WEBP";
-        case FORMAT_AVIF: return "AVIF";
-        default: return "UNKNOWN";
+// Narrows a loaded image to options->crop; the view keeps the pixels and
+// metadata of img alive, so nothing is copied
+ImageData* apply_crop(ImageData* img, const ConversionOptions* options) {
+    if (!img || !options || options->crop.width == 0 || options->crop.height == 0) return img;
+
+    size_t x = options->crop.x;
+    size_t y = options->crop.y;
+    if (x >= img->width || y >= img->height) {
+        printf("Error: Crop region lies outside the %zux%zu image\n", img->width, img->height);
+        free_image_data(img);
+        free(img);
+        return NULL;
     }
+    size_t width = options->crop.width < img->width - x ? options->crop.width : img->width - x;
+    size_t height = options->crop.height < img->height - y ? options->crop.height : img->height - y;
+
+    ImageData* view = create_image_view(img, x, y, width, height);
+    free_image_data(img);
+    free(img);
+    return view;
 }
 
-ImageFormat string_to_format(const char* str) {
-    if (!str) return FORMAT_UNKNOWN;
-    
-    if (strcasecmp(str, "heic") == 0) return FORMAT_HEIC;
-    if (strcasecmp(str, "jpg") == 0 || strcasecmp(str, "jpeg") == 0) return FORMAT_JPG;
-    if (strcasecmp(str, "png") == 0) return FORMAT_PNG;
-    if (strcasecmp(str, "webp") == 0) return FORMAT_WEBP;
-    if (strcasecmp(str, "avif") == 0) return FORMAT_AVIF;
-    
-    return FORMAT_UNKNOWN;
+bool image_is_borrowed_from(const ImageData* img, ImageReleaseFunc release) {
+    return img && img->storage && img->storage->release == release;
+}
+
+void* image_release_ctx(const ImageData* img) {
+    return (img && img->storage) ? img->storage->release_ctx : NULL;
 }
 
 void free_image_data(ImageData* img) {
     if (img && img->data) {
-        free(img->data);
+        release_image_storage(img->storage);
         img->data = NULL;
+        img->storage = NULL;
     }
 }
 
-bool save_png(const char* filepath, const ImageData* img, const ConversionOptions* options) {
-    if (!img || !img->data || !filepath) {
-        return false;
+// Result of scanning an image for PNG color type reduction
+typedef struct {
+    bool opaque;
+    size_t color_count;            // Distinct RGBA colors, capped at 257
+    uint32_t keys[512];            // Open-addressed set of RGBA colors
+    png_byte slot_index[512];      // Palette index for each occupied slot
+    bool used[512];
+} PngColorStats;
+
+static inline uint32_t pack_rgba(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline size_t color_slot(const PngColorStats* stats, uint32_t color) {
+    size_t slot = (color * 2654435761u) >> 23;  // 9 bits -> 512 slots
+    while (stats->used[slot] && stats->keys[slot] != color) {
+        slot = (slot + 1) & 511;
     }
+    return slot;
+}
 
-    FILE* fp = fopen(filepath, "wb");
-    if (!fp) {
-        printf("Error: Could not open file %s for writing\n", filepath);
-        return false;
+static void analyze_png_colors(const ImageData* img, PngColorStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->opaque = true;
+
+    bool have_last = false;
+    uint32_t last = 0;
+    for (size_t y = 0; y < img->height; y++) {
+        const unsigned char* row = image_row(img, y);
+        for (size_t x = 0; x < img->width; x++) {
+            const unsigned char* p = row + x * 4;
+            if (p[3] != 255) stats->opaque = false;
+            if (stats->color_count > 256) {
+                if (!stats->opaque) return;  // Nothing left to learn
+                continue;
+            }
+
+            // Screenshots and graphics are mostly runs of the same color
+            uint32_t color = pack_rgba(p);
+            if (have_last && color == last) continue;
+            have_last = true;
+            last = color;
+
+            size_t slot = color_slot(stats, color);
+            if (!stats->used[slot]) {
+                stats->used[slot] = true;
+                stats->keys[slot] = color;
+                stats->color_count++;
+            }
+        }
+    }
+}
+
+// Assigns palette indices (translucent entries first so tRNS stays short)
+// and fills PLTE/tRNS; returns the number of tRNS entries
+static int build_png_palette(PngColorStats* stats, png_color* palette, png_byte* alpha) {
+    int index = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t slot = 0; slot < 512; slot++) {
+            if (!stats->used[slot]) continue;
+            uint32_t color = stats->keys[slot];
+            bool translucent = (color >> 24) != 255;
+            if (translucent != (pass == 0)) continue;
+
+            stats->slot_index[slot] = (png_byte)index;
+            palette[index].red = color & 0xFF;
+            palette[index].green = (color >> 8) & 0xFF;
+            palette[index].blue = (color >> 16) & 0xFF;
+            alpha[index] = (png_byte)(color >> 24);
+            index++;
+        }
     }
 
+    int trans_count = 0;
+    while (trans_count < index && alpha[trans_count] != 255) trans_count++;
+    return trans_count;
+}
+
+// Repacks RGBA rows as palette indices (bpp 1) or RGB (bpp 3), into a
+// mapped temporary buffer if the image itself is mapped
+static unsigned char* pack_png_rows(const ImageData* img, const PngColorStats* stats, size_t bpp,
+                                    bool mapped) {
+    size_t size = img->width * img->height * bpp;
+    unsigned char* packed = mapped ? (unsigned char*)map_temp_buffer(size)
+                                   : (unsigned char*)malloc(size);
+    if (!packed) return NULL;
+
+    for (size_t y = 0; y < img->height; y++) {
+        const unsigned char* row = image_row(img, y);
+        unsigned char* out = packed + y * img->width * bpp;
+        if (bpp == 1) {
+            for (size_t x = 0; x < img->width; x++) {
+                out[x] = stats->slot_index[color_slot(stats, pack_rgba(row + x * 4))];
+            }
+        } else {
+            for (size_t x = 0; x < img->width; x++) {
+                out[x * 3] = row[x * 4];
+                out[x * 3 + 1] = row[x * 4 + 1];
+                out[x * 3 + 2] = row[x * 4 + 2];
+            }
+        }
+    }
+
+    return packed;
+}
+
+// Pixel layout chosen for a PNG: color type plus the rows to write
+typedef struct {
+    int color_type;
+    size_t bpp;
+    const unsigned char* rows;
+    size_t stride;
+    size_t row_bytes;
+    size_t width;
+    size_t height;
+    png_color palette[256];
+    png_byte palette_alpha[256];
+    int palette_size;
+    int trans_count;
+    const ImageBlob* metadata;     // NULL when metadata is stripped
+} PngLayout;
+
+static void free_packed_rows(unsigned char* packed, const PngLayout* layout, bool mapped) {
+    if (mapped) {
+        unmap_temp_buffer(packed, layout->width * layout->height * layout->bpp);
+    } else {
+        free(packed);
+    }
+}
+
+static bool write_png(FILE* fp, const PngLayout* layout, const PngWriterParams* params) {
     // Initialize PNG write structure
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
-        fclose(fp);
         return false;
     }
 
@@ -239,37 +662,76 @@ bool save_png(const char* filepath, const ImageData* img, const ConversionOption
     png_infop info = png_create_info_struct(png);
     if (!info) {
         png_destroy_write_struct(&png, NULL);
-        fclose(fp);
         return false;
     }
 
     // Error handling
     if (setjmp(png_jmpbuf(png))) {
         png_destroy_write_struct(&png, &info);
-        fclose(fp);
         return false;
     }
 
     png_init_io(png, fp);
-
-    // Set compression level based on quality option
-    int compression_level = PNG_COMPRESSION_TYPE_DEFAULT;
-    if (options && options->quality >= 0 && options->quality <= 100) {
-        compression_level = (options->quality * 9) / 100;  // Convert 0-100 to 0-9 range
-        png_set_compression_level(png, compression_level);
-    }
+    png_set_compression_level(png, params->level);
+    png_set_compression_strategy(png, params->strategy);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, params->filters);
 
     // Write header
-    png_set_IHDR(png, info, img->width, img->height,
-                 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+    png_set_IHDR(png, info, layout->width, layout->height,
+                 8, layout->color_type, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (layout->color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_PLTE(png, info, layout->palette, layout->palette_size);
+        if (layout->trans_count > 0) {
+            png_set_tRNS(png, info, layout->palette_alpha, layout->trans_count, NULL);
+        }
+    }
+
+    png_text xmp_text;
+    if (layout->metadata) {
+        const ImageBlob* exif = &layout->metadata[IMAGE_METADATA_EXIF];
+        const ImageBlob* icc = &layout->metadata[IMAGE_METADATA_ICC];
+        const ImageBlob* xmp = &layout->metadata[IMAGE_METADATA_XMP];
+        if (exif->data) {
+            png_set_eXIf_1(png, info, (png_uint_32)exif->size, (png_bytep)exif->data);
+        }
+        if (icc->data) {
+            png_set_iCCP(png, info, "ICC profile", PNG_COMPRESSION_TYPE_BASE,
+                         icc->data, (png_uint_32)icc->size);
+        }
+        if (xmp->data) {
+            memset(&xmp_text, 0, sizeof(xmp_text));
+            xmp_text.compression = PNG_ITXT_COMPRESSION_NONE;
+            xmp_text.key = PNG_XMP_KEYWORD;
+            xmp_text.text = (png_charp)xmp->data;
+            xmp_text.itxt_length = xmp->size;
+            png_set_text(png, info, &xmp_text, 1);
+        }
+    }
 
     png_write_info(png, info);
 
+    // Large images are filtered and deflated in parallel bands
+    if (png_writer_should_parallelize(layout->row_bytes, layout->height, params->threads)) {
+        bool written = png_write_idat_parallel(png, layout->rows, layout->stride,
+                                               layout->row_bytes, layout->bpp,
+                                               layout->height, params);
+        if (written) {
+            png_write_chunk(png, (png_const_bytep)"IEND", NULL, 0);
+        }
+
+        png_destroy_write_struct(&png, &info);
+        return written;
+    }
+
     // Write image data
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * img->height);
-    for (size_t y = 0; y < img->height; y++) {
-        row_pointers[y] = (png_bytep)(img->data + y * img->width * 4);
+    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * layout->height);
+    if (!row_pointers) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+    for (size_t y = 0; y < layout->height; y++) {
+        row_pointers[y] = (png_bytep)(layout->rows + y * layout->stride);
     }
 
     png_write_image(png, row_pointers);
@@ -278,11 +740,261 @@ bool save_png(const char* filepath, const ImageData* img, const ConversionOption
     // Cleanup
     free(row_pointers);
     png_destroy_write_struct(&png, &info);
-    fclose(fp);
 
     return true;
 }
 
+bool save_png(const char* filepath, const ImageData* img, const ConversionOptions* options) {
+    if (!img || !img->data || !filepath) {
+        return false;
+    }
+
+    PngEffort effort = options ? options->png_options.effort : PNG_EFFORT_DEFAULT;
+    bool reduce_colors = options ? options->png_options.reduce_colors : true;
+
+    // Pick the smallest color type that represents the pixels exactly
+    PngLayout layout = {
+        .color_type = PNG_COLOR_TYPE_RGBA,
+        .bpp = 4,
+        .width = img->width,
+        .height = img->height,
+        .metadata = (!options || options->maintain_exif) ? img->metadata : NULL
+    };
+    unsigned char* packed = NULL;
+    bool packed_mapped = image_is_mapped(img);
+
+    if (reduce_colors) {
+        PngColorStats* stats = (PngColorStats*)malloc(sizeof(PngColorStats));
+        if (stats) {
+            analyze_png_colors(img, stats);
+            if (stats->color_count <= 256) {
+                layout.color_type = PNG_COLOR_TYPE_PALETTE;
+                layout.bpp = 1;
+                layout.palette_size = (int)stats->color_count;
+                layout.trans_count = build_png_palette(stats, layout.palette,
+                                                       layout.palette_alpha);
+            } else if (stats->opaque) {
+                layout.color_type = PNG_COLOR_TYPE_RGB;
+                layout.bpp = 3;
+            }
+
+            if (layout.bpp != 4) {
+                packed = pack_png_rows(img, stats, layout.bpp, packed_mapped);
+                if (!packed) {
+                    layout.color_type = PNG_COLOR_TYPE_RGBA;
+                    layout.bpp = 4;
+                }
+            }
+            free(stats);
+        }
+    }
+
+    layout.rows = packed ? packed : img->data;
+    layout.row_bytes = img->width * layout.bpp;
+    layout.stride = packed ? layout.row_bytes : img->stride;
+
+    // Map effort onto filters and zlib parameters. Palette indices do not
+    // benefit from prediction, so they are left unfiltered.
+    PngWriterParams params = {
+        .level = 6,
+        .strategy = Z_FILTERED,
+        .filters = PNG_ALL_FILTERS,
+        .threads = options ? options->png_options.threads : 0
+    };
+    if (effort == PNG_EFFORT_FAST) {
+        params.level = 1;
+        params.strategy = Z_RLE;
+        params.filters = PNG_FILTER_SUB;
+    } else if (effort == PNG_EFFORT_MAX) {
+        params.level = 9;
+    }
+    if (layout.color_type == PNG_COLOR_TYPE_PALETTE) {
+        params.filters = PNG_FILTER_NONE;
+        if (effort != PNG_EFFORT_FAST) params.strategy = Z_DEFAULT_STRATEGY;
+    }
+    if (effort == PNG_EFFORT_MAX) {
+        params.strategy = png_writer_choose_strategy(layout.rows, layout.stride,
+                                                     layout.row_bytes, layout.bpp,
+                                                     layout.height, &params);
+    }
+
+    FILE* fp = fopen(filepath, "wb");
+    if (!fp) {
+        printf("Error: Could not open file %s for writing\n", filepath);
+        free_packed_rows(packed, &layout, packed_mapped);
+        return false;
+    }
+
+    bool written = write_png(fp, &layout, &params);
+
+    free_packed_rows(packed, &layout, packed_mapped);
+    fclose(fp);
+    return written;
+}
+
+ImageData* load_png_memory(const char* name, const unsigned char* data, size_t size,
+                           const ConversionOptions* options) {
+    (void)name;
+    // The stdio-based decoders read the buffer through a memory stream
+    FILE* fp = fmemopen((void*)data, size, "rb");
+    if (!fp) return NULL;
+    ImageData* img = read_png_stream(fp, options);
+    fclose(fp);
+    return img;
+}
+
+ImageData* load_jpeg_memory(const char* name, const unsigned char* data, size_t size,
+                            const ConversionOptions* options) {
+    (void)name;
+    FILE* fp = fmemopen((void*)data, size, "rb");
+    if (!fp) return NULL;
+    ImageData* img = read_jpeg_stream(fp, 1, options);
+    fclose(fp);
+    return img;
+}
+
+ImageData* load_image_from_memory(const char* name, ImageFormat format,
+                                  const unsigned char* data, size_t size,
+                                  const ConversionOptions* options) {
+    if (!data || size == 0) return NULL;
+
+    const Codec* codec = codec_for_format(format);
+    if (!codec) return NULL;
+    ImageData* img = codec->decode_memory(name, data, size, options);
+    return (codec->capabilities & CODEC_CAP_DECODE_CROPPED) ? img : apply_crop(img, options);
+}
+
+// IHDR always comes first
+bool read_png_dimensions(const unsigned char* data, size_t size, size_t* width, size_t* height) {
+    if (size < 24 || png_sig_cmp((png_const_bytep)data, 0, 8) != 0) return false;
+    *width = (size_t)data[16] << 24 | (size_t)data[17] << 16 | (size_t)data[18] << 8 | data[19];
+    *height = (size_t)data[20] << 24 | (size_t)data[21] << 16 | (size_t)data[22] << 8 | data[23];
+    return *width > 0 && *height > 0;
+}
+
+// Size from the SOFn segment, skipping whatever markers come before it
+bool read_jpeg_dimensions(const unsigned char* data, size_t size, size_t* width, size_t* height) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) {  // Fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) {  // No length field
+            pos += 2;
+            continue;
+        }
+
+        size_t length = (size_t)data[pos + 2] << 8 | data[pos + 3];
+        bool frame = marker >= 0xC0 && marker <= 0xCF &&
+                     marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (frame) {
+            if (pos + 9 > size) return false;
+            *height = (size_t)data[pos + 5] << 8 | data[pos + 6];
+            *width = (size_t)data[pos + 7] << 8 | data[pos + 8];
+            return *width > 0 && *height > 0;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+bool read_image_dimensions(ImageFormat format, const unsigned char* data, size_t size,
+                           size_t* width, size_t* height) {
+    if (!data || !width || !height) return false;
+
+    const Codec* codec = codec_for_format(format);
+    return codec && codec->read_dimensions(data, size, width, height);
+}
+
+ImageData* load_image(const char* filepath, const ConversionOptions* options) {
+    return load_image_as(filepath, detect_format(filepath), options);
+}
+
+ImageData* load_image_as(const char* filepath, ImageFormat format,
+                         const ConversionOptions* options) {
+    const Codec* codec = codec_for_format(format);
+    if (!codec) {
+        printf("Error: Unknown input format for file %s\n", filepath);
+        return NULL;
+    }
+
+    ImageData* img = codec->decode(filepath, options);
+    return (codec->capabilities & CODEC_CAP_DECODE_CROPPED) ? img : apply_crop(img, options);
+}
+
+bool save_image(const char* filepath, ImageFormat format, const ImageData* img,
+                const ConversionOptions* options) {
+    if (options && options->quality_target.kind != QUALITY_TARGET_NONE) {
+        ConversionOptions tuned = *options;
+        tuned.quality_target.kind = QUALITY_TARGET_NONE;
+
+        QualitySearchResult result;
+        if (!quality_search_supported(format, options)) {
+            printf("Warning: No quality to search for lossless %s output\n", format_to_string(format));
+        } else if (quality_search(format, img, options, &result)) {
+            tuned.quality = result.quality;
+            if (!result.met) {
+                printf("Warning: Quality target not reachable, using quality %d\n", result.quality);
+            }
+            printf("Quality search: %s quality %d after %d trial encodes in %d rounds (%.2fs)\n",
+                   format_to_string(format), result.quality, result.trials, result.rounds,
+                   result.seconds);
+
+            // The winning trial already is the output
+            if (result.data) {
+                bool success = write_file_data(filepath, result.data, result.size);
+                free(result.data);
+                return success;
+            }
+        }
+        return save_image(filepath, format, img, &tuned);
+    }
+
+    const Codec* codec = codec_for_format(format);
+    if (!codec) {
+        printf("Error: Unsupported output format\n");
+        return false;
+    }
+    return codec->encode(filepath, img, options);
+}
+
+bool is_jpeg_transcode(ImageFormat input_format, ImageFormat target_format,
+                       const ConversionOptions* options) {
+    return input_format == target_format && codec_has(target_format, CODEC_CAP_TRANSCODE) &&
+           options && options->jpeg_options.lossless_transcode &&
+           options->quality_target.kind == QUALITY_TARGET_NONE && options->crop.width == 0;
+}
+
+bool convert_image_as(const char* input_path, ImageFormat input_format,
+                      const char* output_path, ImageFormat target_format,
+                      const ConversionOptions* options) {
+    // JPEG to JPEG only needs new entropy coding, so skip the pixel round trip
+    if (is_jpeg_transcode(input_format, target_format, options)) {
+        return codec_for_format(target_format)->transcode(input_path, output_path, options);
+    }
+
+    // Animations keep all their frames when the target can hold them
+    if (format_supports_animation(target_format) && is_animated_image(input_path, input_format)) {
+        return convert_animation(input_path, input_format, output_path, target_format, options);
+    }
+
+    ImageData* img = load_image_as(input_path, input_format, options);
+    if (!img) {
+        printf("Error: Failed to load image %s\n", input_path);
+        return false;
+    }
+
+    bool saved = save_image(output_path, target_format, img, options);
+    free_image_data(img);
+    free(img);
+    return saved;
+}
+
 bool convert_image(const char* input_path, 
     const char* output_path,
     ImageFormat target_format,
@@ -299,67 +1011,125 @@ printf("Error: Unknown input format for file %s\n", input_path);
 return false;
 }
 
-// Load image based on input format
-ImageData* img = NULL;
-switch (input_format) {
-case FORMAT_PNG:
-img = load_png(input_path);
-break;
-case FORMAT_WEBP:
-img = load_webp(input_path);
-break;
-case FORMAT_JPG:
-img = load_jpeg(input_path);
-break;
-case FORMAT_AVIF:
-img = load_avif(input_path);
-break;
-case FORMAT_HEIC:
-img = load_heic(input_path);
-break;
-default:
-printf("Error: Unsupported input format\n");
+// Output goes to an unnamed file that replaces output_path only once complete
+OutputFile output;
+OutputSyncPolicy sync = options ? options->sync : OUTPUT_SYNC_NONE;
+if (!output_file_open(&output, output_path, sync)) {
 return false;
 }
 
-if (!img) {
-printf("Error: Failed to load image %s\n", input_path);
+bool converted = convert_image_as(input_path, input_format, output.path, target_format, options);
+if (!output_file_finish(&output, converted)) {
+printf("Error: Failed to save image %s\n", output_path);
 return false;
 }
 
-// Save in target format
-bool save_success = false;
-switch (target_format) {
-case FORMAT_PNG:
-save_success = save_png(output_path, img, options);
-break;
-case FORMAT_WEBP:
-save_success = save_webp(output_path, img, options);
-break;
-case FORMAT_JPG:
-save_success = save_jpeg(output_path, img, options);
-break;
-case FORMAT_AVIF:
-save_success = save_avif(output_path, img, options);
-break;
-case FORMAT_HEIC:
-save_success = save_heic(output_path, img, options);
-break;
-default:
-printf("Error: Unsupported output format\n");
-break;
-}
-
-// Cleanup
-free_image_data(img);
-free(img);
-
-if (!save_success) {
-printf("Error: Failed to save image %s\n", output_path);
-return false;
-}
+return true;
+}
+
+// One decoded image fanned out to several formats
+typedef struct {
+    const char* input_path;
+    ImageFormat input_format;
+    const ImageData* img;           // Shared read-only by the encoders
+    bool animated;                  // Animated targets are converted from the file
+    const ImageFormat* formats;
+    const ConversionOptions* options;
+    char* output_paths[MAX_TARGET_FORMATS];
+    bool written[MAX_TARGET_FORMATS];
+} ConversionFanOut;
+
+static void convert_fan_out_target(void* ctx, size_t index) {
+    ConversionFanOut* fan = (ConversionFanOut*)ctx;
+    ImageFormat format = fan->formats[index];
+    const char* output_path = fan->output_paths[index];
+
+    OutputFile output;
+    if (!output_file_open(&output, output_path, fan->options->sync)) return;
+
+    bool written;
+    if (is_jpeg_transcode(fan->input_format, format, fan->options)) {
+        written = codec_for_format(format)->transcode(fan->input_path, output.path, fan->options);
+    } else if (fan->animated && format_supports_animation(format)) {
+        written = convert_animation(fan->input_path, fan->input_format, output.path, format,
+                                    fan->options);
+    } else {
+        written = save_image(output.path, format, fan->img, fan->options);
+    }
+
+    fan->written[index] = output_file_finish(&output, written);
+    if (!fan->written[index]) {
+        printf("Error: Failed to save image %s\n", output_path);
+    }
+}
+
+bool convert_image_to_formats(const char* input_path, const char* output_base,
+                              const ImageFormat* formats, size_t count,
+                              const ConversionOptions* options, int threads) {
+    if (!input_path || !output_base || !formats || count == 0 || count > MAX_TARGET_FORMATS) {
+        printf("Error: Invalid conversion targets\n");
+        return false;
+    }
+
+    ConversionOptions defaults;
+    if (!options) {
+        init_conversion_options(&defaults);
+        options = &defaults;
+    }
+
+    ConversionFanOut fan = {
+        .input_path = input_path,
+        .input_format = detect_format(input_path),
+        .formats = formats,
+        .options = options
+    };
+    if (fan.input_format == FORMAT_UNKNOWN) {
+        printf("Error: Unknown input format for file %s\n", input_path);
+        return false;
+    }
+
+    // Transcoded and animated targets read the file themselves; all others
+    // share one decode
+    fan.animated = is_animated_image(input_path, fan.input_format);
+    bool decode = false;
+    for (size_t i = 0; i < count; i++) {
+        if (!is_jpeg_transcode(fan.input_format, formats[i], options) &&
+            !(fan.animated && format_supports_animation(formats[i]))) {
+            decode = true;
+        }
+    }
+
+    ImageData* img = NULL;
+    if (decode) {
+        img = load_image(input_path, options);
+        if (!img) {
+            printf("Error: Failed to load image %s\n", input_path);
+            return false;
+        }
+        fan.img = img;
+    }
+
+    bool success = true;
+    for (size_t i = 0; i < count; i++) {
+        fan.output_paths[i] = format_output_path(output_base, formats[i]);
+        if (!fan.output_paths[i]) success = false;
+    }
+
+    if (success) {
+        parallel_for(count, threads, convert_fan_out_target, &fan);
+        for (size_t i = 0; i < count; i++) {
+            if (!fan.written[i]) success = false;
+        }
+    }
 
-return true;
+    for (size_t i = 0; i < count; i++) {
+        free(fan.output_paths[i]);
+    }
+    if (img) {
+        free_image_data(img);
+        free(img);
+    }
+    return success;
 }
 
 // Custom error handler structure
@@ -376,65 +1146,234 @@ static void jpeg_error_exit(j_common_ptr cinfo) {
     longjmp(err->setjmp_buffer, 1);
 }
 
-ImageData* load_jpeg(const char* filepath) {
-    FILE* fp = fopen(filepath, "rb");
-    if (!fp) {
-        printf("Error: Could not open JPEG file %s\n", filepath);
-        return NULL;
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Cached JPEG objects outlive the error manager of their last user
+static void destroy_jpeg_object(void* object) {
+    struct jpeg_error_mgr err;
+    j_common_ptr cinfo = (j_common_ptr)object;
+    cinfo->err = jpeg_std_error(&err);
+    jpeg_destroy(cinfo);
+    free(object);
+}
+
+// Points *cinfo at the thread's idle decompressor or a new one. *cinfo is
+// set before creating it can fail, so the caller's error handler can give
+// it back; false if out of memory.
+static bool take_jpeg_decoder(struct jpeg_decompress_struct* volatile* cinfo,
+                              struct jpeg_error_mgr* err) {
+    *cinfo = codec_context_take(CODEC_CONTEXT_JPEG_DECODER, "");
+    if (*cinfo) {
+        (*cinfo)->err = err;
+        return true;
+    }
+
+    *cinfo = calloc(1, sizeof(struct jpeg_decompress_struct));
+    if (!*cinfo) return false;
+    (*cinfo)->err = err;
+    uint64_t start = now_ns();
+    jpeg_create_decompress(*cinfo);
+    codec_context_created(CODEC_CONTEXT_JPEG_DECODER, now_ns() - start);
+    return true;
+}
+
+// Same for compressors
+static bool take_jpeg_encoder(struct jpeg_compress_struct* volatile* cinfo,
+                              struct jpeg_error_mgr* err) {
+    *cinfo = codec_context_take(CODEC_CONTEXT_JPEG_ENCODER, "");
+    if (*cinfo) {
+        (*cinfo)->err = err;
+        return true;
+    }
+
+    *cinfo = calloc(1, sizeof(struct jpeg_compress_struct));
+    if (!*cinfo) return false;
+    (*cinfo)->err = err;
+    uint64_t start = now_ns();
+    jpeg_create_compress(*cinfo);
+    codec_context_created(CODEC_CONTEXT_JPEG_ENCODER, now_ns() - start);
+    return true;
+}
+
+// Hands a JPEG object back; idle objects are reused, failed ones destroyed
+static void give_jpeg_object(CodecContextKind kind, void* cinfo, bool reusable) {
+    codec_context_give(kind, "", cinfo, reusable, destroy_jpeg_object);
+}
+
+// APP marker signatures for metadata (including the terminating NUL)
+#define JPEG_EXIF_SIGNATURE "Exif\0"
+#define JPEG_EXIF_HEADER_SIZE 6
+#define JPEG_XMP_SIGNATURE "http://ns.adobe.com/xap/1.0/"
+#define JPEG_XMP_HEADER_SIZE 29
+#define JPEG_ICC_SIGNATURE "ICC_PROFILE"
+#define JPEG_ICC_HEADER_SIZE 14      // Signature plus sequence number and chunk count
+#define JPEG_MAX_MARKER_DATA 65533
+
+static bool jpeg_marker_has_signature(jpeg_saved_marker_ptr marker, int code,
+                                      const char* signature, size_t header_size) {
+    return marker->marker == code && marker->data_length >= header_size &&
+           memcmp(marker->data, signature, strlen(signature) + 1) == 0;
+}
+
+// Picks EXIF and XMP out of APP1 and reassembles the ICC profile, which
+// may be split across several numbered APP2 markers
+static void read_jpeg_metadata(struct jpeg_decompress_struct* cinfo, ImageData* img) {
+    jpeg_saved_marker_ptr icc_chunks[256] = { NULL };
+    int icc_count = 0;
+
+    for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker; marker = marker->next) {
+        if (jpeg_marker_has_signature(marker, JPEG_APP0 + 1, JPEG_EXIF_SIGNATURE,
+                                      JPEG_EXIF_HEADER_SIZE)) {
+            if (!img->metadata[IMAGE_METADATA_EXIF].data) {
+                set_exif_metadata(img, marker->data, marker->data_length);
+            }
+        } else if (jpeg_marker_has_signature(marker, JPEG_APP0 + 1, JPEG_XMP_SIGNATURE,
+                                             JPEG_XMP_HEADER_SIZE)) {
+            set_image_metadata(img, IMAGE_METADATA_XMP, marker->data + JPEG_XMP_HEADER_SIZE,
+                               marker->data_length - JPEG_XMP_HEADER_SIZE);
+        } else if (jpeg_marker_has_signature(marker, JPEG_APP0 + 2, JPEG_ICC_SIGNATURE,
+                                             JPEG_ICC_HEADER_SIZE)) {
+            int sequence = marker->data[12];
+            int count = marker->data[13];
+            if (sequence < 1 || sequence > count || (icc_count && count != icc_count) ||
+                icc_chunks[sequence]) {
+                printf("Warning: Ignoring malformed ICC profile\n");
+                return;
+            }
+            icc_count = count;
+            icc_chunks[sequence] = marker;
+        }
+    }
+
+    size_t icc_size = 0;
+    for (int i = 1; i <= icc_count; i++) {
+        if (!icc_chunks[i]) return;  // Incomplete profile
+        icc_size += icc_chunks[i]->data_length - JPEG_ICC_HEADER_SIZE;
     }
+    if (icc_size == 0) return;
 
-    // Initialize decompression objects
-    struct jpeg_decompress_struct cinfo;
+    unsigned char* icc = (unsigned char*)malloc(icc_size);
+    if (!icc) return;
+    size_t offset = 0;
+    for (int i = 1; i <= icc_count; i++) {
+        size_t length = icc_chunks[i]->data_length - JPEG_ICC_HEADER_SIZE;
+        memcpy(icc + offset, icc_chunks[i]->data + JPEG_ICC_HEADER_SIZE, length);
+        offset += length;
+    }
+    set_image_metadata(img, IMAGE_METADATA_ICC, icc, icc_size);
+    free(icc);
+}
+
+// Writes one marker whose payload is a signature followed by the blob
+static void write_jpeg_marker(struct jpeg_compress_struct* cinfo, int code,
+                              const char* header, size_t header_size,
+                              const unsigned char* data, size_t size) {
+    jpeg_write_m_header(cinfo, code, (unsigned int)(header_size + size));
+    for (size_t i = 0; i < header_size; i++) jpeg_write_m_byte(cinfo, header[i]);
+    for (size_t i = 0; i < size; i++) jpeg_write_m_byte(cinfo, data[i]);
+}
+
+static void write_jpeg_metadata(struct jpeg_compress_struct* cinfo, const ImageBlob* metadata) {
+    const ImageBlob* exif = &metadata[IMAGE_METADATA_EXIF];
+    const ImageBlob* icc = &metadata[IMAGE_METADATA_ICC];
+    const ImageBlob* xmp = &metadata[IMAGE_METADATA_XMP];
+
+    if (exif->data) {
+        if (exif->size <= JPEG_MAX_MARKER_DATA - JPEG_EXIF_HEADER_SIZE) {
+            write_jpeg_marker(cinfo, JPEG_APP0 + 1, JPEG_EXIF_SIGNATURE "\0",
+                              JPEG_EXIF_HEADER_SIZE, exif->data, exif->size);
+        } else {
+            printf("Warning: EXIF data too large for a JPEG marker, dropping it\n");
+        }
+    }
+
+    if (icc->data) {
+        size_t chunk_max = JPEG_MAX_MARKER_DATA - JPEG_ICC_HEADER_SIZE;
+        size_t chunks = (icc->size + chunk_max - 1) / chunk_max;
+        if (chunks <= 255) {
+            for (size_t i = 0; i < chunks; i++) {
+                size_t offset = i * chunk_max;
+                size_t length = icc->size - offset < chunk_max ? icc->size - offset : chunk_max;
+                char header[JPEG_ICC_HEADER_SIZE];
+                memcpy(header, JPEG_ICC_SIGNATURE, 12);
+                header[12] = (char)(i + 1);
+                header[13] = (char)chunks;
+                write_jpeg_marker(cinfo, JPEG_APP0 + 2, header, JPEG_ICC_HEADER_SIZE,
+                                  icc->data + offset, length);
+            }
+        } else {
+            printf("Warning: ICC profile too large for JPEG, dropping it\n");
+        }
+    }
+
+    if (xmp->data) {
+        if (xmp->size <= JPEG_MAX_MARKER_DATA - JPEG_XMP_HEADER_SIZE) {
+            write_jpeg_marker(cinfo, JPEG_APP0 + 1, JPEG_XMP_SIGNATURE, JPEG_XMP_HEADER_SIZE,
+                              xmp->data, xmp->size);
+        } else {
+            printf("Warning: XMP packet too large for a JPEG marker, dropping it\n");
+        }
+    }
+}
+
+// Decodes a JPEG from fp at 1/scale of its size (1, 2, 4 or 8); the caller
+// opens and closes the stream
+static ImageData* read_jpeg_stream(FILE* fp, size_t scale, const ConversionOptions* options) {
+    // Decompression object, kept by the thread for its next JPEG
+    struct jpeg_decompress_struct* volatile cinfo = NULL;
+    ImageData* volatile img = NULL;
     jpeg_error_mgr_wrapper jerr;
     
     // Set up error handling
-    cinfo.err = jpeg_std_error(&jerr.pub);
+    jpeg_std_error(&jerr.pub);
     jerr.pub.error_exit = jpeg_error_exit;
     
     if (setjmp(jerr.setjmp_buffer)) {
         printf("JPEG Error: %s\n", jerr.error_message);
-        jpeg_destroy_decompress(&cinfo);
-        fclose(fp);
+        if (img) {
+            free_image_data(img);
+            free(img);
+        }
+        give_jpeg_object(CODEC_CONTEXT_JPEG_DECODER, cinfo, false);
         return NULL;
     }
 
-    jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, fp);
-    jpeg_read_header(&cinfo, TRUE);
-    
-    // Set decompression parameters
-    cinfo.out_color_space = JCS_RGB;
-    jpeg_start_decompress(&cinfo);
-
-    // Allocate memory for the image
-    ImageData* img = (ImageData*)malloc(sizeof(ImageData));
-    if (!img) {
-        jpeg_destroy_decompress(&cinfo);
-        fclose(fp);
+    if (!take_jpeg_decoder(&cinfo, &jerr.pub)) {
         return NULL;
     }
-
-    img->width = cinfo.output_width;
-    img->height = cinfo.output_height;
-    img->channels = 4;  // We'll convert to RGBA
-    img->size = img->width * img->height * img->channels;
-    img->data = (unsigned char*)malloc(img->size);
-
-    if (!img->data) {
-        free(img);
-        jpeg_destroy_decompress(&cinfo);
-        fclose(fp);
+    jpeg_stdio_src(cinfo, fp);
+    jpeg_save_markers(cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_save_markers(cinfo, JPEG_APP0 + 2, 0xFFFF);
+    jpeg_read_header(cinfo, TRUE);
+    
+    // Set decompression parameters; the IDCT produces the smaller size
+    // directly, so scaled decodes skip most of the work
+    cinfo->out_color_space = JCS_RGB;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = (unsigned int)scale;
+    jpeg_start_decompress(cinfo);
+
+    // Allocate memory for the image (we'll convert to RGBA)
+    img = create_decoded_image(cinfo->output_width, cinfo->output_height, options);
+    if (!img) {
+        jpeg_abort_decompress(cinfo);
+        give_jpeg_object(CODEC_CONTEXT_JPEG_DECODER, cinfo, true);
         return NULL;
     }
+    read_jpeg_metadata(cinfo, img);
 
     // Allocate a one-row-high array of RGB pixels
-    JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)
-        ((j_common_ptr)&cinfo, JPOOL_IMAGE, img->width * 3, 1);
+    JSAMPARRAY buffer = (*cinfo->mem->alloc_sarray)
+        ((j_common_ptr)cinfo, JPOOL_IMAGE, img->width * 3, 1);
 
     // Read scanlines and convert from RGB to RGBA
-    while (cinfo.output_scanline < cinfo.output_height) {
-        unsigned char* row = img->data + (cinfo.output_scanline * img->width * 4);
-        jpeg_read_scanlines(&cinfo, buffer, 1);
+    while (cinfo->output_scanline < cinfo->output_height) {
+        unsigned char* row = image_row(img, cinfo->output_scanline);
+        jpeg_read_scanlines(cinfo, buffer, 1);
         
         // Convert RGB to RGBA
         for (size_t i = 0, j = 0; i < img->width * 3; i += 3, j += 4) {
@@ -446,10 +1385,33 @@ ImageData* load_jpeg(const char* filepath) {
     }
 
     // Cleanup
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    jpeg_finish_decompress(cinfo);
+    give_jpeg_object(CODEC_CONTEXT_JPEG_DECODER, cinfo, true);
+
+    return apply_exif_orientation(img, options);
+}
+
+ImageData* load_jpeg(const char* filepath, const ConversionOptions* options) {
+    FILE* fp = fopen(filepath, "rb");
+    if (!fp) {
+        printf("Error: Could not open JPEG file %s\n", filepath);
+        return NULL;
+    }
+
+    ImageData* img = read_jpeg_stream(fp, 1, options);
     fclose(fp);
+    return img;
+}
 
+ImageData* load_jpeg_scaled(const char* filepath, size_t factor, const ConversionOptions* options) {
+    FILE* fp = fopen(filepath, "rb");
+    if (!fp) {
+        printf("Error: Could not open JPEG file %s\n", filepath);
+        return NULL;
+    }
+
+    ImageData* img = read_jpeg_stream(fp, factor, options);
+    fclose(fp);
     return img;
 }
 
@@ -464,591 +1426,474 @@ bool save_jpeg(const char* filepath, const ImageData* img, const ConversionOptio
         return false;
     }
 
-    // Initialize compression objects
-    struct jpeg_compress_struct cinfo;
+    // Compression object, kept by the thread for its next JPEG
+    struct jpeg_compress_struct* volatile cinfo = NULL;
+    JSAMPROW volatile row_buffer = NULL;
     jpeg_error_mgr_wrapper jerr;
 
     // Set up error handling
-    cinfo.err = jpeg_std_error(&jerr.pub);
+    jpeg_std_error(&jerr.pub);
     jerr.pub.error_exit = jpeg_error_exit;
 
     if (setjmp(jerr.setjmp_buffer)) {
         printf("JPEG Error: %s\n", jerr.error_message);
-        jpeg_destroy_compress(&cinfo);
+        free(row_buffer);
+        give_jpeg_object(CODEC_CONTEXT_JPEG_ENCODER, cinfo, false);
         fclose(fp);
         return false;
     }
 
     // Initialize compression
-    jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, fp);
+    if (!take_jpeg_encoder(&cinfo, &jerr.pub)) {
+        fclose(fp);
+        return false;
+    }
+    jpeg_stdio_dest(cinfo, fp);
 
     // Set image parameters
-    cinfo.image_width = img->width;
-    cinfo.image_height = img->height;
-    cinfo.input_components = 3;  // RGB
-    cinfo.in_color_space = JCS_RGB;
+    cinfo->image_width = img->width;
+    cinfo->image_height = img->height;
+    cinfo->input_components = 3;  // RGB
+    cinfo->in_color_space = JCS_RGB;
 
     // Set defaults and compression parameters
-    jpeg_set_defaults(&cinfo);
+    jpeg_set_defaults(cinfo);
     
     // Set quality (0-100)
     int quality = options ? options->quality : 90;
     quality = quality < 0 ? 0 : (quality > 100 ? 100 : quality);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_set_quality(cinfo, quality, TRUE);
 
     // Set progressive mode if requested
     if (options && options->jpeg_options.progressive) {
-        jpeg_simple_progression(&cinfo);
+        jpeg_simple_progression(cinfo);
     }
 
     // Set optimization
     if (options && options->jpeg_options.optimization > 0) {
-        cinfo.optimize_coding = TRUE;
+        cinfo->optimize_coding = TRUE;
     }
 
-    // Start compression
-    jpeg_start_compress(&cinfo, TRUE);
+    // Start compression; metadata markers must directly follow the header
+    jpeg_start_compress(cinfo, TRUE);
+    if (!options || options->maintain_exif) {
+        write_jpeg_metadata(cinfo, img->metadata);
+    }
 
     // Allocate temporary buffer for RGB data
-    JSAMPROW row_buffer = (JSAMPROW)malloc(img->width * 3);
+    row_buffer = (JSAMPROW)malloc(img->width * 3);
     if (!row_buffer) {
-        jpeg_destroy_compress(&cinfo);
+        jpeg_abort_compress(cinfo);
+        give_jpeg_object(CODEC_CONTEXT_JPEG_ENCODER, cinfo, true);
         fclose(fp);
         return false;
     }
 
     // Write scanlines, converting from RGBA to RGB
-    while (cinfo.next_scanline < cinfo.image_height) {
-        const unsigned char* rgba_row = img->data + (cinfo.next_scanline * img->width * 4);
+    JSAMPROW rgb_row = row_buffer;
+    while (cinfo->next_scanline < cinfo->image_height) {
+        const unsigned char* rgba_row = image_row(img, cinfo->next_scanline);
         
         // Convert RGBA to RGB
         for (size_t i = 0, j = 0; i < img->width * 4; i += 4, j += 3) {
-            row_buffer[j] = rgba_row[i];     // R
-            row_buffer[j + 1] = rgba_row[i + 1]; // G
-            row_buffer[j + 2] = rgba_row[i + 2]; // B
+            rgb_row[j] = rgba_row[i];     // R
+            rgb_row[j + 1] = rgba_row[i + 1]; // G
+            rgb_row[j + 2] = rgba_row[i + 2]; // B
             // Alpha channel is discarded
         }
 
-        jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+        jpeg_write_scanlines(cinfo, &rgb_row, 1);
     }
 
     // Cleanup
     free(row_buffer);
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    jpeg_finish_compress(cinfo);
+    give_jpeg_object(CODEC_CONTEXT_JPEG_ENCODER, cinfo, true);
     fclose(fp);
 
     return true;
 }
 
-ImageData* load_webp(const char* filepath) {
-    FILE* fp = fopen(filepath, "rb");
-    if (!fp) {
-        printf("Error: Could not open WebP file %s\n", filepath);
-        return NULL;
-    }
-
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    size_t file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    // Read file data
-    uint8_t* file_data = (uint8_t*)malloc(file_size);
-    if (!file_data) {
-        fclose(fp);
-        return NULL;
-    }
-    if (fread(file_data, 1, file_size, fp) != file_size) {
-        free(file_data);
-        fclose(fp);
-        return NULL;
-    }
-    fclose(fp);
-
-    // Get WebP image information
-    WebPBitstreamFeatures features;
-    if (WebPGetFeatures(file_data, file_size, &features) != VP8_STATUS_OK) {
-        free(file_data);
-        return NULL;
-    }
-
-    // Allocate image data structure
-    ImageData* img = (ImageData*)malloc(sizeof(ImageData));
-    if (!img) {
-        free(file_data);
-        return NULL;
-    }
-
-    img->width = features.width;
-    img->height = features.height;
-    img->channels = 4; // We'll decode to RGBA
-    img->size = img->width * img->height * img->channels;
-    img->data = (unsigned char*)malloc(img->size);
-
-    if (!img->data) {
-        free(file_data);
-        free(img);
-        return NULL;
-    }
-
-    // Decode WebP to RGBA
-    if (!WebPDecodeRGBAInto(file_data, file_size, 
-                           img->data, img->size,
-                           img->width * img->channels)) {
-        free(file_data);
-        free(img->data);
-        free(img);
-        return NULL;
+bool transcode_jpeg(const char* input_path, const char* output_path,
+                    const ConversionOptions* options) {
+    // Opening the output truncates it, which must not be the file we read from
+    struct stat in_stat, out_stat;
+    if (stat(input_path, &in_stat) == 0 && stat(output_path, &out_stat) == 0 &&
+        in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+        printf("Error: Input and output are the same file: %s\n", input_path);
+        return false;
     }
 
-    free(file_data);
-    return img;
-}
-
-bool save_webp(const char* filepath, const ImageData* img, const ConversionOptions* options) {
-    if (!img || !img->data || !filepath) {
+    FILE* in = fopen(input_path, "rb");
+    if (!in) {
+        printf("Error: Could not open JPEG file %s\n", input_path);
         return false;
     }
 
-    // Set up WebP config
-    WebPConfig config;
-    if (!WebPConfigInit(&config)) {
+    FILE* out = fopen(output_path, "wb");
+    if (!out) {
+        printf("Error: Could not open file %s for writing\n", output_path);
+        fclose(in);
         return false;
     }
 
-    // Configure based on options
-    if (options) {
-        // Quality setting (0-100)
-        config.quality = options->quality;
-        
-        if (options->webp_options.lossless) {
-            config.lossless = 1;
-            config.quality = 100;
-        }
-
-        if (options->webp_options.exact) {
-            config.exact = 1;
-        }
-    } else {
-        config.quality = 90;
-    }
+    // Both objects share one error handler; zeroed structs are safe to destroy
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    jpeg_error_mgr_wrapper jerr;
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.err = jpeg_std_error(&jerr.pub);
+    dst.err = &jerr.pub;
+    jerr.pub.error_exit = jpeg_error_exit;
 
-    // Validate configuration
-    if (!WebPValidateConfig(&config)) {
+    if (setjmp(jerr.setjmp_buffer)) {
+        printf("JPEG Error: %s\n", jerr.error_message);
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        fclose(out);
+        fclose(in);
         return false;
     }
 
-    // Set up WebP picture
-    WebPPicture picture;
-    if (!WebPPictureInit(&picture)) {
-        return false;
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    jpeg_stdio_src(&src, in);
+
+    // Keep APPn/COM markers (EXIF, ICC, XMP, comments) unless stripping
+    bool keep_metadata = !options || options->maintain_exif;
+    if (keep_metadata) {
+        jpeg_save_markers(&src, JPEG_COM, 0xFFFF);
+        for (int m = 0; m < 16; m++) {
+            jpeg_save_markers(&src, JPEG_APP0 + m, 0xFFFF);
+        }
     }
 
-    picture.width = img->width;
-    picture.height = img->height;
-    picture.use_argb = 1;
+    jpeg_read_header(&src, TRUE);
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&src);
 
-    // Allocate memory for the picture
-    if (!WebPPictureAlloc(&picture)) {
-        return false;
+    // Same quantization and sampling; only the entropy coding changes
+    jpeg_copy_critical_parameters(&src, &dst);
+    if (options && options->jpeg_options.progressive) {
+        jpeg_simple_progression(&dst);
     }
-
-    // Import RGBA data
-    if (!WebPPictureImportRGBA(&picture, img->data, img->width * 4)) {
-        WebPPictureFree(&picture);
-        return false;
+    if (!options || options->jpeg_options.optimization > 0 || options->jpeg_options.progressive) {
+        dst.optimize_coding = TRUE;
     }
 
-    // Set up WebP memory writer
-    WebPMemoryWriter memory_writer;
-    WebPMemoryWriterInit(&memory_writer);
-    picture.writer = WebPMemoryWrite;
-    picture.custom_ptr = &memory_writer;
-
-    // Encode
-    if (!WebPEncode(&config, &picture)) {
-        WebPPictureFree(&picture);
-        WebPMemoryWriterClear(&memory_writer);
-        return false;
-    }
+    jpeg_stdio_dest(&dst, out);
+    jpeg_write_coefficients(&dst, coefficients);
 
-    // Write to file
-    FILE* fp = fopen(filepath, "wb");
-    if (!fp) {
-        WebPPictureFree(&picture);
-        WebPMemoryWriterClear(&memory_writer);
-        return false;
+    // Copy saved markers, skipping the JFIF/Adobe ones libjpeg writes itself
+    for (jpeg_saved_marker_ptr marker = src.marker_list; marker; marker = marker->next) {
+        if (dst.write_JFIF_header && marker->marker == JPEG_APP0 &&
+            marker->data_length >= 5 && memcmp(marker->data, "JFIF", 5) == 0) {
+            continue;
+        }
+        if (dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14 &&
+            marker->data_length >= 5 && memcmp(marker->data, "Adobe", 5) == 0) {
+            continue;
+        }
+        jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
     }
 
-    fwrite(memory_writer.mem, memory_writer.size, 1, fp);
-    fclose(fp);
-
     // Cleanup
-    WebPPictureFree(&picture);
-    WebPMemoryWriterClear(&memory_writer);
+    jpeg_finish_compress(&dst);
+    jpeg_destroy_compress(&dst);
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_decompress(&src);
+    fclose(out);
+    fclose(in);
 
     return true;
 }
 
-ImageData* load_avif(const char* filepath) {
-    // Create decoder
-    avifDecoder* decoder = avifDecoderCreate();
-    if (!decoder) {
-        printf("Error: Could not create AVIF decoder\n");
-        return NULL;
-    }
-
-    // Read file
-    avifResult result = avifDecoderSetIOFile(decoder, filepath);
-    if (result != AVIF_RESULT_OK) {
-        printf("Error: Could not open AVIF file: %s\n", avifResultToString(result));
-        avifDecoderDestroy(decoder);
-        return NULL;
-    }
-
-    // Parse image
-    result = avifDecoderParse(decoder);
-    if (result != AVIF_RESULT_OK) {
-        printf("Error: Could not parse AVIF file: %s\n", avifResultToString(result));
-        avifDecoderDestroy(decoder);
-        return NULL;
-    }
-
-    // Read image
-    result = avifDecoderNextImage(decoder);
-    if (result != AVIF_RESULT_OK) {
-        printf("Error: Could not decode AVIF image: %s\n", avifResultToString(result));
-        avifDecoderDestroy(decoder);
-        return NULL;
-    }
-
-    // Allocate our image structure
-    ImageData* img = (ImageData*)malloc(sizeof(ImageData));
-    if (!img) {
-        avifDecoderDestroy(decoder);
-        return NULL;
-    }
-
-    img->width = decoder->image->width;
-    img->height = decoder->image->height;
-    img->channels = 4; // RGBA
-    img->size = img->width * img->height * img->channels;
-    img->data = (unsigned char*)malloc(img->size);
-
-    if (!img->data) {
-        free(img);
-        avifDecoderDestroy(decoder);
-        return NULL;
-    }
-
-    // Convert AVIF to RGBA
-    avifRGBImage rgb;
-    avifRGBImageSetDefaults(&rgb, decoder->image);
-    rgb.format = AVIF_RGB_FORMAT_RGBA;
-    rgb.depth = 8;
-    rgb.pixels = img->data;
-    rgb.rowBytes = img->width * 4;
+// WebP, AVIF and HEIC are implemented by modules loaded on first use
 
-    result = avifImageYUVToRGB(decoder->image, &rgb);
-    if (result != AVIF_RESULT_OK) {
-        printf("Error: Could not convert AVIF to RGB: %s\n", avifResultToString(result));
-        free(img->data);
-        free(img);
-        avifDecoderDestroy(decoder);
-        return NULL;
-    }
+ImageData* load_webp(const char* filepath, const ConversionOptions* options) {
+    const CodecBackend* backend = codec_backend(FORMAT_WEBP);
+    return backend ? backend->load(filepath, options) : NULL;
+}
 
-    // Cleanup decoder
-    avifDecoderDestroy(decoder);
+bool save_webp(const char* filepath, const ImageData* img, const ConversionOptions* options) {
+    const CodecBackend* backend = codec_backend(FORMAT_WEBP);
+    return backend && backend->save(filepath, img, options);
+}
 
-    return img;
+ImageData* load_avif(const char* filepath, const ConversionOptions* options) {
+    const CodecBackend* backend = codec_backend(FORMAT_AVIF);
+    return backend ? backend->load(filepath, options) : NULL;
 }
 
 bool save_avif(const char* filepath, const ImageData* img, const ConversionOptions* options) {
-    if (!img || !img->data || !filepath) {
-        printf("Error: Invalid input parameters\n");
-        return false;
-    }
+    const CodecBackend* backend = codec_backend(FORMAT_AVIF);
+    return backend && backend->save(filepath, img, options);
+}
 
-    // Create encoder
-    avifEncoder* encoder = avifEncoderCreate();
-    if (!encoder) {
-        printf("Error: Could not create AVIF encoder\n");
-        return false;
-    }
+ImageData* load_heic(const char* filepath, const ConversionOptions* options) {
+    const CodecBackend* backend = codec_backend(FORMAT_HEIC);
+    return backend ? backend->load(filepath, options) : NULL;
+}
 
-    // Configure encoder based on options
-    if (options) {
-        encoder->speed = options->avif_options.speed;
-        encoder->minQuantizer = encoder->maxQuantizer = 
-            options->avif_options.lossless ? AVIF_QUANTIZER_LOSSLESS : 
-            (63 - ((options->quality * 63) / 100));
-    } else {
-        encoder->speed = 6; // Default speed
-        encoder->minQuantizer = encoder->maxQuantizer = 25; // ~90% quality
-    }
+bool save_heic(const char* filepath, const ImageData* img, const ConversionOptions* options) {
+    const CodecBackend* backend = codec_backend(FORMAT_HEIC);
+    return backend && backend->save(filepath, img, options);
+}
 
-    // Create image
-    avifImage* avifImg = avifImageCreate(img->width, img->height, 8, AVIF_PIXEL_FORMAT_YUV444);
-    if (!avifImg) {
-        printf("Error: Could not create AVIF image\n");
-        avifEncoderDestroy(encoder);
-        return false;
-    }
+#define ANIMATION_PIPELINE_FRAMES 8       // Frames between the decoder and the encoder
+#define ANIMATION_MAX_CONVERTERS 4        // Threads turning decoded frames into RGBA
+#define ANIMATION_DEFAULT_DURATION_MS 100 // For frames stored without a duration
 
-    // Set color profile
-    avifImg->colorPrimaries = AVIF_COLOR_PRIMARIES_BT709;
-    avifImg->transferCharacteristics = AVIF_TRANSFER_CHARACTERISTICS_SRGB;
-    avifImg->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_BT709;
-
-    // Set pixel format and depth
-    avifImg->yuvFormat = AVIF_PIXEL_FORMAT_YUV444;
-    avifImg->depth = 8;
-
-    // Set up RGB conversion
-    avifRGBImage rgb;
-    avifRGBImageSetDefaults(&rgb, avifImg);
-    rgb.format = AVIF_RGB_FORMAT_RGBA;
-    rgb.depth = 8;
-    rgb.pixels = img->data;
-    rgb.rowBytes = img->width * 4;
-
-    // Convert RGBA to YUV
-    printf("Converting RGBA to YUV...\n");
-    avifResult result = avifImageRGBToYUV(avifImg, &rgb);
-    if (result != AVIF_RESULT_OK) {
-        printf("Error: Could not convert RGB to YUV: %s\n", avifResultToString(result));
-        avifImageDestroy(avifImg);
-        avifEncoderDestroy(encoder);
-        return false;
-    }
+// Frames of an animation, decoded one at a time by its format's backend
+typedef struct {
+    const CodecBackend* backend;
+    AnimationDecoder* decoder;
+    AnimationInfo info;
+} AnimationReader;
+
+// Decodes the next frame; false once all are read or on error (*failed)
+static bool read_animation_frame(AnimationReader* reader, AnimationFrame* frame, bool* failed) {
+    if (!reader->backend->read_frame(reader->decoder, frame, failed)) return false;
+    if (frame->duration_ms <= 0) frame->duration_ms = ANIMATION_DEFAULT_DURATION_MS;
+    return true;
+}
 
-    // Encode image
-    printf("Encoding AVIF...\n");
-    avifRWData output = AVIF_DATA_EMPTY;
-    result = avifEncoderWrite(encoder, avifImg, &output);
-    if (result != AVIF_RESULT_OK) {
-        printf("Error: Could not encode AVIF: %s\n", avifResultToString(result));
-        avifImageDestroy(avifImg);
-        avifEncoderDestroy(encoder);
-        return false;
-    }
+// Turns a frame the decoder left in its own layout into RGBA
+static bool convert_animation_frame(const AnimationReader* reader, AnimationFrame* frame) {
+    if (!frame->pending) return frame->image != NULL;
+    return reader->backend->convert_frame(frame);
+}
 
-    // Write to file
-    printf("Writing AVIF file...\n");
-    FILE* f = fopen(filepath, "wb");
-    if (!f) {
-        printf("Error: Could not open output file: %s\n", filepath);
-        avifRWDataFree(&output);
-        avifImageDestroy(avifImg);
-        avifEncoderDestroy(encoder);
-        return false;
+static void free_animation_frame(const AnimationReader* reader, AnimationFrame* frame) {
+    if (frame->image) {
+        free_image_data(frame->image);
+        free(frame->image);
     }
+    if (frame->pending) reader->backend->free_pending_frame(frame->pending);
+    memset(frame, 0, sizeof(*frame));
+}
 
-    size_t bytesWritten = fwrite(output.data, 1, output.size, f);
-    fclose(f);
-
-    if (bytesWritten != output.size) {
-        printf("Error: Failed to write all data to file\n");
-        avifRWDataFree(&output);
-        avifImageDestroy(avifImg);
-        avifEncoderDestroy(encoder);
+// Encodes frames into an animation through the target format's backend
+typedef struct {
+    const CodecBackend* backend;
+    const ConversionOptions* options;
+    int loop_count;
+    size_t width;                   // Set by the first frame
+    size_t height;
+    size_t frame_count;
+    AnimationEncoder* encoder;
+} AnimationWriter;
+
+static bool add_animation_frame(AnimationWriter* writer, const ImageData* frame, int duration_ms) {
+    if (writer->frame_count == 0) {
+        writer->encoder = writer->backend->start_animation(frame, writer->loop_count, writer->options);
+        if (!writer->encoder) return false;
+        writer->width = frame->width;
+        writer->height = frame->height;
+    }
+    if (frame->width != writer->width || frame->height != writer->height) {
+        printf("Error: Animation frame %zu is %zux%zu instead of %zux%zu\n", writer->frame_count + 1,
+               frame->width, frame->height, writer->width, writer->height);
         return false;
     }
 
-    // Cleanup
-    avifRWDataFree(&output);
-    avifImageDestroy(avifImg);
-    avifEncoderDestroy(encoder);
-
-    printf("Successfully encoded and saved AVIF file\n");
-    return true;
+    bool added = writer->backend->add_frame(writer->encoder, frame, duration_ms);
+    writer->frame_count++;
+    return added;
 }
 
-ImageData* load_heic(const char* filepath) {
-    struct heif_context* ctx = heif_context_alloc();
-    if (!ctx) {
-        printf("Error: Could not create HEIF context\n");
-        return NULL;
-    }
+static bool finish_animation_writer(AnimationWriter* writer, const char* filepath) {
+    if (writer->frame_count == 0) return false;
+    return writer->backend->finish_animation(writer->encoder, filepath);
+}
 
-    // Read HEIC file
-    struct heif_error error = heif_context_read_from_file(ctx, filepath, NULL);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not read HEIF file: %s\n", error.message);
-        heif_context_free(ctx);
-        return NULL;
-    }
+static void close_animation_writer(AnimationWriter* writer) {
+    if (writer->encoder) writer->backend->close_animation_encoder(writer->encoder);
+}
 
-    // Get handle to primary image
-    struct heif_image_handle* handle;
-    error = heif_context_get_primary_image_handle(ctx, &handle);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not get primary image handle: %s\n", error.message);
-        heif_context_free(ctx);
-        return NULL;
-    }
+typedef enum {
+    FRAME_SLOT_EMPTY,
+    FRAME_SLOT_DECODED,
+    FRAME_SLOT_CONVERTING,
+    FRAME_SLOT_READY
+} FrameSlotState;
 
-    // Decode the image
-    struct heif_image* img;
-    error = heif_decode_image(handle, &img, heif_colorspace_RGB, heif_chroma_interleaved_RGBA, NULL);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not decode image: %s\n", error.message);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        return NULL;
-    }
+// Frames flow decoder -> converters -> encoder through a ring of slots, so
+// decoding, RGB conversion and encoding overlap while only a few frames
+// are in memory at once
+typedef struct {
+    AnimationReader* reader;
+    const ConversionOptions* options;
+    AnimationFrame frames[ANIMATION_PIPELINE_FRAMES];
+    FrameSlotState states[ANIMATION_PIPELINE_FRAMES];
+    size_t decoded;                 // Frames the decoder has produced
+    bool finished;                  // The decoder is done, successfully or not
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} AnimationPipeline;
+
+static void* decode_animation_frames(void* arg) {
+    AnimationPipeline* pipeline = (AnimationPipeline*)arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->failed) {
+        size_t slot = pipeline->decoded % ANIMATION_PIPELINE_FRAMES;
+        if (pipeline->states[slot] != FRAME_SLOT_EMPTY) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
 
-    // Get image dimensions
-    int width = heif_image_get_width(img, heif_channel_interleaved);
-    int height = heif_image_get_height(img, heif_channel_interleaved);
+        AnimationFrame frame;
+        bool failed;
+        bool more = read_animation_frame(pipeline->reader, &frame, &failed);
 
-    // Allocate our image structure
-    ImageData* output = (ImageData*)malloc(sizeof(ImageData));
-    if (!output) {
-        heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        return NULL;
-    }
+        pthread_mutex_lock(&pipeline->lock);
+        if (!more) {
+            if (failed) pipeline->failed = true;
+            break;
+        }
+        pipeline->frames[slot] = frame;
+        pipeline->states[slot] = FRAME_SLOT_DECODED;
+        pipeline->decoded++;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pipeline->finished = true;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
 
-    output->width = width;
-    output->height = height;
-    output->channels = 4; // RGBA
-    output->size = width * height * 4;
-    output->data = (unsigned char*)malloc(output->size);
+static void* convert_animation_frames(void* arg) {
+    AnimationPipeline* pipeline = (AnimationPipeline*)arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->failed) {
+        // Oldest frame first, as that is the one the encoder waits for
+        size_t slot = ANIMATION_PIPELINE_FRAMES;
+        for (size_t i = 0; i < ANIMATION_PIPELINE_FRAMES; i++) {
+            if (pipeline->states[i] == FRAME_SLOT_DECODED &&
+                (slot == ANIMATION_PIPELINE_FRAMES || pipeline->frames[i].index < pipeline->frames[slot].index)) {
+                slot = i;
+            }
+        }
+        if (slot == ANIMATION_PIPELINE_FRAMES) {
+            if (pipeline->finished) break;
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+            continue;
+        }
 
-    if (!output->data) {
-        free(output);
-        heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        return NULL;
-    }
+        pipeline->states[slot] = FRAME_SLOT_CONVERTING;
+        pthread_mutex_unlock(&pipeline->lock);
 
-    // Get the image data
-    int stride;
-    const uint8_t* data = heif_image_get_plane_readonly(img, heif_channel_interleaved, &stride);
-    if (!data) {
-        free(output->data);
-        free(output);
-        heif_image_release(img);
-        heif_image_handle_release(handle);
-        heif_context_free(ctx);
-        return NULL;
-    }
+        AnimationFrame* frame = &pipeline->frames[slot];
+        bool converted = convert_animation_frame(pipeline->reader, frame);
+        if (converted) {
+            frame->image = apply_crop(frame->image, pipeline->options);
+            converted = frame->image != NULL;
+        }
 
-    // Copy the data
-    for (int y = 0; y < height; y++) {
-        memcpy(output->data + y * width * 4, data + y * stride, width * 4);
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->states[slot] = FRAME_SLOT_READY;
+        if (!converted) pipeline->failed = true;
+        pthread_cond_broadcast(&pipeline->changed);
     }
-
-    // Cleanup HEIF objects
-    heif_image_release(img);
-    heif_image_handle_release(handle);
-    heif_context_free(ctx);
-
-    return output;
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
 }
 
-bool save_heic(const char* filepath, const ImageData* img, const ConversionOptions* options) {
-    if (!img || !img->data || !filepath) {
-        printf("Error: Invalid input parameters\n");
-        return false;
-    }
+bool format_supports_animation(ImageFormat format) {
+    return codec_has(format, CODEC_CAP_ANIMATION);
+}
 
-    // Create encoder
-    struct heif_context* ctx = heif_context_alloc();
-    if (!ctx) {
-        printf("Error: Could not create HEIF context\n");
-        return false;
-    }
+bool is_animated_image(const char* filepath, ImageFormat format) {
+    const Codec* codec = codec_for_format(format);
+    return codec && codec->is_animated && codec->is_animated(filepath);
+}
 
-    // Create HEIF image
-    struct heif_image* heif_img;
-    struct heif_error error = heif_image_create(img->width, img->height,
-                                              heif_colorspace_RGB,
-                                              heif_chroma_interleaved_RGBA,
-                                              &heif_img);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not create HEIF image: %s\n", error.message);
-        heif_context_free(ctx);
-        return false;
+bool convert_animation(const char* input_path, ImageFormat input_format,
+                       const char* output_path, ImageFormat target_format,
+                       const ConversionOptions* options) {
+    if (!input_path || !output_path || !format_supports_animation(target_format)) return false;
+
+    AnimationReader reader = { .backend = codec_backend(input_format) };
+    const CodecBackend* target = codec_backend(target_format);
+    if (!reader.backend || !reader.backend->open_animation || !target) return false;
+    reader.decoder = reader.backend->open_animation(input_path, options, &reader.info);
+    if (!reader.decoder) return false;
+
+    AnimationPipeline pipeline = { .reader = &reader, .options = options };
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    // Frames that arrive as RGBA only need cropping, which one thread keeps up with
+    int converters = 1;
+    if (reader.backend->convert_frame) {
+        converters = parallel_cpu_count();
+        if (converters > ANIMATION_MAX_CONVERTERS) converters = ANIMATION_MAX_CONVERTERS;
+    }
+
+    pthread_t decoder_thread;
+    pthread_t converter_threads[ANIMATION_MAX_CONVERTERS];
+    int started = 0;
+    bool decoding = pthread_create(&decoder_thread, NULL, decode_animation_frames, &pipeline) == 0;
+    for (int i = 0; decoding && i < converters; i++) {
+        if (pthread_create(&converter_threads[started], NULL, convert_animation_frames, &pipeline) == 0) {
+            started++;
+        }
     }
 
-    // Add image plane
-    error = heif_image_add_plane(heif_img, heif_channel_interleaved,
-                                img->width, img->height, 8);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not add image plane: %s\n", error.message);
-        heif_image_release(heif_img);
-        heif_context_free(ctx);
-        return false;
-    }
+    AnimationWriter writer = {
+        .backend = target,
+        .options = options,
+        .loop_count = reader.info.loop_count
+    };
+
+    // Frames are encoded in order as they become ready
+    pthread_mutex_lock(&pipeline.lock);
+    // The stages may already have failed; never clear what they recorded
+    if (!decoding || started == 0) {
+        pipeline.failed = true;
+        pthread_cond_broadcast(&pipeline.changed);
+    }
+    for (size_t index = 0; !pipeline.failed; index++) {
+        size_t slot = index % ANIMATION_PIPELINE_FRAMES;
+        while (!pipeline.failed && pipeline.states[slot] != FRAME_SLOT_READY &&
+               !(pipeline.finished && index >= pipeline.decoded)) {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        if (pipeline.failed || pipeline.states[slot] != FRAME_SLOT_READY) break;
+        pthread_mutex_unlock(&pipeline.lock);
 
-    // Get plane data
-    int stride;
-    uint8_t* plane = heif_image_get_plane(heif_img, heif_channel_interleaved, &stride);
-    if (!plane) {
-        printf("Error: Could not get image plane\n");
-        heif_image_release(heif_img);
-        heif_context_free(ctx);
-        return false;
-    }
+        AnimationFrame* frame = &pipeline.frames[slot];
+        bool added = add_animation_frame(&writer, frame->image, frame->duration_ms);
+        free_animation_frame(&reader, frame);
 
-    // Copy image data
-    for (size_t y = 0; y < img->height; y++) {
-        memcpy(plane + y * stride, 
-               img->data + y * img->width * 4,
-               img->width * 4);
-    }
-
-    // Get encoder
-    struct heif_encoder* encoder;
-    error = heif_context_get_encoder_for_format(ctx, heif_compression_HEVC, &encoder);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not create encoder: %s\n", error.message);
-        heif_image_release(heif_img);
-        heif_context_free(ctx);
-        return false;
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.states[slot] = FRAME_SLOT_EMPTY;
+        if (!added) pipeline.failed = true;
+        pthread_cond_broadcast(&pipeline.changed);
     }
+    bool failed = pipeline.failed;
+    // Wakes the other stages if the encoder gave up
+    pipeline.failed = true;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
 
-    // Set encoding quality
-    if (options) {
-        int quality = options->quality;
-        error = heif_encoder_set_lossy_quality(encoder, quality);
-        if (error.code != heif_error_Ok) {
-            printf("Warning: Could not set quality: %s\n", error.message);
-        }
+    if (decoding) pthread_join(decoder_thread, NULL);
+    for (int i = 0; i < started; i++) {
+        pthread_join(converter_threads[i], NULL);
     }
 
-    // Encode image
-    error = heif_context_encode_image(ctx, heif_img, encoder, NULL, NULL);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not encode image: %s\n", error.message);
-        heif_encoder_release(encoder);
-        heif_image_release(heif_img);
-        heif_context_free(ctx);
-        return false;
-    }
+    bool success = !failed && finish_animation_writer(&writer, output_path);
 
-    // Write file
-    error = heif_context_write_to_file(ctx, filepath);
-    if (error.code != heif_error_Ok) {
-        printf("Error: Could not write file: %s\n", error.message);
-        heif_encoder_release(encoder);
-        heif_image_release(heif_img);
-        heif_context_free(ctx);
-        return false;
+    for (size_t i = 0; i < ANIMATION_PIPELINE_FRAMES; i++) {
+        free_animation_frame(&reader, &pipeline.frames[i]);
     }
-
-    // Cleanup
-    heif_encoder_release(encoder);
-    heif_image_release(heif_img);
-    heif_context_free(ctx);
-
-    printf("Successfully encoded and saved HEIC file\n");
-    return true;
+    close_animation_writer(&writer);
+    reader.backend->close_animation(reader.decoder);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    return success;
 }
@@ -186,10 +186,9 @@ static void convert_clicked(GtkWidget *widget G_GNUC_UNUSED, gpointer data) {
     AppWindow *app = (AppWindow *)data;
     int current_tab = gtk_notebook_get_current_page(GTK_NOTEBOOK(app->notebook));
     
-    ConversionOptions options = {
-        .quality = app->quality,
-        .maintain_exif = true
-    };
+    ConversionOptions options;
+    init_conversion_options(&options);
+    options.quality = app->quality;
 
     if (current_tab == 0) {  // Single file mode
         if (!app->single_tab->current_filename) {
@@ -0,0 +1,487 @@
+#include "../include/image_metrics.h"
+#include "../include/parallel.h"
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PSNR_CHUNK_PIXELS 16384   // Keeps the 32-bit SIMD accumulators from overflowing
+#define METRIC_BANDS_PER_THREAD 4 // Row bands per thread, to even out the load
+#define MS_SSIM_SCALES 5
+
+// Per-scale exponents from Wang, Simoncelli and Bovik's MS-SSIM
+static const double ms_ssim_weights[MS_SSIM_SCALES] = {
+    0.0448, 0.2856, 0.3001, 0.2363, 0.1333
+};
+
+// Sums over one 4x4 block of both luma planes
+typedef struct {
+    uint32_t s1;    // Sum of a
+    uint32_t s2;    // Sum of b
+    uint32_t ss;    // Sum of a^2 + b^2
+    uint32_t s12;   // Sum of a * b
+} SsimSums;
+
+// A luma plane, width bytes per row
+typedef struct {
+    unsigned char* data;
+    size_t width;
+    size_t height;
+} LumaPlane;
+
+typedef struct {
+    const ImageData* img;
+    unsigned char* plane;
+} LumaJob;
+
+typedef struct {
+    const LumaPlane* a;
+    const LumaPlane* b;
+    size_t blocks_x;
+    size_t blocks_y;
+    size_t rows_per_band;       // Window rows per band
+    double* ssim;               // Per band: sum of SSIM over its windows
+    double* cs;                 // Per band: sum of contrast-structure terms
+    atomic_bool failed;
+} SsimJob;
+
+typedef struct {
+    const ImageData* a;
+    const ImageData* b;
+    size_t rows_per_band;
+    uint64_t* errors;           // Per band
+} PsnrJob;
+
+static bool same_size(const ImageData* a, const ImageData* b) {
+    return a && b && a->data && b->data && a->width == b->width && a->height == b->height &&
+           a->width > 0 && a->height > 0;
+}
+
+static size_t band_count(size_t rows, int threads) {
+    size_t bands = (size_t)threads * METRIC_BANDS_PER_THREAD;
+    if (bands > rows) bands = rows;
+    return bands > 0 ? bands : 1;
+}
+
+// BT.601 luma in 8.8 fixed point (the weights add up to 256)
+static void luma_row(void* ctx, size_t y) {
+    const LumaJob* job = (const LumaJob*)ctx;
+    const unsigned char* p = image_row(job->img, y);
+    unsigned char* out = job->plane + y * job->img->width;
+    for (size_t x = 0; x < job->img->width; x++, p += 4) {
+        out[x] = (unsigned char)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+    }
+}
+
+static bool luma_plane(const ImageData* img, int threads, LumaPlane* plane) {
+    plane->width = img->width;
+    plane->height = img->height;
+    plane->data = (unsigned char*)malloc(img->width * img->height);
+    if (!plane->data) return false;
+
+    LumaJob job = { .img = img, .plane = plane->data };
+    parallel_for(img->height, threads, luma_row, &job);
+    return true;
+}
+
+// Halves a plane with a 2x2 box filter (the MS-SSIM low-pass step)
+static bool downsample_plane(const LumaPlane* src, LumaPlane* dst) {
+    dst->width = src->width / 2;
+    dst->height = src->height / 2;
+    dst->data = (unsigned char*)malloc(dst->width * dst->height);
+    if (!dst->data) return false;
+
+    for (size_t y = 0; y < dst->height; y++) {
+        const unsigned char* r0 = src->data + 2 * y * src->width;
+        const unsigned char* r1 = r0 + src->width;
+        unsigned char* out = dst->data + y * dst->width;
+        size_t x = 0;
+#ifdef __SSE2__
+        // 16 source pixels per row give 8 outputs: even and odd pixels are
+        // split into 16-bit lanes and the four of each output added up
+        const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+        const __m128i rounding = _mm_set1_epi16(2);
+        for (; x + 8 <= dst->width; x += 8) {
+            __m128i v0 = _mm_loadu_si128((const __m128i*)(r0 + 2 * x));
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(r1 + 2 * x));
+            __m128i sum = _mm_add_epi16(_mm_and_si128(v0, low_bytes), _mm_srli_epi16(v0, 8));
+            sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_and_si128(v1, low_bytes), _mm_srli_epi16(v1, 8)));
+            sum = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+            _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(sum, sum));
+        }
+#endif
+        for (; x < dst->width; x++) {
+            out[x] = (unsigned char)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+        }
+    }
+    return true;
+}
+
+// Sums for a row of 4x4 blocks starting at a and b
+static void ssim_block_row(const unsigned char* a, const unsigned char* b, size_t stride,
+                           size_t blocks, SsimSums* sums) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // Four blocks (16 pixels) per step: 16-bit lanes collect the pixel sums,
+    // madd turns products of neighboring pixels into 32-bit pair sums
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= blocks; i += 4) {
+        __m128i s1[2] = { zero, zero };
+        __m128i s2[2] = { zero, zero };
+        __m128i ss[2] = { zero, zero };
+        __m128i s12[2] = { zero, zero };
+
+        for (size_t row = 0; row < 4; row++) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a + row * stride + i * 4));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b + row * stride + i * 4));
+            __m128i pa[2] = { _mm_unpacklo_epi8(va, zero), _mm_unpackhi_epi8(va, zero) };
+            __m128i pb[2] = { _mm_unpacklo_epi8(vb, zero), _mm_unpackhi_epi8(vb, zero) };
+
+            for (int h = 0; h < 2; h++) {
+                s1[h] = _mm_add_epi16(s1[h], pa[h]);
+                s2[h] = _mm_add_epi16(s2[h], pb[h]);
+                ss[h] = _mm_add_epi32(ss[h], _mm_add_epi32(_mm_madd_epi16(pa[h], pa[h]),
+                                                           _mm_madd_epi16(pb[h], pb[h])));
+                s12[h] = _mm_add_epi32(s12[h], _mm_madd_epi16(pa[h], pb[h]));
+            }
+        }
+
+        uint16_t s1_lanes[16], s2_lanes[16];
+        uint32_t ss_lanes[8], s12_lanes[8];
+        for (int h = 0; h < 2; h++) {
+            _mm_storeu_si128((__m128i*)(s1_lanes + h * 8), s1[h]);
+            _mm_storeu_si128((__m128i*)(s2_lanes + h * 8), s2[h]);
+            _mm_storeu_si128((__m128i*)(ss_lanes + h * 4), ss[h]);
+            _mm_storeu_si128((__m128i*)(s12_lanes + h * 4), s12[h]);
+        }
+
+        for (size_t k = 0; k < 4; k++) {
+            SsimSums* out = &sums[i + k];
+            out->s1 = (uint32_t)s1_lanes[4 * k] + s1_lanes[4 * k + 1] +
+                      s1_lanes[4 * k + 2] + s1_lanes[4 * k + 3];
+            out->s2 = (uint32_t)s2_lanes[4 * k] + s2_lanes[4 * k + 1] +
+                      s2_lanes[4 * k + 2] + s2_lanes[4 * k + 3];
+            out->ss = ss_lanes[2 * k] + ss_lanes[2 * k + 1];
+            out->s12 = s12_lanes[2 * k] + s12_lanes[2 * k + 1];
+        }
+    }
+#endif
+    for (; i < blocks; i++) {
+        SsimSums block = {0};
+        for (size_t row = 0; row < 4; row++) {
+            const unsigned char* pa = a + row * stride + i * 4;
+            const unsigned char* pb = b + row * stride + i * 4;
+            for (size_t x = 0; x < 4; x++) {
+                block.s1 += pa[x];
+                block.s2 += pb[x];
+                block.ss += pa[x] * pa[x] + pb[x] * pb[x];
+                block.s12 += pa[x] * pb[x];
+            }
+        }
+        sums[i] = block;
+    }
+}
+
+// Splits the SSIM of a window of n pixels, computed from its sums, into the
+// luminance term and the contrast-structure term. The usual constants
+// (K1 = 0.01, K2 = 0.03) are scaled to sums instead of means.
+static void ssim_window(double s1, double s2, double ss, double s12, double n,
+                        double* luminance, double* cs) {
+    const double c1 = 0.01 * 0.01 * 255 * 255 * n * n;
+    const double c2 = 0.03 * 0.03 * 255 * 255 * n * (n - 1);
+    double vars = ss * n - s1 * s1 - s2 * s2;
+    double covar = s12 * n - s1 * s2;
+    *luminance = (2 * s1 * s2 + c1) / (s1 * s1 + s2 * s2 + c1);
+    *cs = (2 * covar + c2) / (vars + c2);
+}
+
+// One band of window rows; each 8x8 window combines 2x2 neighboring blocks
+static void ssim_band(void* ctx, size_t band) {
+    SsimJob* job = (SsimJob*)ctx;
+    size_t first = 1 + band * job->rows_per_band;
+    size_t last = first + job->rows_per_band < job->blocks_y ? first + job->rows_per_band : job->blocks_y;
+    size_t width = job->a->width;
+
+    job->ssim[band] = 0.0;
+    job->cs[band] = 0.0;
+    if (first >= last) return;
+
+    SsimSums* rows = (SsimSums*)malloc(2 * job->blocks_x * sizeof(SsimSums));
+    if (!rows) {
+        atomic_store(&job->failed, true);
+        return;
+    }
+
+    double ssim_total = 0.0;
+    double cs_total = 0.0;
+    for (size_t by = first - 1; by < last; by++) {
+        SsimSums* current = rows + (by & 1) * job->blocks_x;
+        SsimSums* previous = rows + ((by + 1) & 1) * job->blocks_x;
+        ssim_block_row(job->a->data + by * 4 * width, job->b->data + by * 4 * width,
+                       width, job->blocks_x, current);
+        if (by == first - 1) continue;
+
+        for (size_t bx = 0; bx + 1 < job->blocks_x; bx++) {
+            const SsimSums* q[4] = { &previous[bx], &previous[bx + 1],
+                                     &current[bx], &current[bx + 1] };
+            double s1 = 0, s2 = 0, ss = 0, s12 = 0;
+            for (int k = 0; k < 4; k++) {
+                s1 += q[k]->s1;
+                s2 += q[k]->s2;
+                ss += q[k]->ss;
+                s12 += q[k]->s12;
+            }
+            double luminance, cs;
+            ssim_window(s1, s2, ss, s12, 64, &luminance, &cs);
+            ssim_total += luminance * cs;
+            cs_total += cs;
+        }
+    }
+
+    free(rows);
+    job->ssim[band] = ssim_total;
+    job->cs[band] = cs_total;
+}
+
+// Mean SSIM and mean contrast-structure term of two planes
+static bool ssim_plane(const LumaPlane* a, const LumaPlane* b, int threads,
+                       double* ssim, double* cs) {
+    size_t blocks_x = a->width / 4;
+    size_t blocks_y = a->height / 4;
+
+    if (blocks_x < 2 || blocks_y < 2) {
+        // Too small for 8x8 windows: one window covering the whole plane
+        size_t n = a->width * a->height;
+        double s1 = 0, s2 = 0, ss = 0, s12 = 0;
+        for (size_t i = 0; i < n; i++) {
+            s1 += a->data[i];
+            s2 += b->data[i];
+            ss += (double)a->data[i] * a->data[i] + (double)b->data[i] * b->data[i];
+            s12 += (double)a->data[i] * b->data[i];
+        }
+        if (n < 2) {
+            *ssim = *cs = a->data[0] == b->data[0] ? 1.0 : 0.0;
+            return true;
+        }
+        double luminance;
+        ssim_window(s1, s2, ss, s12, (double)n, &luminance, cs);
+        *ssim = luminance * *cs;
+        return true;
+    }
+
+    size_t window_rows = blocks_y - 1;
+    size_t bands = band_count(window_rows, threads);
+    SsimJob job = {
+        .a = a,
+        .b = b,
+        .blocks_x = blocks_x,
+        .blocks_y = blocks_y,
+        .rows_per_band = (window_rows + bands - 1) / bands,
+        .ssim = (double*)calloc(bands, sizeof(double)),
+        .cs = (double*)calloc(bands, sizeof(double))
+    };
+    atomic_init(&job.failed, false);
+
+    bool success = job.ssim && job.cs;
+    if (success) {
+        parallel_for(bands, threads, ssim_band, &job);
+        success = !atomic_load(&job.failed);
+    }
+
+    if (success) {
+        double ssim_total = 0.0;
+        double cs_total = 0.0;
+        for (size_t i = 0; i < bands; i++) {
+            ssim_total += job.ssim[i];
+            cs_total += job.cs[i];
+        }
+        double windows = (double)window_rows * (blocks_x - 1);
+        *ssim = ssim_total / windows;
+        *cs = cs_total / windows;
+    }
+
+    free(job.ssim);
+    free(job.cs);
+    return success;
+}
+
+// MS-SSIM over as many of the five scales as the plane size allows
+// (weights renormalized); negative terms are clamped to 0
+static bool ms_ssim_planes(const LumaPlane* a, const LumaPlane* b, int threads, double* ms_ssim) {
+    int scales = 1;
+    while (scales < MS_SSIM_SCALES &&
+           (a->width >> scales) >= 8 && (a->height >> scales) >= 8) {
+        scales++;
+    }
+    double weight_total = 0.0;
+    for (int i = 0; i < scales; i++) weight_total += ms_ssim_weights[i];
+
+    LumaPlane current[2] = { *a, *b };
+    bool owned = false;     // current holds downsampled copies
+    double result = 1.0;
+    bool success = true;
+
+    for (int scale = 0; scale < scales && success; scale++) {
+        double ssim, cs;
+        success = ssim_plane(&current[0], &current[1], threads, &ssim, &cs);
+        if (!success) break;
+
+        // Luminance only counts at the coarsest scale
+        double term = scale == scales - 1 ? ssim : cs;
+        result *= pow(term > 0.0 ? term : 0.0, ms_ssim_weights[scale] / weight_total);
+
+        if (scale < scales - 1) {
+            LumaPlane next[2] = {{0}};
+            success = downsample_plane(&current[0], &next[0]) &&
+                      downsample_plane(&current[1], &next[1]);
+            if (owned) {
+                free(current[0].data);
+                free(current[1].data);
+            }
+            current[0] = next[0];
+            current[1] = next[1];
+            owned = true;
+        }
+    }
+
+    if (owned) {
+        free(current[0].data);
+        free(current[1].data);
+    }
+    *ms_ssim = result;
+    return success;
+}
+
+// Squared RGB error of one row; alpha is ignored
+static uint64_t row_squared_error(const unsigned char* a, const unsigned char* b, size_t width) {
+    uint64_t total = 0;
+    size_t x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+    while (x + 4 <= width) {
+        size_t end = x + PSNR_CHUNK_PIXELS < width ? x + PSNR_CHUNK_PIXELS : width;
+        __m128i acc = zero;
+        for (; x + 4 <= end; x += 4) {
+            __m128i va = _mm_and_si128(_mm_loadu_si128((const __m128i*)(a + x * 4)), rgb_mask);
+            __m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i*)(b + x * 4)), rgb_mask);
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, acc);
+        total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; x < width; x++) {
+        for (int c = 0; c < 3; c++) {
+            int d = a[x * 4 + c] - b[x * 4 + c];
+            total += (uint64_t)(d * d);
+        }
+    }
+    return total;
+}
+
+static void psnr_band(void* ctx, size_t band) {
+    PsnrJob* job = (PsnrJob*)ctx;
+    size_t first = band * job->rows_per_band;
+    size_t last = first + job->rows_per_band < job->a->height ? first + job->rows_per_band : job->a->height;
+
+    uint64_t error = 0;
+    for (size_t y = first; y < last; y++) {
+        error += row_squared_error(image_row(job->a, y), image_row(job->b, y), job->a->width);
+    }
+    job->errors[band] = error;
+}
+
+static double psnr_threaded(const ImageData* a, const ImageData* b, int threads) {
+    size_t bands = band_count(a->height, threads);
+    PsnrJob job = {
+        .a = a,
+        .b = b,
+        .rows_per_band = (a->height + bands - 1) / bands,
+        .errors = (uint64_t*)calloc(bands, sizeof(uint64_t))
+    };
+    if (!job.errors) return -1.0;
+
+    parallel_for(bands, threads, psnr_band, &job);
+
+    uint64_t error = 0;
+    for (size_t i = 0; i < bands; i++) error += job.errors[i];
+    free(job.errors);
+    if (error == 0) return INFINITY;
+
+    double mse = (double)error / (3.0 * a->width * a->height);
+    return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+double image_psnr(const ImageData* a, const ImageData* b) {
+    return same_size(a, b) ? psnr_threaded(a, b, 1) : -1.0;
+}
+
+double image_ssim(const ImageData* a, const ImageData* b) {
+    if (!same_size(a, b)) return -1.0;
+
+    LumaPlane la, lb;
+    double ssim = -1.0, cs;
+    if (luma_plane(a, 1, &la) && luma_plane(b, 1, &lb)) {
+        if (!ssim_plane(&la, &lb, 1, &ssim, &cs)) ssim = -1.0;
+        free(lb.data);
+    }
+    free(la.data);
+    return ssim;
+}
+
+bool compare_images(const ImageData* a, const ImageData* b, int threads, ImageQuality* quality) {
+    if (!quality || !same_size(a, b)) return false;
+    if (threads <= 0) threads = parallel_cpu_count();
+
+    LumaPlane la = {0}, lb = {0};
+    double cs;
+    bool success = luma_plane(a, threads, &la) && luma_plane(b, threads, &lb) &&
+                   ssim_plane(&la, &lb, threads, &quality->ssim, &cs) &&
+                   ms_ssim_planes(&la, &lb, threads, &quality->ms_ssim);
+    free(la.data);
+    free(lb.data);
+
+    quality->psnr = success ? psnr_threaded(a, b, threads) : -1.0;
+    return success && quality->psnr >= 0.0;
+}
+
+bool compare_image_files(const char* path_a, const char* path_b, int threads,
+                         ImageQuality* quality) {
+    // Compare what a viewer shows: upright, metadata aside
+    ConversionOptions options;
+    init_conversion_options(&options);
+    options.maintain_exif = false;
+
+    ImageData* a = load_image(path_a, &options);
+    ImageData* b = a ? load_image(path_b, &options) : NULL;
+    bool success = false;
+
+    if (!a || !b) {
+        printf("Error: Could not load %s\n", a ? path_b : path_a);
+    } else if (a->width != b->width || a->height != b->height) {
+        printf("Error: Images differ in size (%zux%zu vs %zux%zu)\n",
+               a->width, a->height, b->width, b->height);
+    } else {
+        success = compare_images(a, b, threads, quality);
+        if (!success) printf("Error: Could not compare images\n");
+    }
+
+    if (a) {
+        free_image_data(a);
+        free(a);
+    }
+    if (b) {
+        free_image_data(b);
+        free(b);
+    }
+    return success;
+}
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include "../include/image_ops.h"
+#include "../include/memory_budget.h"
+#include "../include/parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define EXIF_TAG_ORIENTATION 0x0112
+#define ORIENT_BLOCK_SIZE 64   // Pixels per side of a cache block (64*64*4 = 16 KB)
+#define SPILL_DEFAULT_DIR "/var/tmp"   // Disk-backed, unlike /tmp on many systems
+
+// Locates the value field of the orientation entry in IFD0
+static unsigned char* find_orientation_entry(const unsigned char* exif, size_t size,
+                                             bool* big_endian) {
+    if (!exif || size < 8) return NULL;
+
+    if (memcmp(exif, "II*\0", 4) == 0) {
+        *big_endian = false;
+    } else if (memcmp(exif, "MM\0*", 4) == 0) {
+        *big_endian = true;
+    } else {
+        return NULL;
+    }
+
+#define EXIF_U16(p) (*big_endian ? (uint32_t)((p)[0] << 8 | (p)[1]) : (uint32_t)((p)[1] << 8 | (p)[0]))
+#define EXIF_U32(p) (*big_endian ? \
+    ((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | (uint32_t)(p)[2] << 8 | (p)[3]) : \
+    ((uint32_t)(p)[3] << 24 | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[1] << 8 | (p)[0]))
+
+    uint32_t ifd = EXIF_U32(exif + 4);
+    if (ifd > size - 2) return NULL;
+
+    uint32_t count = EXIF_U16(exif + ifd);
+    const unsigned char* entry = exif + ifd + 2;
+    for (uint32_t i = 0; i < count; i++, entry += 12) {
+        if ((size_t)(entry - exif) + 12 > size) return NULL;
+        if (EXIF_U16(entry) == EXIF_TAG_ORIENTATION) {
+            return (unsigned char*)entry + 8;
+        }
+    }
+
+#undef EXIF_U16
+#undef EXIF_U32
+    return NULL;
+}
+
+int exif_get_orientation(const unsigned char* exif, size_t size) {
+    bool big_endian;
+    const unsigned char* value = find_orientation_entry(exif, size, &big_endian);
+    if (!value) return EXIF_ORIENTATION_NORMAL;
+
+    int orientation = big_endian ? (value[0] << 8 | value[1]) : (value[1] << 8 | value[0]);
+    return (orientation >= 1 && orientation <= 8) ? orientation : EXIF_ORIENTATION_NORMAL;
+}
+
+bool exif_set_orientation(unsigned char* exif, size_t size, int orientation) {
+    bool big_endian;
+    unsigned char* value = find_orientation_entry(exif, size, &big_endian);
+    if (!value) return false;
+
+    value[big_endian ? 0 : 1] = 0;
+    value[big_endian ? 1 : 0] = (unsigned char)orientation;
+    return true;
+}
+
+typedef struct {
+    const ImageData* src;
+    ImageData* dst;
+    bool flip_h;      // Mirror output columns
+    bool flip_v;      // Mirror output rows
+} OrientJob;
+
+static inline void copy_pixel(const OrientJob* job, size_t x, size_t y) {
+    // Source (x, y) lands on output row x, column y, then mirrors apply
+    size_t out_row = job->flip_v ? job->src->width - 1 - x : x;
+    size_t out_col = job->flip_h ? job->src->height - 1 - y : y;
+    memcpy(image_row(job->dst, out_row) + out_col * 4, image_row(job->src, y) + x * 4, 4);
+}
+
+// Transposes one horizontal stripe of source blocks (orientations 5-8).
+// Working in 64x64 blocks keeps both the rows being read and the columns
+// being written in cache; inside a block 4x4 tiles are transposed in SSE2
+// registers.
+static void transpose_stripe(void* ctx, size_t index) {
+    const OrientJob* job = (const OrientJob*)ctx;
+    const ImageData* src = job->src;
+    size_t by = index * ORIENT_BLOCK_SIZE;
+    size_t ey = by + ORIENT_BLOCK_SIZE < src->height ? by + ORIENT_BLOCK_SIZE : src->height;
+
+    for (size_t bx = 0; bx < src->width; bx += ORIENT_BLOCK_SIZE) {
+        size_t ex = bx + ORIENT_BLOCK_SIZE < src->width ? bx + ORIENT_BLOCK_SIZE : src->width;
+        size_t y = by;
+#ifdef __SSE2__
+        for (; y + 4 <= ey; y += 4) {
+            size_t x = bx;
+            for (; x + 4 <= ex; x += 4) {
+                __m128i r0 = _mm_loadu_si128((const __m128i*)(image_row(src, y) + x * 4));
+                __m128i r1 = _mm_loadu_si128((const __m128i*)(image_row(src, y + 1) + x * 4));
+                __m128i r2 = _mm_loadu_si128((const __m128i*)(image_row(src, y + 2) + x * 4));
+                __m128i r3 = _mm_loadu_si128((const __m128i*)(image_row(src, y + 3) + x * 4));
+                __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+                __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+                __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+                __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+                __m128i columns[4] = {
+                    _mm_unpacklo_epi64(t0, t1),
+                    _mm_unpackhi_epi64(t0, t1),
+                    _mm_unpacklo_epi64(t2, t3),
+                    _mm_unpackhi_epi64(t2, t3)
+                };
+
+                size_t out_col = job->flip_h ? src->height - 4 - y : y;
+                for (int i = 0; i < 4; i++) {
+                    size_t out_row = job->flip_v ? src->width - 1 - (x + i) : x + i;
+                    __m128i v = columns[i];
+                    if (job->flip_h) v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+                    _mm_storeu_si128((__m128i*)(image_row(job->dst, out_row) + out_col * 4), v);
+                }
+            }
+            for (; x < ex; x++) {
+                for (size_t k = 0; k < 4; k++) copy_pixel(job, x, y + k);
+            }
+        }
+#endif
+        for (; y < ey; y++) {
+            for (size_t x = bx; x < ex; x++) copy_pixel(job, x, y);
+        }
+    }
+}
+
+// Row copies for orientations 2-4 (no transpose)
+static void flip_row(void* ctx, size_t y) {
+    const OrientJob* job = (const OrientJob*)ctx;
+    const ImageData* src = job->src;
+    const unsigned char* in = image_row(src, job->flip_v ? src->height - 1 - y : y);
+    unsigned char* out = image_row(job->dst, y);
+
+    if (!job->flip_h) {
+        memcpy(out, in, src->width * 4);
+        return;
+    }
+
+    size_t x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= src->width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + (src->width - 4 - x) * 4));
+        _mm_storeu_si128((__m128i*)(out + x * 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; x < src->width; x++) {
+        memcpy(out + x * 4, in + (src->width - 1 - x) * 4, 4);
+    }
+}
+
+// Opens an unlinked temporary file in dir
+static int open_temp_file(const char* dir) {
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+#endif
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/media-processor-XXXXXX", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+void* map_temp_buffer(size_t size) {
+    if (size == 0) return NULL;
+
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = SPILL_DEFAULT_DIR;
+    int fd = open_temp_file(dir);
+    if (fd < 0) {
+        printf("Error: Could not create temporary file in %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    // Reserving the blocks now turns a full disk into an error here rather
+    // than SIGBUS on some later write through the mapping
+#ifdef __linux__
+    int error = posix_fallocate(fd, 0, (off_t)size);
+#else
+    int error = ftruncate(fd, (off_t)size) == 0 ? 0 : errno;
+#endif
+    void* buffer = MAP_FAILED;
+    if (error == 0) {
+        buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (buffer == MAP_FAILED) error = errno;
+    }
+    // The mapping keeps the file alive
+    close(fd);
+
+    if (buffer == MAP_FAILED) {
+        printf("Error: Could not map %zu bytes of temporary file in %s: %s\n",
+               size, dir, strerror(error));
+        return NULL;
+    }
+    // Codecs walk images row by row
+    madvise(buffer, size, MADV_SEQUENTIAL);
+    return buffer;
+}
+
+void unmap_temp_buffer(void* buffer, size_t size) {
+    if (buffer) munmap(buffer, size);
+}
+
+typedef struct {
+    void* buffer;
+    size_t size;
+} MappedPixels;
+
+static void release_mapped_pixels(void* ctx) {
+    MappedPixels* pixels = (MappedPixels*)ctx;
+    unmap_temp_buffer(pixels->buffer, pixels->size);
+    free(pixels);
+}
+
+ImageData* create_mapped_image_data(size_t width, size_t height) {
+    MappedPixels* pixels = (MappedPixels*)malloc(sizeof(MappedPixels));
+    if (!pixels) return NULL;
+
+    pixels->size = width * height * 4;
+    pixels->buffer = map_temp_buffer(pixels->size);
+    if (!pixels->buffer) {
+        free(pixels);
+        return NULL;
+    }
+
+    ImageData* img = wrap_image_data((unsigned char*)pixels->buffer, width, height, width * 4,
+                                     release_mapped_pixels, pixels);
+    if (!img) release_mapped_pixels(pixels);
+    return img;
+}
+
+bool image_is_mapped(const ImageData* img) {
+    return image_is_borrowed_from(img, release_mapped_pixels);
+}
+
+static size_t automatic_spill_threshold;
+
+static void init_spill_threshold(void) {
+    automatic_spill_threshold = memory_limit_default() / SPILL_MEMORY_SHARE;
+}
+
+bool image_should_spill(size_t width, size_t height, const ConversionOptions* options) {
+    size_t threshold = options ? options->spill_threshold : 0;
+    if (threshold == 0) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, init_spill_threshold);
+        threshold = automatic_spill_threshold;
+    }
+    return width * height * 4 > threshold;
+}
+
+ImageData* orient_image(const ImageData* src, int orientation) {
+    if (!src || !src->data || orientation < 1 || orientation > 8) return NULL;
+
+    bool transpose = orientation >= 5;
+    size_t width = transpose ? src->height : src->width;
+    size_t height = transpose ? src->width : src->height;
+    ImageData* dst = image_is_mapped(src) ? create_mapped_image_data(width, height)
+                                          : create_image_data(width, height);
+    if (!dst) return NULL;
+
+    // Orientation -> mirrors applied after the optional transpose:
+    // 2 mirror, 3 rotate 180, 4 flip, 5 transpose, 6 rotate 90 CW,
+    // 7 transverse, 8 rotate 90 CCW
+    OrientJob job = { .src = src, .dst = dst };
+    switch (orientation) {
+        case 2: job.flip_h = true; break;
+        case 3: job.flip_h = true; job.flip_v = true; break;
+        case 4: job.flip_v = true; break;
+        case 6: job.flip_h = true; break;
+        case 7: job.flip_h = true; job.flip_v = true; break;
+        case 8: job.flip_v = true; break;
+        default: break;
+    }
+
+    if (transpose) {
+        size_t stripes = (src->height + ORIENT_BLOCK_SIZE - 1) / ORIENT_BLOCK_SIZE;
+        parallel_for(stripes, 0, transpose_stripe, &job);
+    } else {
+        parallel_for(src->height, 0, flip_row, &job);
+    }
+
+    return dst;
+}
+
+size_t shrink_factor(size_t width, size_t height, size_t max_side) {
+    size_t longest = width > height ? width : height;
+    size_t factor = max_side ? (longest + max_side - 1) / max_side : 1;
+    return factor < 1 ? 1 : factor;
+}
+
+ImageData* shrink_image(const ImageData* img, size_t max_side, bool point_sample) {
+    if (!img || !img->data || max_side == 0) return NULL;
+    return shrink_image_by(img, shrink_factor(img->width, img->height, max_side), point_sample);
+}
+
+ImageData* shrink_image_by(const ImageData* img, size_t factor, bool point_sample) {
+    if (!img || !img->data || factor == 0) return NULL;
+
+    size_t width = img->width / factor;
+    size_t height = img->height / factor;
+    if (width < 1) width = 1;
+    if (height < 1) height = 1;
+
+    ImageData* proxy = create_image_data(width, height);
+    if (!proxy) return NULL;
+
+    for (size_t y = 0; y < height; y++) {
+        unsigned char* out = image_row(proxy, y);
+        size_t src_y = y * factor;
+        size_t rows = src_y + factor <= img->height ? factor : img->height - src_y;
+
+        for (size_t x = 0; x < width; x++, out += 4) {
+            size_t src_x = x * factor;
+            if (point_sample || factor == 1) {
+                memcpy(out, image_row(img, src_y) + src_x * 4, 4);
+                continue;
+            }
+
+            size_t cols = src_x + factor <= img->width ? factor : img->width - src_x;
+            uint32_t sum[4] = {0};
+            for (size_t dy = 0; dy < rows; dy++) {
+                const unsigned char* p = image_row(img, src_y + dy) + src_x * 4;
+                for (size_t dx = 0; dx < cols; dx++, p += 4) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    sum[3] += p[3];
+                }
+            }
+            uint32_t count = (uint32_t)(rows * cols);
+            for (int c = 0; c < 4; c++) {
+                out[c] = (unsigned char)((sum[c] + count / 2) / count);
+            }
+        }
+    }
+
+    return proxy;
+}
+
+uint64_t image_checksum(const ImageData* img) {
+    if (!img || !img->data) return 0;
+
+    // FNV-1a over whole pixels
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t y = 0; y < img->height; y++) {
+        const unsigned char* p = image_row(img, y);
+        for (size_t x = 0; x < img->width; x++, p += 4) {
+            uint32_t pixel = p[3] ? (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                                    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24 : 0;
+            hash = (hash ^ pixel) * 0x100000001b3ull;
+        }
+    }
+    return hash;
+}
@@ -0,0 +1,524 @@
+#include "../include/io_backend.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define PREFETCH_SYNC_THREADS 4           // Blocking readers for the fallback backend
+#define PREFETCH_MAX_READ (1u << 30)      // Largest single read request
+
+bool string_to_io_backend(const char* str, IoBackend* backend) {
+    if (!str || !backend) return false;
+
+    if (strcasecmp(str, "sync") == 0) *backend = IO_BACKEND_SYNC;
+    else if (strcasecmp(str, "uring") == 0) *backend = IO_BACKEND_URING;
+    else return false;
+
+    return true;
+}
+
+const char* io_backend_to_string(IoBackend backend) {
+    return backend == IO_BACKEND_URING ? "io_uring" : "sync";
+}
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t done;        // Bytes read so far
+    int fd;
+    int error;          // errno if the read failed
+    bool ready;
+} PrefetchSlot;
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+
+// Minimal io_uring driven through the raw syscalls (no liburing)
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+} Uring;
+#endif
+
+struct FilePrefetcher {
+    const char* const* paths;
+    size_t count;
+    size_t depth;
+    PrefetchSlot* slots;
+    IoBackend backend;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;      // A slot became ready
+    pthread_cond_t space_cond;      // A slot was taken, or stop was requested
+    size_t next;                    // Next index to start reading
+    size_t outstanding;             // Started but not yet taken
+    bool stop;
+
+    pthread_t threads[PREFETCH_SYNC_THREADS];
+    int thread_count;
+#ifdef HAVE_IO_URING
+    Uring ring;
+    unsigned in_flight;             // Ring requests awaiting completion
+#endif
+};
+
+// Publishes a finished (or failed) slot to waiting consumers
+static void finish_slot(FilePrefetcher* prefetcher, PrefetchSlot* slot, int error) {
+    if (slot->fd >= 0) {
+        close(slot->fd);
+        slot->fd = -1;
+    }
+    if (error) {
+        free(slot->data);
+        slot->data = NULL;
+        slot->size = 0;
+    }
+
+    pthread_mutex_lock(&prefetcher->lock);
+    slot->error = error;
+    slot->ready = true;
+    pthread_cond_broadcast(&prefetcher->ready_cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+}
+
+// Sizes the buffer for an opened file; false if there is nothing to read
+static bool start_slot(PrefetchSlot* slot, int* error) {
+    struct stat st;
+    if (fstat(slot->fd, &st) != 0) {
+        *error = errno;
+        return false;
+    }
+
+    slot->size = (size_t)st.st_size;
+    slot->data = (unsigned char*)malloc(slot->size ? slot->size : 1);
+    if (!slot->data) {
+        *error = ENOMEM;
+        return false;
+    }
+
+    *error = 0;
+    return slot->size > 0;
+}
+
+// Claims the next index once the window has room; false when done
+static bool claim_next(FilePrefetcher* prefetcher, size_t* index) {
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!prefetcher->stop && prefetcher->next < prefetcher->count &&
+           prefetcher->outstanding >= prefetcher->depth) {
+        pthread_cond_wait(&prefetcher->space_cond, &prefetcher->lock);
+    }
+
+    bool claimed = !prefetcher->stop && prefetcher->next < prefetcher->count;
+    if (claimed) {
+        *index = prefetcher->next++;
+        prefetcher->outstanding++;
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return claimed;
+}
+
+static void* sync_reader(void* arg) {
+    FilePrefetcher* prefetcher = (FilePrefetcher*)arg;
+
+    size_t index;
+    while (claim_next(prefetcher, &index)) {
+        PrefetchSlot* slot = &prefetcher->slots[index];
+        int error = 0;
+
+        slot->fd = open(prefetcher->paths[index], O_RDONLY | O_CLOEXEC);
+        if (slot->fd < 0) {
+            error = errno;
+        } else if (start_slot(slot, &error)) {
+            while (slot->done < slot->size) {
+                ssize_t n = pread(slot->fd, slot->data + slot->done,
+                                  slot->size - slot->done, (off_t)slot->done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                    error = errno;
+                    break;
+                }
+                if (n == 0) {
+                    slot->size = slot->done;   // Truncated while reading
+                    break;
+                }
+                slot->done += (size_t)n;
+            }
+        }
+
+        finish_slot(prefetcher, slot, error);
+    }
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_destroy(Uring* ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Checks that the kernel supports the opcodes the prefetcher relies on
+static bool uring_supports_ops(int fd) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+    if (!probe) return false;
+
+    bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                     probe->last_op >= IORING_OP_READ &&
+                     (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+static bool uring_init(Uring* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+    if (!uring_supports_ops(ring->fd)) {
+        uring_destroy(ring);
+        return false;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return false;
+    }
+
+    ring->cq_ring = single_mmap ? ring->sq_ring :
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+        ring->cq_ring = NULL;
+        uring_destroy(ring);
+        return false;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return false;
+    }
+
+    unsigned char* sq = (unsigned char*)ring->sq_ring;
+    unsigned char* cq = (unsigned char*)ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Queues one request; the caller keeps in-flight requests below sq_entries
+static struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->sq_entries) return NULL;
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+// Submits queued requests and waits for at least one completion
+static int uring_submit_and_wait(Uring* ring) {
+    for (;;) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= (unsigned)ret < ring->to_submit ? (unsigned)ret : ring->to_submit;
+            return 0;
+        }
+        if (errno != EINTR) return -errno;
+    }
+}
+
+// user_data layout: file index in the upper bits, request kind in bit 0
+#define URING_OPEN 0
+#define URING_READ 1
+
+static bool uring_queue_open(FilePrefetcher* prefetcher, size_t index) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&prefetcher->ring);
+    if (!sqe) return false;
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)prefetcher->paths[index];
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = (uint64_t)index << 1 | URING_OPEN;
+    prefetcher->in_flight++;
+    return true;
+}
+
+static bool uring_queue_read(FilePrefetcher* prefetcher, size_t index) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&prefetcher->ring);
+    if (!sqe) return false;
+
+    PrefetchSlot* slot = &prefetcher->slots[index];
+    size_t remaining = slot->size - slot->done;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(slot->data + slot->done);
+    sqe->len = remaining < PREFETCH_MAX_READ ? (unsigned)remaining : PREFETCH_MAX_READ;
+    sqe->off = slot->done;
+    sqe->user_data = (uint64_t)index << 1 | URING_READ;
+    prefetcher->in_flight++;
+    return true;
+}
+
+static void uring_complete(FilePrefetcher* prefetcher, uint64_t user_data, int res) {
+    size_t index = (size_t)(user_data >> 1);
+    PrefetchSlot* slot = &prefetcher->slots[index];
+    int error = 0;
+
+    if ((user_data & 1) == URING_OPEN) {
+        if (res < 0) {
+            finish_slot(prefetcher, slot, -res);
+            return;
+        }
+        slot->fd = res;
+        if (start_slot(slot, &error)) {
+            if (uring_queue_read(prefetcher, index)) return;
+            error = EBUSY;
+        }
+        finish_slot(prefetcher, slot, error);
+        return;
+    }
+
+    if (res == -EINTR || res == -EAGAIN) {
+        if (uring_queue_read(prefetcher, index)) return;
+        error = EBUSY;
+    } else if (res < 0) {
+        error = -res;
+    } else if (res == 0) {
+        slot->size = slot->done;    // Truncated while reading
+    } else {
+        slot->done += (size_t)res;
+        if (slot->done < slot->size) {
+            if (uring_queue_read(prefetcher, index)) return;
+            error = EBUSY;
+        }
+    }
+    finish_slot(prefetcher, slot, error);
+}
+
+// Keeps up to `depth` files in flight through a single ring
+static void* uring_reader(void* arg) {
+    FilePrefetcher* prefetcher = (FilePrefetcher*)arg;
+    Uring* ring = &prefetcher->ring;
+
+    for (;;) {
+        pthread_mutex_lock(&prefetcher->lock);
+        while (!prefetcher->stop && prefetcher->next < prefetcher->count &&
+               prefetcher->outstanding < prefetcher->depth) {
+            size_t index = prefetcher->next;
+            if (!uring_queue_open(prefetcher, index)) break;
+            prefetcher->next++;
+            prefetcher->outstanding++;
+        }
+
+        if (prefetcher->in_flight == 0) {
+            if (prefetcher->stop || prefetcher->next >= prefetcher->count) {
+                pthread_mutex_unlock(&prefetcher->lock);
+                break;
+            }
+            pthread_cond_wait(&prefetcher->space_cond, &prefetcher->lock);
+            pthread_mutex_unlock(&prefetcher->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        int ret = uring_submit_and_wait(ring);
+        if (ret < 0) {
+            fprintf(stderr, "Warning: io_uring_enter failed: %s\n", strerror(-ret));
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            prefetcher->in_flight--;
+            uring_complete(prefetcher, user_data, res);
+        }
+    }
+    return NULL;
+}
+#endif
+
+FilePrefetcher* file_prefetcher_create(IoBackend backend, const char* const* paths,
+                                       size_t count, size_t depth) {
+    FilePrefetcher* prefetcher = (FilePrefetcher*)calloc(1, sizeof(FilePrefetcher));
+    if (!prefetcher) return NULL;
+
+    prefetcher->slots = (PrefetchSlot*)calloc(count ? count : 1, sizeof(PrefetchSlot));
+    if (!prefetcher->slots) {
+        free(prefetcher);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        prefetcher->slots[i].fd = -1;
+    }
+
+    prefetcher->paths = paths;
+    prefetcher->count = count;
+    prefetcher->depth = depth > 0 ? depth : 1;
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->ready_cond, NULL);
+    pthread_cond_init(&prefetcher->space_cond, NULL);
+
+    // io_uring may be missing or blocked (old kernels, seccomp filters)
+    prefetcher->backend = IO_BACKEND_SYNC;
+#ifdef HAVE_IO_URING
+    prefetcher->ring.fd = -1;
+    if (backend == IO_BACKEND_URING) {
+        if (uring_init(&prefetcher->ring, (unsigned)prefetcher->depth)) {
+            if (prefetcher->ring.sq_entries < prefetcher->depth) {
+                prefetcher->depth = prefetcher->ring.sq_entries;
+            }
+            if (pthread_create(&prefetcher->threads[0], NULL, uring_reader, prefetcher) == 0) {
+                prefetcher->thread_count = 1;
+                prefetcher->backend = IO_BACKEND_URING;
+            } else {
+                uring_destroy(&prefetcher->ring);
+            }
+        } else {
+            printf("Warning: io_uring unavailable, using blocking reads\n");
+        }
+    }
+#else
+    if (backend == IO_BACKEND_URING) {
+        printf("Warning: io_uring unavailable, using blocking reads\n");
+    }
+#endif
+
+    if (prefetcher->backend == IO_BACKEND_SYNC) {
+        int threads = (int)(prefetcher->depth < PREFETCH_SYNC_THREADS ?
+                            prefetcher->depth : PREFETCH_SYNC_THREADS);
+        for (int i = 0; i < threads; i++) {
+            if (pthread_create(&prefetcher->threads[i], NULL, sync_reader, prefetcher) != 0) break;
+            prefetcher->thread_count++;
+        }
+        if (prefetcher->thread_count == 0) {
+            file_prefetcher_destroy(prefetcher);
+            return NULL;
+        }
+    }
+
+    return prefetcher;
+}
+
+IoBackend file_prefetcher_backend(const FilePrefetcher* prefetcher) {
+    return prefetcher ? prefetcher->backend : IO_BACKEND_SYNC;
+}
+
+unsigned char* file_prefetcher_take(FilePrefetcher* prefetcher, size_t index, size_t* size) {
+    if (!prefetcher || index >= prefetcher->count) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    PrefetchSlot* slot = &prefetcher->slots[index];
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!slot->ready) {
+        pthread_cond_wait(&prefetcher->ready_cond, &prefetcher->lock);
+    }
+
+    unsigned char* data = slot->data;
+    int error = slot->error;
+    if (size) *size = slot->size;
+    slot->data = NULL;
+    prefetcher->outstanding--;
+    pthread_cond_broadcast(&prefetcher->space_cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    if (!data) errno = error ? error : EIO;
+    return data;
+}
+
+void file_prefetcher_destroy(FilePrefetcher* prefetcher) {
+    if (!prefetcher) return;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->stop = true;
+    pthread_cond_broadcast(&prefetcher->space_cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    for (int i = 0; i < prefetcher->thread_count; i++) {
+        pthread_join(prefetcher->threads[i], NULL);
+    }
+#ifdef HAVE_IO_URING
+    if (prefetcher->ring.fd >= 0) uring_destroy(&prefetcher->ring);
+#endif
+
+    // Files read ahead but never taken
+    for (size_t i = 0; i < prefetcher->count; i++) {
+        free(prefetcher->slots[i].data);
+        if (prefetcher->slots[i].fd >= 0) close(prefetcher->slots[i].fd);
+    }
+
+    pthread_cond_destroy(&prefetcher->space_cond);
+    pthread_cond_destroy(&prefetcher->ready_cond);
+    pthread_mutex_destroy(&prefetcher->lock);
+    free(prefetcher->slots);
+    free(prefetcher);
+}
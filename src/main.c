@@ -1,18 +1,131 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
 #include "converter.h"
 #include "batch_processor.h"
+#include "auto_format.h"
+#include "image_metrics.h"
+#include "output_writer.h"
+#include "conversion_server.h"
+#include "codec_backend.h"
+#include "codec.h"
+
+// Parses a byte count with an optional K, M or G suffix (binary units)
+static bool parse_byte_size(const char* str, size_t* bytes) {
+    char* end = NULL;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) return false;
+
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1024 * 1024;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        value *= 1024ull * 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || value == 0) return false;
+
+    *bytes = (size_t)value;
+    return true;
+}
+
+// "AVIF, WEBP, JPG"
+static void print_format_list(const ImageFormat* formats, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        printf("%s%s", i > 0 ? ", " : "", format_to_string(formats[i]));
+    }
+    printf("\n");
+}
+
+// Lists every codec with what it can do, loading the modules to show where
+// each came from and how long loading it took
+static void print_codecs(void) {
+    static const struct {
+        unsigned capability;
+        const char* name;
+    } capabilities[] = {
+        { CODEC_CAP_DECODE_SCALED, "scaled decode" },
+        { CODEC_CAP_DECODE_CROPPED, "cropped decode" },
+        { CODEC_CAP_STREAMS_DECODE, "streaming decode" },
+        { CODEC_CAP_STREAMS_ENCODE, "streaming encode" },
+        { CODEC_CAP_THREADED_DECODE, "threaded decode" },
+        { CODEC_CAP_THREADED_ENCODE, "threaded encode" },
+        { CODEC_CAP_ANIMATION, "animation" },
+        { CODEC_CAP_TRANSCODE, "lossless transcode" },
+        { CODEC_CAP_REUSES_CONTEXTS, "context reuse" }
+    };
+
+    for (size_t i = 0; i < codec_count(); i++) {
+        const Codec* codec = codec_at(i);
+        CodecModuleInfo info;
+        if (!codec_module_info(codec->format, &info)) {
+            printf("  %-5s built in\n", codec->name);
+        } else if (info.loaded) {
+            printf("  %-5s %s (loaded in %.2f ms)\n", codec->name, info.path, info.load_ms);
+        } else {
+            printf("  %-5s unavailable: %s\n", codec->name, info.error);
+        }
+
+        const char* separator = "        ";
+        for (size_t c = 0; c < sizeof(capabilities) / sizeof(capabilities[0]); c++) {
+            if (codec->capabilities & capabilities[c].capability) {
+                printf("%s%s", separator, capabilities[c].name);
+                separator = ", ";
+            }
+        }
+        if (separator[0] == ',') printf("\n");
+    }
+}
 
 void print_usage(const char* program_name) {
     printf("Usage:\n");
     printf("Single file: %s <input_file> <output_file>\n", program_name);
-    printf("Batch processing: %s -b <input_directory> <target_format>\n", program_name);
+    printf("Batch processing: %s -b <input_directory> <target_format[,format...]>\n", program_name);
+    printf("Several formats: %s --to <format,format...> <input_file> <output_base>\n", program_name);
+    printf("Automatic format: %s --auto [-b] <input> <output_file|input_directory>\n", program_name);
+    printf("Compare images: %s --compare <image_a> <image_b>\n", program_name);
+    printf("Conversion server: %s --serve <socket>\n", program_name);
+    printf("Through a server: %s --client <socket> <input_file> <output_file>\n", program_name);
     printf("\nSupported formats: PNG, JPG, WEBP, AVIF, HEIC\n");
     printf("Options:\n");
     printf("  -b, --batch       Enable batch processing mode\n");
     printf("  -r, --replace     Replace original files (batch mode only)\n");
     printf("  -q, --quality     Set quality (0-100, default: 90)\n");
+    printf("  --target-size <n>     Highest quality whose output fits n bytes (K/M suffixes)\n");
+    printf("  --target-ssim <s>     Lowest quality whose output reaches SSIM s (0-1)\n");
+    printf("  --to <f1,f2,...>      Convert to each listed format from a single decode\n");
+    printf("  --auto                Pick the format per image (lossless for graphics, lossy for photos)\n");
+    printf("  --verify              Batch: decode and check each output before removing its source\n");
+    printf("  --compare             Print PSNR, SSIM and MS-SSIM between two images\n");
+    printf("  -j, --jobs <n>        Parallel workers: batch files, --compare threads (default: all cores)\n");
+    printf("  --mem-limit <n>       Batch: memory for files in flight (K/M/G; default: cgroup limit)\n");
+    printf("  --spill-above <n>     Keep decoded images over n bytes in a temp file (K/M/G or never)\n");
+    printf("  --io <b>              Batch read-ahead backend (uring, sync; default: uring)\n");
+    printf("  --jpeg-progressive    Write progressive JPEGs\n");
+    printf("  --jpeg-optimize       Optimize JPEG Huffman tables\n");
+    printf("  --jpeg-reencode       Fully re-encode JPEG->JPEG instead of transcoding\n");
+    printf("  --png-effort <e>      PNG compression effort (fast, default, max)\n");
+    printf("  --webp-method <0-6>   WebP speed/size trade-off (default: 4)\n");
+    printf("  --webp-preset <p>     WebP content preset (photo, picture, drawing)\n");
+    printf("  --webp-near-lossless <0-100>  WebP near-lossless level (100 = off)\n");
+    printf("  --decode-threads <n>  Max HEIC decoding threads (default: all cores for grid tiles)\n");
+    printf("  --crop <WxH+X+Y>      Load only this region (tiled HEICs decode just its tiles)\n");
+    printf("  --heic-preset <p>     x265 preset (ultrafast..placebo)\n");
+    printf("  --heic-tune <t>       x265 tune (psnr, ssim, grain, fastdecode)\n");
+    printf("  --heic-chroma <c>     HEIC chroma subsampling (420, 422, 444)\n");
+    printf("  --heic-lossless       Encode HEIC losslessly\n");
+    printf("  --strip-metadata      Drop EXIF, ICC and XMP metadata from the output\n");
+    printf("  --keep-orientation    Don't rotate pixels to the EXIF orientation\n");
+    printf("  --sync <s>            Flush outputs to disk (none, file, batch; default: none)\n");
+    printf("  --serve <socket>      Serve conversions on a Unix socket (-j workers) until stopped\n");
+    printf("  --client <socket>     Have the server at socket convert the file (-q is passed on)\n");
+    printf("  --codecs              List the codec modules and how long each took to load\n");
     printf("  -h, --help        Show this help message\n");
 }
 
@@ -23,11 +136,29 @@ int main(int argc, char *argv[]) {
         print_usage(argv[0]);
         return 1;
     }
+    if (strcmp(argv[1], "--codecs") == 0) {
+        print_codecs();
+        return 0;
+    }
 
     // Check if we're in batch mode
     bool batch_mode = false;
     bool replace_originals = false;
-    int quality = 90;
+    bool auto_format = false;
+    bool compare_mode = false;
+    bool verify = false;
+    int jobs = 0;
+    ImageFormat target_formats[MAX_TARGET_FORMATS];
+    size_t target_count = 0;
+    IoBackend io_backend = IO_BACKEND_URING;
+    size_t mem_limit = 0;
+    const char* serve_socket = NULL;
+    const char* client_socket = NULL;
+    int client_quality = -1;
+
+    // Create conversion options
+    ConversionOptions options;
+    init_conversion_options(&options);
     
     // Parse command line options
     int arg_index = 1;
@@ -41,59 +172,284 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[arg_index], "-q") == 0 || 
                    strcmp(argv[arg_index], "--quality") == 0) {
             if (arg_index + 1 < argc) {
-                quality = atoi(argv[arg_index + 1]);
+                int quality = atoi(argv[arg_index + 1]);
                 if (quality < 0) quality = 0;
                 if (quality > 100) quality = 100;
+                options.quality = quality;
+                client_quality = quality;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--target-size") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!parse_byte_size(argv[arg_index + 1], &options.quality_target.max_bytes)) {
+                    printf("Error: Invalid target size: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                options.quality_target.kind = QUALITY_TARGET_SIZE;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--target-ssim") == 0) {
+            if (arg_index + 1 < argc) {
+                double ssim = atof(argv[arg_index + 1]);
+                if (ssim <= 0.0 || ssim > 1.0) {
+                    printf("Error: Target SSIM must be between 0 and 1: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                options.quality_target.kind = QUALITY_TARGET_SSIM;
+                options.quality_target.min_ssim = ssim;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--to") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!string_to_format_list(argv[arg_index + 1], target_formats, &target_count)) {
+                    printf("Error: Invalid target formats: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[arg_index], "--compare") == 0) {
+            compare_mode = true;
+        } else if (strcmp(argv[arg_index], "--auto") == 0) {
+            auto_format = true;
+        } else if (strcmp(argv[arg_index], "-j") == 0 || 
+                   strcmp(argv[arg_index], "--jobs") == 0) {
+            if (arg_index + 1 < argc) {
+                jobs = atoi(argv[arg_index + 1]);
+                if (jobs < 0) jobs = 0;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--mem-limit") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!parse_byte_size(argv[arg_index + 1], &mem_limit)) {
+                    printf("Error: Invalid memory limit: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--spill-above") == 0) {
+            if (arg_index + 1 < argc) {
+                if (strcmp(argv[arg_index + 1], "never") == 0) {
+                    options.spill_threshold = SIZE_MAX;
+                } else if (!parse_byte_size(argv[arg_index + 1], &options.spill_threshold)) {
+                    printf("Error: Invalid spill threshold: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--io") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!string_to_io_backend(argv[arg_index + 1], &io_backend)) {
+                    printf("Error: Unknown I/O backend: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--jpeg-progressive") == 0) {
+            options.jpeg_options.progressive = true;
+        } else if (strcmp(argv[arg_index], "--jpeg-optimize") == 0) {
+            options.jpeg_options.optimization = 1;
+        } else if (strcmp(argv[arg_index], "--jpeg-reencode") == 0) {
+            options.jpeg_options.lossless_transcode = false;
+        } else if (strcmp(argv[arg_index], "--png-effort") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!string_to_png_effort(argv[arg_index + 1], &options.png_options.effort)) {
+                    printf("Error: Unknown PNG effort: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--webp-method") == 0) {
+            if (arg_index + 1 < argc) {
+                int method = atoi(argv[arg_index + 1]);
+                if (method < 0) method = 0;
+                if (method > 6) method = 6;
+                options.webp_options.method = method;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--webp-preset") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!string_to_webp_preset(argv[arg_index + 1], &options.webp_options.preset)) {
+                    printf("Error: Unknown WebP preset: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--webp-near-lossless") == 0) {
+            if (arg_index + 1 < argc) {
+                int level = atoi(argv[arg_index + 1]);
+                if (level < 0) level = 0;
+                if (level > 100) level = 100;
+                options.webp_options.near_lossless = level;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--decode-threads") == 0) {
+            if (arg_index + 1 < argc) {
+                int threads = atoi(argv[arg_index + 1]);
+                options.heic_options.decoder_threads = threads > 0 ? threads : 0;
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--crop") == 0) {
+            if (arg_index + 1 < argc) {
+                char end;
+                if (sscanf(argv[arg_index + 1], "%zux%zu+%zu+%zu%c", &options.crop.width,
+                           &options.crop.height, &options.crop.x, &options.crop.y, &end) != 4 ||
+                    options.crop.width == 0 || options.crop.height == 0) {
+                    printf("Error: Invalid crop region (expected WxH+X+Y): %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--heic-preset") == 0) {
+            if (arg_index + 1 < argc) {
+                options.heic_options.preset = argv[arg_index + 1];
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--heic-tune") == 0) {
+            if (arg_index + 1 < argc) {
+                options.heic_options.tune = argv[arg_index + 1];
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--heic-chroma") == 0) {
+            if (arg_index + 1 < argc) {
+                options.heic_options.chroma = argv[arg_index + 1];
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--heic-lossless") == 0) {
+            options.heic_options.lossless = true;
+        } else if (strcmp(argv[arg_index], "--strip-metadata") == 0) {
+            options.maintain_exif = false;
+        } else if (strcmp(argv[arg_index], "--keep-orientation") == 0) {
+            options.apply_orientation = false;
+        } else if (strcmp(argv[arg_index], "--serve") == 0) {
+            if (arg_index + 1 < argc) {
+                serve_socket = argv[arg_index + 1];
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--client") == 0) {
+            if (arg_index + 1 < argc) {
+                client_socket = argv[arg_index + 1];
+                arg_index++;
+            }
+        } else if (strcmp(argv[arg_index], "--sync") == 0) {
+            if (arg_index + 1 < argc) {
+                if (!string_to_sync_policy(argv[arg_index + 1], &options.sync)) {
+                    printf("Error: Unknown sync policy: %s\n", argv[arg_index + 1]);
+                    return 1;
+                }
                 arg_index++;
             }
         }
         arg_index++;
     }
 
-    // Create conversion options
-    ConversionOptions options = {
-        .quality = quality,
-        .maintain_exif = true,
-        .webp_options = {
-            .lossless = false,
-            .exact = false
-        },
-        .avif_options = {
-            .speed = 6,      // Medium speed
-            .lossless = false
+    if (auto_format && target_count > 0) {
+        printf("Error: --auto picks the format itself and cannot be combined with --to\n");
+        return 1;
+    }
+
+    if (serve_socket) {
+        return run_conversion_server(serve_socket, &options, jobs) ? 0 : 1;
+    }
+
+    if (client_socket) {
+        if (batch_mode || auto_format || target_count > 0) {
+            printf("Error: --client converts a single file to the format of its output name\n");
+            return 1;
+        }
+        if (argc - arg_index < 2) {
+            printf("Error: Client mode requires input and output files\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (options.sync == OUTPUT_SYNC_BATCH) {
+            options.sync = OUTPUT_SYNC_FILE;
+        }
+        if (!convert_with_server(client_socket, argv[arg_index], argv[arg_index + 1],
+                                 &options, client_quality)) {
+            printf("Failed to save file\n");
+            return 1;
+        }
+        printf("Successfully converted file to: %s\n", argv[arg_index + 1]);
+        return 0;
+    }
+
+    if (compare_mode) {
+        if (argc - arg_index < 2) {
+            printf("Error: Compare mode requires two images\n");
+            print_usage(argv[0]);
+            return 1;
         }
-    };
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ImageQuality quality;
+        if (!compare_image_files(argv[arg_index], argv[arg_index + 1], jobs, &quality)) {
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (isinf(quality.psnr)) {
+            printf("PSNR: inf (identical)\n");
+        } else {
+            printf("PSNR: %.2f dB\n", quality.psnr);
+        }
+        printf("SSIM: %.5f\n", quality.ssim);
+        printf("MS-SSIM: %.5f\n", quality.ms_ssim);
+        printf("Time: %.3fs (including decoding)\n",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        return 0;
+    }
 
     if (batch_mode) {
         // Check remaining arguments for batch mode
-        if (argc - arg_index < 2) {
+        bool formats_given = auto_format || target_count > 0;
+        if (argc - arg_index < (formats_given ? 1 : 2)) {
             printf("Error: Batch mode requires input directory and target format\n");
             print_usage(argv[0]);
             return 1;
         }
 
         const char* input_dir = argv[arg_index];
-        const char* target_format_str = argv[arg_index + 1];
-        
-        // Convert target format string to enum
-        ImageFormat target_format = string_to_format(target_format_str);
-        if (target_format == FORMAT_UNKNOWN) {
-            printf("Error: Unsupported target format: %s\n", target_format_str);
+
+        // Convert target format string to enums
+        if (!formats_given) {
+            const char* target_format_str = argv[arg_index + 1];
+            if (!string_to_format_list(target_format_str, target_formats, &target_count)) {
+                printf("Error: Unsupported target format: %s\n", target_format_str);
+                return 1;
+            }
+        }
+        if (replace_originals && target_count > 1) {
+            printf("Error: --replace needs a single target format\n");
             return 1;
         }
 
         // Set up batch processing options
         BatchProcessingOptions batch_options = {
             .input_dir = (char*)input_dir,
-            .target_format = target_format,
+            .target_count = target_count,
+            .auto_format = auto_format,
             .options = options,
             .replace_originals = replace_originals,
-            .extension_filter = NULL  // Process all supported images
+            .verify = verify,
+            .extension_filter = NULL,  // Process all supported images
+            .threads = jobs,
+            .io_backend = io_backend,
+            .mem_limit = mem_limit
         };
 
+        memcpy(batch_options.target_formats, target_formats, target_count * sizeof(ImageFormat));
+
         // Process directory
         printf("Starting batch processing in directory: %s\n", input_dir);
-        printf("Target format: %s\n", format_to_string(target_format));
+        if (auto_format) {
+            printf("Target format: auto\n");
+        } else {
+            printf("Target format%s: ", target_count > 1 ? "s" : "");
+            print_format_list(target_formats, target_count);
+        }
         printf("Replace originals: %s\n", replace_originals ? "Yes" : "No");
         
         int result = process_directory(&batch_options);
@@ -116,51 +472,88 @@ int main(int argc, char *argv[]) {
         ImageFormat input_format = detect_format(input_file);
         printf("Detected input format: %s\n", format_to_string(input_format));
 
-        ImageData* img = NULL;
-        switch (input_format) {
-            case FORMAT_PNG:
-                img = load_png(input_file);
-                break;
-            case FORMAT_WEBP:
-                img = load_webp(input_file);
-                break;
-            case FORMAT_JPG:
-                img = load_jpeg(input_file);
-                break;
-            case FORMAT_AVIF:
-                img = load_avif(input_file);
-                break;
-            case FORMAT_HEIC:
-                img = load_heic(input_file);
-                break;
-            default:
-                printf("Unsupported input format\n");
+        // A single file has nothing to batch, so a batch flush is a per-file one
+        if (options.sync == OUTPUT_SYNC_BATCH) {
+            options.sync = OUTPUT_SYNC_FILE;
+        }
+
+        // One decode, written out in every requested format
+        if (target_count > 0) {
+            printf("Target formats: ");
+            print_format_list(target_formats, target_count);
+            if (!convert_image_to_formats(input_file, output_file, target_formats, target_count,
+                                          &options, jobs)) {
+                printf("Failed to save file\n");
+                return 1;
+            }
+            for (size_t i = 0; i < target_count; i++) {
+                char* path = format_output_path(output_file, target_formats[i]);
+                printf("Successfully converted file to: %s\n", path ? path : output_file);
+                free(path);
+            }
+            return 0;
+        }
+
+        // JPEG to JPEG only needs new entropy coding
+        if (!auto_format &&
+            is_jpeg_transcode(input_format, detect_format(output_file), &options)) {
+            OutputFile output;
+            const Codec* codec = codec_for_format(input_format);
+            if (!output_file_open(&output, output_file, options.sync) ||
+                !output_file_finish(&output, codec->transcode(input_file, output.path, &options))) {
+                printf("Failed to save file\n");
                 return 1;
+            }
+            printf("Successfully converted file to: %s\n", output_file);
+            return 0;
         }
 
+        ImageData* img = load_image(input_file, &options);
+
         if (img) {
             ImageFormat output_format = detect_format(output_file);
+            bool animated = is_animated_image(input_file, input_format);
             bool save_success = false;
-            
-            switch (output_format) {
-                case FORMAT_PNG:
-                    save_success = save_png(output_file, img, &options);
-                    break;
-                case FORMAT_WEBP:
-                    save_success = save_webp(output_file, img, &options);
-                    break;
-                case FORMAT_JPG:
-                    save_success = save_jpeg(output_file, img, &options);
-                    break;
-                case FORMAT_AVIF:
-                    save_success = save_avif(output_file, img, &options);
-                    break;
-                case FORMAT_HEIC:
-                    save_success = save_heic(output_file, img, &options);
-                    break;
-                default:
-                    printf("Unsupported output format\n");
-                    break;
+
+            // The content decides the format; the output gets its extension
+            char* auto_output = NULL;
+            if (auto_format) {
+                AutoFormatChoice choice;
+                if (choose_auto_format(img, animated, &options, &choice)) {
+                    output_format = choice.format;
+                    options = choice.options;
+                    auto_output = format_output_path(output_file, output_format);
+                    printf("Auto format: %s (%s, proxy encoded to %zu bytes)\n",
+                           format_to_string(output_format),
+                           choice.content.graphic ? "graphic" : "photo",
+                           choice.proxy_size);
+                }
+                if (!auto_output) {
+                    printf("Error: Could not choose an output format%s\n",
+                           animated ? " that holds animations" : "");
+                    free_image_data(img);
+                    free(img);
+                    return 1;
+                }
+                output_file = auto_output;
+            }
+
+            if (animated && !format_supports_animation(output_format)) {
+                printf("Warning: %s holds no animations, keeping only the first frame\n",
+                       format_to_string(output_format));
+            }
+
+            // The output only replaces output_file once it is complete
+            OutputFile output;
+            if (output_file_open(&output, output_file, options.sync)) {
+                // Animations keep every frame when the output format can hold them
+                if (animated && format_supports_animation(output_format)) {
+                    save_success = convert_animation(input_file, input_format, output.path,
+                                                     output_format, &options);
+                } else {
+                    save_success = save_image(output.path, output_format, img, &options);
+                }
+                save_success = output_file_finish(&output, save_success);
             }
 
             if (save_success) {
@@ -172,6 +565,7 @@ int main(int argc, char *argv[]) {
             // Cleanup
             free_image_data(img);
             free(img);
+            free(auto_output);
         } else {
             printf("Failed to load input file\n");
             return 1;
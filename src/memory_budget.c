@@ -0,0 +1,247 @@
+#include "../include/memory_budget.h"
+#include "../include/codec.h"
+#include "../include/image_ops.h"
+#include "../include/parallel.h"
+#include "../include/quality_search.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MEMORY_MAX_OVERTAKES 16     // Admissions ahead of a waiting task before it blocks the rest
+#define MEMORY_CGROUP_ROOT "/sys/fs/cgroup"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// Codec working memory on top of the decoded RGBA image, in multiples of
+// its size; rough upper bounds for large photos
+static const double decode_factor[] = {
+    [FORMAT_PNG] = 0.1,     // Row buffers
+    [FORMAT_JPG] = 0.5,     // Component buffers
+    [FORMAT_WEBP] = 1.0,    // YUV planes
+    [FORMAT_AVIF] = 2.0,    // YUV frame, plus high bit depth copies
+    [FORMAT_HEIC] = 2.5     // Grid tiles and the YUV frame before conversion
+};
+static const double encode_factor[] = {
+    [FORMAT_PNG] = 1.5,     // Filtered rows and compressed chunks per thread
+    [FORMAT_JPG] = 0.5,
+    [FORMAT_WEBP] = 2.0,    // ARGB/YUV pictures and the token buffers
+    [FORMAT_AVIF] = 4.0,    // YUV image and the AV1 encoder's lookahead
+    [FORMAT_HEIC] = 4.0     // Likewise for x265
+};
+#define MEMORY_TRANSCODE_FACTOR 0.75  // JPEG coefficients, 16 bits per sample at 4:2:0
+#define MEMORY_STREAMING_BYTES (256.0 * 1024 * 1024)  // Row-streaming codec on a spilled image
+
+struct MemoryWaiter {
+    size_t bytes;
+    bool admitted;
+    MemoryWaiter* next;
+};
+
+// Parses a cgroup limit file; false for "max" or anything unreadable
+static bool read_limit_file(const char* path, size_t* limit) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return false;
+
+    unsigned long long value = 0;
+    bool found = fscanf(fp, "%llu", &value) == 1;
+    fclose(fp);
+
+    // cgroup v1 reports "no limit" as a huge page-rounded number
+    if (!found || value == 0 || value >= (unsigned long long)SIZE_MAX / 2) return false;
+    *limit = (size_t)value;
+    return true;
+}
+
+// Our group in the hierarchy /proc/self/cgroup lists as prefix ("0::" for
+// cgroup v2, or the v1 hierarchy's controllers)
+static bool read_cgroup_path(const char* prefix, char* group, size_t size) {
+    FILE* fp = fopen("/proc/self/cgroup", "r");
+    if (!fp) return false;
+
+    char line[PATH_MAX];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        // v1 lines look like "4:memory:/path"
+        char* entry = strncmp(line, "0::", 3) == 0 ? line : strchr(line, ':');
+        if (!entry) continue;
+        if (entry == line) {
+            found = strcmp(prefix, "0::") == 0;
+            entry += 3;
+        } else {
+            size_t length = strlen(prefix);
+            found = strncmp(entry + 1, prefix, length) == 0 && entry[1 + length] == ':';
+            entry += length + 2;
+        }
+        if (found) {
+            snprintf(group, size, "%s", entry);
+            group[strcspn(group, "\n")] = '\0';
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// Lowest limit in file from our group up to the hierarchy's root, as
+// limits on any ancestor apply too
+static bool read_cgroup_limit(const char* prefix, const char* root, const char* file,
+                              size_t* limit) {
+    char group[PATH_MAX];
+    if (!read_cgroup_path(prefix, group, sizeof(group))) return false;
+
+    bool found = false;
+    char path[PATH_MAX * 2];
+    while (true) {
+        size_t value;
+        snprintf(path, sizeof(path), "%s%s/%s", root, strcmp(group, "/") == 0 ? "" : group, file);
+        if (read_limit_file(path, &value) && (!found || value < *limit)) {
+            *limit = value;
+            found = true;
+        }
+
+        char* slash = strrchr(group, '/');
+        if (!slash || strcmp(group, "/") == 0) break;
+        if (slash == group) {
+            strcpy(group, "/");
+        } else {
+            *slash = '\0';
+        }
+    }
+    return found;
+}
+
+size_t memory_limit_default(void) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t physical = pages > 0 && page_size > 0 ? (size_t)pages * (size_t)page_size : SIZE_MAX;
+
+    size_t limit;
+    if (read_cgroup_limit("0::", MEMORY_CGROUP_ROOT, "memory.max", &limit) ||
+        read_cgroup_limit("memory", MEMORY_CGROUP_ROOT "/memory", "memory.limit_in_bytes", &limit)) {
+        return limit < physical ? limit : physical;
+    }
+    return physical;
+}
+
+void memory_budget_init(MemoryBudget* budget, size_t limit) {
+    memset(budget, 0, sizeof(*budget));
+    budget->limit = limit;
+    pthread_mutex_init(&budget->lock, NULL);
+    pthread_cond_init(&budget->changed, NULL);
+}
+
+void memory_budget_destroy(MemoryBudget* budget) {
+    pthread_mutex_destroy(&budget->lock);
+    pthread_cond_destroy(&budget->changed);
+}
+
+// Admits every waiter that may go now; called with the lock held
+static void admit_waiters(MemoryBudget* budget) {
+    MemoryWaiter** link = &budget->waiters;
+    bool oldest = true;
+
+    while (*link) {
+        MemoryWaiter* waiter = *link;
+        bool fits = budget->used == 0 || waiter->bytes <= budget->limit - budget->used;
+
+        if (fits && (oldest || budget->overtakes < MEMORY_MAX_OVERTAKES)) {
+            budget->used += waiter->bytes;
+            if (budget->used > budget->peak) budget->peak = budget->used;
+            if (oldest) {
+                budget->overtakes = 0;
+            } else {
+                budget->overtakes++;
+            }
+            waiter->admitted = true;
+            *link = waiter->next;
+        } else {
+            oldest = false;
+            link = &waiter->next;
+        }
+    }
+}
+
+void memory_budget_acquire(MemoryBudget* budget, size_t bytes) {
+    MemoryWaiter waiter = { .bytes = bytes };
+
+    pthread_mutex_lock(&budget->lock);
+    MemoryWaiter** tail = &budget->waiters;
+    while (*tail) tail = &(*tail)->next;
+    *tail = &waiter;
+
+    admit_waiters(budget);
+    while (!waiter.admitted) {
+        pthread_cond_wait(&budget->changed, &budget->lock);
+    }
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void memory_budget_release(MemoryBudget* budget, size_t bytes) {
+    pthread_mutex_lock(&budget->lock);
+    budget->used -= bytes < budget->used ? bytes : budget->used;
+    admit_waiters(budget);
+    pthread_cond_broadcast(&budget->changed);
+    pthread_mutex_unlock(&budget->lock);
+}
+
+static double encoder_memory(ImageFormat format, double image_bytes, bool spilled,
+                             const ConversionOptions* options) {
+    bool streaming = spilled && codec_has(format, CODEC_CAP_STREAMS_ENCODE);
+    double bytes = streaming ? MEMORY_STREAMING_BYTES : encode_factor[format] * image_bytes;
+
+    // Every parallel trial of a quality search holds an encoder of its own
+    if (options && options->quality_target.kind != QUALITY_TARGET_NONE &&
+        quality_search_supported(format, options)) {
+        int trials = options->quality_target.threads > 0 ? options->quality_target.threads
+                                                         : parallel_cpu_count();
+        if (trials > QUALITY_SEARCH_MAX_PARALLEL) trials = QUALITY_SEARCH_MAX_PARALLEL;
+        bytes *= trials;
+    }
+    return bytes;
+}
+
+size_t estimate_conversion_memory(size_t width, size_t height, size_t file_size,
+                                  ImageFormat input_format, const ImageFormat* targets,
+                                  size_t target_count, bool parallel_targets,
+                                  const ConversionOptions* options) {
+    double image_bytes = (double)width * (double)height * 4.0;
+    // Spilled pixels are file pages the kernel can write back, not resident memory
+    bool spilled = image_should_spill(width, height, options);
+    bool decode = targets == NULL || target_count == 0;
+    double encoders = 0.0;
+
+    if (decode) {
+        // Any format may be picked
+        for (size_t i = 0; i < codec_count(); i++) {
+            double bytes = encoder_memory(codec_at(i)->format, image_bytes, spilled, options);
+            if (bytes > encoders) encoders = bytes;
+        }
+    }
+    for (size_t i = 0; i < target_count && targets; i++) {
+        double bytes;
+        if (is_jpeg_transcode(input_format, targets[i], options)) {
+            bytes = MEMORY_TRANSCODE_FACTOR * image_bytes;
+        } else {
+            bytes = encoder_memory(targets[i], image_bytes, spilled, options);
+            decode = true;
+        }
+        if (parallel_targets) {
+            encoders += bytes;
+        } else if (bytes > encoders) {
+            encoders = bytes;
+        }
+    }
+
+    // The decoder's working set is gone by the time the encoders start
+    double total = (double)file_size + encoders;
+    if (decode && input_format > FORMAT_UNKNOWN && input_format <= FORMAT_AVIF) {
+        bool streaming = spilled && codec_has(input_format, CODEC_CAP_STREAMS_DECODE);
+        double decoder = streaming ? MEMORY_STREAMING_BYTES : decode_factor[input_format] * image_bytes;
+        total = (double)file_size + (spilled ? 0.0 : image_bytes) +
+                (decoder > encoders ? decoder : encoders);
+    }
+    return total < (double)SIZE_MAX ? (size_t)total : SIZE_MAX;
+}
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "../include/output_writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Attempts at finding an unused temp name before giving up
+#define OUTPUT_TEMP_ATTEMPTS 16
+
+// Fills out->temp_name with a fresh hidden name next to the final one
+static void make_temp_name(OutputFile* out) {
+    static atomic_uint counter;
+    unsigned int salt = (unsigned int)getpid() * 2654435761u ^
+                        (unsigned int)time(NULL) ^ atomic_fetch_add(&counter, 1) * 40503u;
+    snprintf(out->temp_name, sizeof(out->temp_name), ".%.200s.%08x", out->name, salt);
+}
+
+// Fallback for filesystems without O_TMPFILE: a named, hidden temp file
+static bool open_named_temp(OutputFile* out, const char* dir) {
+    for (int attempt = 0; attempt < OUTPUT_TEMP_ATTEMPTS; attempt++) {
+        make_temp_name(out);
+        out->fd = openat(out->dir_fd, out->temp_name,
+                         O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (out->fd >= 0) {
+            int length = snprintf(out->path, sizeof(out->path), "%s/%s", dir, out->temp_name);
+            if (length > 0 && (size_t)length < sizeof(out->path)) return true;
+
+            unlinkat(out->dir_fd, out->temp_name, 0);
+            close(out->fd);
+            out->fd = -1;
+            errno = ENAMETOOLONG;
+            break;
+        }
+        if (errno != EEXIST) break;
+    }
+    out->temp_name[0] = '\0';
+    return false;
+}
+
+bool output_file_open(OutputFile* out, const char* final_path, OutputSyncPolicy sync) {
+    if (!out || !final_path) return false;
+
+    memset(out, 0, sizeof(*out));
+    out->fd = -1;
+    out->sync = sync;
+
+    // Split into directory and entry name
+    char dir[PATH_MAX];
+    const char* slash = strrchr(final_path, '/');
+    const char* name = slash ? slash + 1 : final_path;
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else if (slash == final_path) {
+        snprintf(dir, sizeof(dir), "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - final_path), final_path);
+    }
+    if (!*name || strlen(name) > NAME_MAX) {
+        printf("Error: Invalid output filename %s\n", final_path);
+        return false;
+    }
+    snprintf(out->name, sizeof(out->name), "%s", name);
+
+    out->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (out->dir_fd < 0) {
+        printf("Error: Could not open output directory %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+
+    struct stat existing;
+    bool replacing = fstatat(out->dir_fd, out->name, &existing, 0) == 0;
+
+    // An unnamed file never shows up half-written, even after a crash; the
+    // encoders reach it through /proc
+#ifdef O_TMPFILE
+    out->fd = openat(out->dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+    if (out->fd >= 0) {
+        snprintf(out->path, sizeof(out->path), "/proc/self/fd/%d", out->fd);
+        if (access(out->path, W_OK) == 0) {
+            out->anonymous = true;
+        } else {
+            close(out->fd);
+            out->fd = -1;
+        }
+    }
+#endif
+
+    if (out->fd < 0 && !open_named_temp(out, dir)) {
+        printf("Error: Could not create output file in %s: %s\n", dir, strerror(errno));
+        close(out->dir_fd);
+        return false;
+    }
+
+    // A replaced file keeps its permissions
+    if (replacing) {
+        fchmod(out->fd, existing.st_mode & 07777);
+    }
+    return true;
+}
+
+// Gives an anonymous file a temp name so it can be renamed over a target
+static bool link_temp_name(OutputFile* out) {
+    for (int attempt = 0; attempt < OUTPUT_TEMP_ATTEMPTS; attempt++) {
+        make_temp_name(out);
+        if (linkat(AT_FDCWD, out->path, out->dir_fd, out->temp_name, AT_SYMLINK_FOLLOW) == 0) {
+            return true;
+        }
+        if (errno != EEXIST) break;
+    }
+    out->temp_name[0] = '\0';
+    return false;
+}
+
+static void close_output(OutputFile* out) {
+    close(out->fd);
+    close(out->dir_fd);
+    out->fd = -1;
+    out->dir_fd = -1;
+}
+
+bool output_file_commit(OutputFile* out) {
+    if (!out || out->fd < 0) return false;
+
+    // Data must be on disk before the name points at it
+    bool success = out->sync != OUTPUT_SYNC_FILE || fdatasync(out->fd) == 0;
+
+    if (success && out->anonymous) {
+        // linkat cannot replace an existing entry; rename can, atomically
+        if (linkat(AT_FDCWD, out->path, out->dir_fd, out->name, AT_SYMLINK_FOLLOW) != 0) {
+            success = errno == EEXIST && link_temp_name(out) &&
+                      renameat(out->dir_fd, out->temp_name, out->dir_fd, out->name) == 0;
+        }
+    } else if (success) {
+        success = renameat(out->dir_fd, out->temp_name, out->dir_fd, out->name) == 0;
+    }
+
+    // Persist the new directory entry as well
+    if (success && out->sync == OUTPUT_SYNC_FILE) {
+        success = fsync(out->dir_fd) == 0;
+    }
+
+    if (!success) {
+        printf("Error: Could not write %s: %s\n", out->name, strerror(errno));
+        if (out->temp_name[0]) unlinkat(out->dir_fd, out->temp_name, 0);
+    }
+
+    close_output(out);
+    return success;
+}
+
+void output_file_discard(OutputFile* out) {
+    if (!out || out->fd < 0) return;
+
+    if (!out->anonymous && out->temp_name[0]) {
+        unlinkat(out->dir_fd, out->temp_name, 0);
+    }
+    close_output(out);
+}
+
+bool output_file_finish(OutputFile* out, bool written) {
+    if (!written) {
+        output_file_discard(out);
+        return false;
+    }
+    return output_file_commit(out);
+}
+
+bool output_sync_filesystem(const char* dir) {
+    int fd = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    bool success = syncfs(fd) == 0;
+    close(fd);
+    return success;
+}
+
+bool memory_output_open(MemoryOutput* out) {
+    if (!out) return false;
+
+    out->fd = -1;
+#ifdef MFD_CLOEXEC
+    out->fd = memfd_create("media-processor-trial", MFD_CLOEXEC);
+#endif
+    if (out->fd < 0) return false;
+
+    snprintf(out->path, sizeof(out->path), "/proc/self/fd/%d", out->fd);
+    return true;
+}
+
+size_t memory_output_size(const MemoryOutput* out) {
+    struct stat st;
+    if (!out || out->fd < 0 || fstat(out->fd, &st) != 0) return 0;
+    return (size_t)st.st_size;
+}
+
+unsigned char* memory_output_read(const MemoryOutput* out, size_t* size) {
+    size_t total = memory_output_size(out);
+    unsigned char* data = total > 0 ? (unsigned char*)malloc(total) : NULL;
+    if (!data) return NULL;
+
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = pread(out->fd, data + done, total - done, (off_t)done);
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+
+    *size = total;
+    return data;
+}
+
+void memory_output_close(MemoryOutput* out) {
+    if (out && out->fd >= 0) {
+        close(out->fd);
+        out->fd = -1;
+    }
+}
+
+bool write_file_data(const char* filepath, const unsigned char* data, size_t size) {
+    FILE* fp = fopen(filepath, "wb");
+    if (!fp) {
+        printf("Error: Could not open %s for writing\n", filepath);
+        return false;
+    }
+
+    output_preallocate(fp, size);
+    bool success = fwrite(data, 1, size, fp) == size;
+    success = fclose(fp) == 0 && success;
+    if (!success) {
+        printf("Error: Could not write %s\n", filepath);
+    }
+    return success;
+}
+
+void output_preallocate(FILE* fp, size_t size) {
+    // Lets the filesystem pick one extent up front; unsupported is fine
+    if (fp && size > 0) {
+        fallocate(fileno(fp), 0, 0, (off_t)size);
+    }
+}
@@ -0,0 +1,57 @@
+#include "../include/parallel.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    ParallelTask task;
+    void* ctx;
+    size_t count;
+    atomic_size_t next;
+} ParallelJob;
+
+int parallel_cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+static void* parallel_worker(void* arg) {
+    ParallelJob* job = (ParallelJob*)arg;
+    size_t index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->count) {
+        job->task(job->ctx, index);
+    }
+    return NULL;
+}
+
+void parallel_for(size_t count, int threads, ParallelTask task, void* ctx) {
+    if (count == 0 || !task) return;
+
+    if (threads <= 0) threads = parallel_cpu_count();
+    if ((size_t)threads > count) threads = (int)count;
+
+    ParallelJob job = { .task = task, .ctx = ctx, .count = count };
+    atomic_init(&job.next, 0);
+
+    // If threads cannot be created the calling thread simply does all the work
+    pthread_t* workers = NULL;
+    int started = 0;
+    if (threads > 1) {
+        workers = (pthread_t*)malloc(sizeof(pthread_t) * (threads - 1));
+    }
+    if (workers) {
+        for (int i = 0; i < threads - 1; i++) {
+            if (pthread_create(&workers[started], NULL, parallel_worker, &job) == 0) {
+                started++;
+            }
+        }
+    }
+
+    parallel_worker(&job);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
@@ -0,0 +1,366 @@
+#include "../include/png_writer.h"
+#include "../include/parallel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define PNG_WRITER_WINDOW_SIZE 32768          // deflate window (windowBits = 15)
+#define PNG_WRITER_MIN_BAND_BYTES (256 * 1024) // smallest band worth a thread
+#define PNG_WRITER_MAX_BAND_BYTES (8 << 20)    // larger images get more bands, not larger ones
+#define PNG_WRITER_BANDS_PER_THREAD 4          // bands compressed (and held) at a time per thread
+
+typedef struct {
+    unsigned char* out;   // 2 spare bytes in front for the zlib header
+    size_t out_size;      // deflate bytes written after the spare bytes
+    uLong adler;          // Adler-32 of the band's filtered bytes
+    size_t in_size;
+    bool ok;
+} PngBand;
+
+typedef struct {
+    const unsigned char* rows;
+    size_t stride;
+    size_t row_bytes;
+    size_t bpp;
+    size_t height;
+    const PngWriterParams* params;
+    const unsigned char* zero_row;
+    size_t band_rows;
+    size_t band_count;
+    size_t first_band;    // of the window being compressed
+    PngBand* bands;
+} PngWriterJob;
+
+// Sum of |x| over the bytes interpreted as signed, the usual PNG heuristic
+static size_t filter_cost(const unsigned char* data, size_t n) {
+    size_t sum = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i magnitude = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(magnitude, zero));
+    }
+    unsigned long long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = (size_t)(lanes[0] + lanes[1]);
+#endif
+    for (; i < n; i++) {
+        unsigned v = data[i];
+        sum += v < 128 ? v : 256 - v;
+    }
+    return sum;
+}
+
+static inline unsigned char paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (unsigned char)a;
+    if (pb <= pc) return (unsigned char)b;
+    return (unsigned char)c;
+}
+
+// Each filter only reads the raw rows, so the loops have no carried
+// dependency and are left for the compiler to vectorize
+static void apply_filter(int type, const unsigned char* row, const unsigned char* prev,
+                         size_t n, size_t bpp, unsigned char* out) {
+    size_t i;
+    switch (type) {
+        case PNG_FILTER_VALUE_SUB:
+            for (i = 0; i < bpp; i++) out[i] = row[i];
+            for (i = bpp; i < n; i++) out[i] = row[i] - row[i - bpp];
+            break;
+        case PNG_FILTER_VALUE_UP:
+            for (i = 0; i < n; i++) out[i] = row[i] - prev[i];
+            break;
+        case PNG_FILTER_VALUE_AVG:
+            for (i = 0; i < bpp; i++) out[i] = row[i] - (prev[i] >> 1);
+            for (i = bpp; i < n; i++) out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+            break;
+        case PNG_FILTER_VALUE_PAETH:
+            for (i = 0; i < bpp; i++) out[i] = row[i] - prev[i];
+            for (i = bpp; i < n; i++) {
+                out[i] = row[i] - paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+            }
+            break;
+        default:
+            memcpy(out, row, n);
+            break;
+    }
+}
+
+// Writes the filter byte and filtered row y to line; scratch holds row_bytes
+static void filter_line(const PngWriterJob* job, size_t y, unsigned char* line,
+                        unsigned char* scratch) {
+    static const int filter_bits[PNG_FILTER_VALUE_LAST] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH
+    };
+    const unsigned char* row = job->rows + y * job->stride;
+    const unsigned char* prev = y > 0 ? row - job->stride : job->zero_row;
+    unsigned char* best = line + 1;
+    size_t best_cost = (size_t)-1;
+    int best_type = PNG_FILTER_VALUE_NONE;
+
+    int filters = job->params->filters & PNG_ALL_FILTERS;
+    if (!filters) filters = PNG_FILTER_NONE;
+
+    for (int type = 0; type < PNG_FILTER_VALUE_LAST; type++) {
+        if (!(filters & filter_bits[type])) continue;
+
+        // Only one candidate: no need to score it
+        if (filters == filter_bits[type]) {
+            apply_filter(type, row, prev, job->row_bytes, job->bpp, best);
+            best_type = type;
+            break;
+        }
+
+        unsigned char* candidate = best_cost == (size_t)-1 ? best : scratch;
+        apply_filter(type, row, prev, job->row_bytes, job->bpp, candidate);
+        size_t cost = filter_cost(candidate, job->row_bytes);
+        if (cost < best_cost) {
+            if (candidate != best) memcpy(best, candidate, job->row_bytes);
+            best_cost = cost;
+            best_type = type;
+        }
+    }
+
+    line[0] = (unsigned char)best_type;
+}
+
+static void compress_band(void* ctx, size_t window_index) {
+    PngWriterJob* job = (PngWriterJob*)ctx;
+    size_t index = job->first_band + window_index;
+    PngBand* band = &job->bands[index];
+    size_t line_size = job->row_bytes + 1;
+    size_t first = index * job->band_rows;
+    size_t last = first + job->band_rows < job->height ? first + job->band_rows : job->height;
+    bool final_band = index == job->band_count - 1;
+
+    // Re-filter the tail of the previous band so its bytes can prime the
+    // deflate window without waiting for the thread that owns that band
+    size_t dict_rows = (PNG_WRITER_WINDOW_SIZE + line_size - 1) / line_size;
+    if (dict_rows > first) dict_rows = first;
+
+    size_t filtered_size = (last - first + dict_rows) * line_size;
+    unsigned char* filtered = (unsigned char*)malloc(filtered_size);
+    unsigned char* scratch = (unsigned char*)malloc(job->row_bytes);
+    if (!filtered || !scratch) {
+        free(filtered);
+        free(scratch);
+        return;
+    }
+
+    for (size_t y = first - dict_rows; y < last; y++) {
+        filter_line(job, y, filtered + (y - first + dict_rows) * line_size, scratch);
+    }
+    free(scratch);
+
+    const unsigned char* input = filtered + dict_rows * line_size;
+    band->in_size = (last - first) * line_size;
+    band->adler = adler32(adler32(0L, Z_NULL, 0), input, band->in_size);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, job->params->level, Z_DEFLATED, -15, 8,
+                     job->params->strategy) != Z_OK) {
+        free(filtered);
+        return;
+    }
+
+    if (dict_rows > 0) {
+        size_t dict_size = dict_rows * line_size;
+        if (dict_size > PNG_WRITER_WINDOW_SIZE) dict_size = PNG_WRITER_WINDOW_SIZE;
+        deflateSetDictionary(&strm, input - dict_size, (uInt)dict_size);
+    }
+
+    // Room for the zlib header in front and the Adler-32 trailer behind
+    size_t bound = deflateBound(&strm, band->in_size) + 16;
+    band->out = (unsigned char*)malloc(2 + bound + 4);
+    if (band->out) {
+        strm.next_in = (Bytef*)input;
+        strm.avail_in = (uInt)band->in_size;
+        strm.next_out = band->out + 2;
+        strm.avail_out = (uInt)bound;
+
+        // Non-final bands end on a byte boundary without BFINAL so the raw
+        // deflate streams can be concatenated as-is
+        int ret = deflate(&strm, final_band ? Z_FINISH : Z_SYNC_FLUSH);
+        band->ok = final_band ? ret == Z_STREAM_END : (ret == Z_OK && strm.avail_in == 0);
+        band->out_size = bound - strm.avail_out;
+    }
+
+    deflateEnd(&strm);
+    free(filtered);
+}
+
+int png_writer_choose_strategy(const unsigned char* rows, size_t stride, size_t row_bytes,
+                               size_t bpp, size_t height, const PngWriterParams* params) {
+    static const int candidates[] = { Z_FILTERED, Z_DEFAULT_STRATEGY, Z_RLE };
+    int best_strategy = params->strategy;
+    if (!rows || height == 0 || row_bytes == 0) return best_strategy;
+
+    // Sample from the middle; the first rows are often borders or headers
+    size_t line_size = row_bytes + 1;
+    size_t sample_rows = PNG_WRITER_MIN_BAND_BYTES / line_size;
+    if (sample_rows == 0) sample_rows = 1;
+    if (sample_rows > height) sample_rows = height;
+    size_t first = (height - sample_rows) / 2;
+
+    PngWriterJob job = {
+        .rows = rows,
+        .stride = stride,
+        .row_bytes = row_bytes,
+        .bpp = bpp,
+        .height = height,
+        .params = params
+    };
+    unsigned char* zero_row = (unsigned char*)calloc(1, row_bytes);
+    unsigned char* scratch = (unsigned char*)malloc(row_bytes);
+    unsigned char* filtered = (unsigned char*)malloc(sample_rows * line_size);
+    unsigned char* out = NULL;
+    size_t out_capacity = compressBound(sample_rows * line_size) + 64;
+    out = (unsigned char*)malloc(out_capacity);
+    if (!zero_row || !scratch || !filtered || !out) {
+        free(zero_row);
+        free(scratch);
+        free(filtered);
+        free(out);
+        return best_strategy;
+    }
+    job.zero_row = zero_row;
+
+    for (size_t y = 0; y < sample_rows; y++) {
+        filter_line(&job, first + y, filtered + y * line_size, scratch);
+    }
+
+    size_t best_size = (size_t)-1;
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, params->level, Z_DEFLATED, -15, 8, candidates[i]) != Z_OK) {
+            continue;
+        }
+        strm.next_in = filtered;
+        strm.avail_in = (uInt)(sample_rows * line_size);
+        strm.next_out = out;
+        strm.avail_out = (uInt)out_capacity;
+        if (deflate(&strm, Z_FINISH) == Z_STREAM_END && strm.total_out < best_size) {
+            best_size = strm.total_out;
+            best_strategy = candidates[i];
+        }
+        deflateEnd(&strm);
+    }
+
+    free(zero_row);
+    free(scratch);
+    free(filtered);
+    free(out);
+    return best_strategy;
+}
+
+bool png_writer_should_parallelize(size_t row_bytes, size_t height, int threads) {
+    if (threads <= 0) threads = parallel_cpu_count();
+    if (threads == 1 || height < 2) return false;
+    return (row_bytes + 1) * height >= 2 * PNG_WRITER_MIN_BAND_BYTES;
+}
+
+bool png_write_idat_parallel(png_structp png, const unsigned char* rows, size_t stride,
+                             size_t row_bytes, size_t bpp, size_t height,
+                             const PngWriterParams* params) {
+    if (!png || !rows || !params || height == 0 || row_bytes == 0) return false;
+
+    int threads = params->threads > 0 ? params->threads : parallel_cpu_count();
+    size_t line_size = row_bytes + 1;
+
+    // A few bands per thread keeps workers busy when bands compress unevenly;
+    // capping their size bounds memory however tall the image is
+    size_t band_rows = height / ((size_t)threads * PNG_WRITER_BANDS_PER_THREAD);
+    size_t min_rows = (PNG_WRITER_MIN_BAND_BYTES + line_size - 1) / line_size;
+    size_t max_rows = PNG_WRITER_MAX_BAND_BYTES / line_size;
+    if (band_rows > max_rows) band_rows = max_rows;
+    if (band_rows < min_rows) band_rows = min_rows;
+    if (band_rows == 0) band_rows = 1;
+
+    PngWriterJob job = {
+        .rows = rows,
+        .stride = stride,
+        .row_bytes = row_bytes,
+        .bpp = bpp,
+        .height = height,
+        .params = params,
+        .band_rows = band_rows,
+        .band_count = (height + band_rows - 1) / band_rows
+    };
+    job.zero_row = (const unsigned char*)calloc(1, row_bytes);
+    job.bands = (PngBand*)calloc(job.band_count, sizeof(PngBand));
+    if (!job.zero_row || !job.bands) {
+        free((void*)job.zero_row);
+        free(job.bands);
+        return false;
+    }
+
+    // zlib header: deflate, 32K window, level hint, no preset dictionary
+    int level = params->level < 0 ? 6 : params->level;
+    int flevel = level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3));
+    unsigned cmf = 0x78;
+    unsigned flg = (unsigned)flevel << 6;
+    flg += 31 - ((cmf * 256 + flg) % 31);
+
+    // Bands are compressed a window at a time and written out in order, so
+    // only one window's output is held however large the image is
+    size_t window = (size_t)threads * PNG_WRITER_BANDS_PER_THREAD;
+    bool ok = true;
+    uLong adler = 0;
+    for (job.first_band = 0; job.first_band < job.band_count; job.first_band += window) {
+        size_t count = job.band_count - job.first_band < window ? job.band_count - job.first_band
+                                                                : window;
+        parallel_for(count, threads, compress_band, &job);
+
+        for (size_t i = job.first_band; i < job.first_band + count; i++) {
+            PngBand* band = &job.bands[i];
+            if (!band->ok) {
+                ok = false;
+                break;
+            }
+            adler = i == 0 ? band->adler : adler32_combine(adler, band->adler, (z_off_t)band->in_size);
+        }
+        if (!ok) break;
+
+        if (job.first_band == 0) {
+            job.bands[0].out[0] = (unsigned char)cmf;
+            job.bands[0].out[1] = (unsigned char)flg;
+        }
+        if (job.first_band + count == job.band_count) {
+            PngBand* final_band = &job.bands[job.band_count - 1];
+            unsigned char* trailer = final_band->out + 2 + final_band->out_size;
+            trailer[0] = (unsigned char)(adler >> 24);
+            trailer[1] = (unsigned char)(adler >> 16);
+            trailer[2] = (unsigned char)(adler >> 8);
+            trailer[3] = (unsigned char)adler;
+            final_band->out_size += 4;
+        }
+
+        for (size_t i = job.first_band; i < job.first_band + count; i++) {
+            PngBand* band = &job.bands[i];
+            const unsigned char* chunk = i == 0 ? band->out : band->out + 2;
+            size_t chunk_size = i == 0 ? band->out_size + 2 : band->out_size;
+            png_write_chunk(png, (png_const_bytep)"IDAT", chunk, chunk_size);
+            free(band->out);
+            band->out = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < job.band_count; i++) {
+        free(job.bands[i].out);
+    }
+    free(job.bands);
+    free((void*)job.zero_row);
+    return ok;
+}
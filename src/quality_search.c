@@ -0,0 +1,232 @@
+#include "../include/quality_search.h"
+#include "../include/codec.h"
+#include "../include/image_metrics.h"
+#include "../include/image_ops.h"
+#include "../include/output_writer.h"
+#include "../include/parallel.h"
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    int quality;
+    bool valid;             // The encode (and decode, for SSIM) succeeded
+    bool met;               // The encode meets the target
+    size_t size;
+    double ssim;
+    unsigned char* data;    // Kept for full-size trials only
+} QualityTrial;
+
+// One round of trial encodes against a reference image
+typedef struct {
+    ImageFormat format;
+    const ImageData* reference;
+    ConversionOptions options;      // Encoder settings, without the target
+    QualityTargetKind kind;
+    size_t max_bytes;               // Budget for this reference
+    double min_ssim;
+    bool keep_data;
+    QualityTrial* trials;
+} TrialRound;
+
+bool quality_search_supported(ImageFormat format, const ConversionOptions* options) {
+    const Codec* codec = codec_for_format(format);
+    return options && codec && codec->has_quality && codec->has_quality(options);
+}
+
+static void run_trial(void* ctx, size_t index) {
+    TrialRound* round = (TrialRound*)ctx;
+    QualityTrial* trial = &round->trials[index];
+    ConversionOptions options = round->options;
+    options.quality = trial->quality;
+
+    MemoryOutput output;
+    if (!memory_output_open(&output)) return;
+    if (save_image(output.path, round->format, round->reference, &options)) {
+        trial->data = memory_output_read(&output, &trial->size);
+    }
+    memory_output_close(&output);
+    if (!trial->data) return;
+
+    if (round->kind == QUALITY_TARGET_SSIM) {
+        // Decode exactly what was stored; the reference is already upright
+        ConversionOptions decode_options = options;
+        decode_options.maintain_exif = false;
+        decode_options.apply_orientation = false;
+        decode_options.crop.width = 0;
+
+        ImageData* decoded = load_image_from_memory("trial encode", round->format,
+                                                    trial->data, trial->size, &decode_options);
+        if (decoded) {
+            trial->ssim = image_ssim(round->reference, decoded);
+            free_image_data(decoded);
+            free(decoded);
+        }
+        trial->valid = decoded && trial->ssim >= 0.0;
+        trial->met = trial->valid && trial->ssim >= round->min_ssim;
+    } else {
+        trial->valid = true;
+        trial->met = trial->size <= round->max_bytes;
+    }
+
+    if (!round->keep_data) {
+        free(trial->data);
+        trial->data = NULL;
+    }
+}
+
+static void adopt_trial(QualityTrial* best, QualityTrial* trial) {
+    free(best->data);
+    *best = *trial;
+    trial->data = NULL;
+}
+
+// Searches [lo, hi] for the best quality meeting the target and stores it in
+// best; false if no quality in the range does
+static bool search_range(TrialRound* round, int lo, int hi, int parallel,
+                         QualityTrial* best, QualitySearchResult* result) {
+    bool want_highest = round->kind == QUALITY_TARGET_SIZE;
+    bool found = false;
+
+    while (lo <= hi) {
+        // Split the range into count + 1 parts; small ranges are tried whole
+        int span = hi - lo + 1;
+        int count = span < parallel ? span : parallel;
+        QualityTrial trials[QUALITY_SEARCH_MAX_PARALLEL];
+        memset(trials, 0, sizeof(trials));
+        for (int i = 0; i < count; i++) {
+            trials[i].quality = span <= parallel ? lo + i : lo + (i + 1) * span / (count + 1);
+        }
+
+        round->trials = trials;
+        parallel_for((size_t)count, parallel, run_trial, round);
+        result->trials += count;
+        result->rounds++;
+
+        // Size shrinks and SSIM drops with quality, so everything past the
+        // first miss (walking away from the target) misses too
+        if (want_highest) {
+            for (int i = 0; i < count; i++) {
+                if (!trials[i].met) {
+                    hi = trials[i].quality - 1;
+                    break;
+                }
+                adopt_trial(best, &trials[i]);
+                found = true;
+                lo = trials[i].quality + 1;
+            }
+        } else {
+            for (int i = count - 1; i >= 0; i--) {
+                if (!trials[i].met) {
+                    lo = trials[i].quality + 1;
+                    break;
+                }
+                adopt_trial(best, &trials[i]);
+                found = true;
+                hi = trials[i].quality - 1;
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            free(trials[i].data);
+        }
+    }
+
+    return found;
+}
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+bool quality_search(ImageFormat format, const ImageData* img,
+                    const ConversionOptions* options, QualitySearchResult* result) {
+    if (!result) return false;
+    memset(result, 0, sizeof(*result));
+    if (!img || !img->data || !options || options->quality_target.kind == QUALITY_TARGET_NONE ||
+        !quality_search_supported(format, options)) {
+        return false;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int parallel = options->quality_target.threads > 0 ? options->quality_target.threads
+                                                       : parallel_cpu_count();
+    if (parallel > QUALITY_SEARCH_MAX_PARALLEL) parallel = QUALITY_SEARCH_MAX_PARALLEL;
+
+    TrialRound round = {
+        .format = format,
+        .options = *options,
+        .kind = options->quality_target.kind,
+        .max_bytes = options->quality_target.max_bytes,
+        .min_ssim = options->quality_target.min_ssim
+    };
+    round.options.quality_target.kind = QUALITY_TARGET_NONE;
+
+    int lo = 0;
+    int hi = 100;
+
+    // Coarse search on a proxy; its budget is scaled by area after taking
+    // out the metadata, which does not shrink with the pixels
+    size_t longest = img->width > img->height ? img->width : img->height;
+    if (longest > 2 * QUALITY_SEARCH_PROXY_SIDE) {
+        ImageData* proxy = shrink_image(img, QUALITY_SEARCH_PROXY_SIDE, false);
+        if (proxy) {
+            size_t metadata_size = 0;
+            for (int kind = 0; options->maintain_exif && kind < IMAGE_METADATA_COUNT; kind++) {
+                metadata_size += img->metadata[kind].size;
+            }
+            double scale = (double)(proxy->width * proxy->height) / (double)(img->width * img->height);
+
+            round.reference = proxy;
+            round.max_bytes = round.max_bytes > metadata_size ?
+                (size_t)((round.max_bytes - metadata_size) * scale) : 0;
+            round.keep_data = false;
+
+            QualityTrial coarse = { .quality = -1 };
+            int center = search_range(&round, 0, 100, parallel, &coarse, result) ? coarse.quality :
+                         (round.kind == QUALITY_TARGET_SIZE ? 0 : 100);
+            lo = center - QUALITY_SEARCH_REFINE_SPAN < 0 ? 0 : center - QUALITY_SEARCH_REFINE_SPAN;
+            hi = center + QUALITY_SEARCH_REFINE_SPAN > 100 ? 100 : center + QUALITY_SEARCH_REFINE_SPAN;
+
+            free_image_data(proxy);
+            free(proxy);
+        }
+    }
+
+    // Full-size search, widened whenever the answer lies outside the range
+    round.reference = img;
+    round.max_bytes = options->quality_target.max_bytes;
+    round.keep_data = true;
+
+    QualityTrial best = { .quality = -1 };
+    bool found = search_range(&round, lo, hi, parallel, &best, result);
+    if (round.kind == QUALITY_TARGET_SIZE) {
+        if (!found && lo > 0) {
+            found = search_range(&round, 0, lo - 1, parallel, &best, result);
+        } else if (found && best.quality == hi && hi < 100) {
+            search_range(&round, hi + 1, 100, parallel, &best, result);
+        }
+    } else {
+        if (!found && hi < 100) {
+            found = search_range(&round, hi + 1, 100, parallel, &best, result);
+        } else if (found && best.quality == lo && lo > 0) {
+            search_range(&round, 0, lo - 1, parallel, &best, result);
+        }
+    }
+
+    result->met = found;
+    if (found) {
+        result->quality = best.quality;
+        result->size = best.size;
+        result->ssim = best.ssim;
+        result->data = best.data;
+    } else {
+        // Closest to the target
+        result->quality = round.kind == QUALITY_TARGET_SIZE ? 0 : 100;
+    }
+    result->seconds = elapsed_seconds(&start);
+    return true;
+}
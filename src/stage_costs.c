@@ -0,0 +1,170 @@
+#include "../include/stage_costs.h"
+#include "../include/output_writer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define STAGE_COSTS_DIR "media-processor"
+#define STAGE_COSTS_FILE "stage-costs"
+#define STAGE_COSTS_MIN_PIXELS (1u << 16)   // Fewer measured pixels are mostly per-file overhead
+#define STAGE_COSTS_WEIGHT 0.5              // Share of the new measurement in a learned cost
+
+static const char* const stage_names[STAGE_COUNT] = { "decode", "encode", "transcode" };
+
+// Starting points for a first run (ns per pixel, one core of a desktop CPU)
+static const double default_costs[STAGE_COUNT][STAGE_COST_FORMATS] = {
+    [STAGE_DECODE] = {
+        [FORMAT_PNG] = 10.0, [FORMAT_JPG] = 5.0, [FORMAT_WEBP] = 10.0,
+        [FORMAT_AVIF] = 30.0, [FORMAT_HEIC] = 40.0
+    },
+    [STAGE_ENCODE] = {
+        [FORMAT_PNG] = 40.0, [FORMAT_JPG] = 15.0, [FORMAT_WEBP] = 80.0,
+        [FORMAT_AVIF] = 400.0, [FORMAT_HEIC] = 300.0
+    },
+    [STAGE_TRANSCODE] = {
+        [FORMAT_JPG] = 8.0
+    }
+};
+
+// Cost file path under $XDG_CACHE_HOME or ~/.cache; false if neither is set
+static bool stage_costs_path(char* path, size_t size, bool create_dir) {
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    char dir[PATH_MAX];
+
+    if (cache && cache[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s", cache);
+    } else if (home && home[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return false;
+    }
+
+    if (create_dir) {
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+    }
+    size_t length = strlen(dir);
+    snprintf(dir + length, sizeof(dir) - length, "/%s", STAGE_COSTS_DIR);
+    if (create_dir) {
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+    }
+
+    return snprintf(path, size, "%s/%s", dir, STAGE_COSTS_FILE) < (int)size;
+}
+
+void stage_costs_load(StageCosts* costs) {
+    memcpy(costs->ns_per_pixel, default_costs, sizeof(default_costs));
+
+    char path[PATH_MAX];
+    if (!stage_costs_path(path, sizeof(path), false)) return;
+    FILE* fp = fopen(path, "r");
+    if (!fp) return;
+
+    // One "<stage> <format> <ns per pixel>" per line
+    char line[128];
+    while (fgets(line, sizeof(line), fp)) {
+        char stage_name[16];
+        char format_name[16];
+        double value;
+        if (line[0] == '#' || sscanf(line, "%15s %15s %lf", stage_name, format_name, &value) != 3) {
+            continue;
+        }
+
+        ImageFormat format = string_to_format(format_name);
+        if (format == FORMAT_UNKNOWN || !(value > 0.0)) continue;
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            if (strcasecmp(stage_name, stage_names[stage]) == 0) {
+                costs->ns_per_pixel[stage][format] = value;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+void stage_costs_learn(StageCosts* costs, StageSamples* samples) {
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        for (int format = FORMAT_HEIC; format < STAGE_COST_FORMATS; format++) {
+            uint64_t pixels = atomic_load(&samples->pixels[stage][format]);
+            if (pixels < STAGE_COSTS_MIN_PIXELS) continue;
+
+            double measured = (double)atomic_load(&samples->ns[stage][format]) / (double)pixels;
+            double* cost = &costs->ns_per_pixel[stage][format];
+            *cost = *cost > 0.0 ? *cost + STAGE_COSTS_WEIGHT * (measured - *cost) : measured;
+        }
+    }
+}
+
+bool stage_costs_save(const StageCosts* costs) {
+    char path[PATH_MAX];
+    if (!stage_costs_path(path, sizeof(path), true)) return false;
+
+    // Replaced atomically, so concurrent batches never read half a file
+    OutputFile output;
+    if (!output_file_open(&output, path, OUTPUT_SYNC_NONE)) return false;
+    FILE* fp = fopen(output.path, "w");
+    bool written = fp != NULL;
+
+    if (fp) {
+        fprintf(fp, "# Stage costs learned by media_processor (ns per pixel)\n");
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            for (int format = FORMAT_HEIC; format < STAGE_COST_FORMATS; format++) {
+                if (costs->ns_per_pixel[stage][format] > 0.0) {
+                    fprintf(fp, "%s %s %.3f\n", stage_names[stage],
+                            format_to_string((ImageFormat)format), costs->ns_per_pixel[stage][format]);
+                }
+            }
+        }
+        written = fclose(fp) == 0;
+    }
+    return output_file_finish(&output, written);
+}
+
+void stage_samples_init(StageSamples* samples) {
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        for (int format = 0; format < STAGE_COST_FORMATS; format++) {
+            atomic_init(&samples->ns[stage][format], 0);
+            atomic_init(&samples->pixels[stage][format], 0);
+        }
+    }
+}
+
+void stage_samples_add(StageSamples* samples, ConversionStage stage, ImageFormat format,
+                       uint64_t ns, size_t pixels) {
+    if (format <= FORMAT_UNKNOWN || format >= STAGE_COST_FORMATS || pixels == 0) return;
+    atomic_fetch_add(&samples->ns[stage][format], ns);
+    atomic_fetch_add(&samples->pixels[stage][format], pixels);
+}
+
+double estimate_conversion_cost(const StageCosts* costs, ImageFormat input_format, size_t pixels,
+                                const ImageFormat* targets, size_t target_count,
+                                const ConversionOptions* options) {
+    if (input_format <= FORMAT_UNKNOWN || input_format >= STAGE_COST_FORMATS) return 0.0;
+
+    bool decode = targets == NULL || target_count == 0;
+    double per_pixel = 0.0;
+
+    if (decode) {
+        // The slowest format stands in for whichever gets picked
+        double slowest = 0.0;
+        for (int format = FORMAT_HEIC; format < STAGE_COST_FORMATS; format++) {
+            double cost = costs->ns_per_pixel[STAGE_ENCODE][format];
+            if (cost > slowest) slowest = cost;
+        }
+        per_pixel += slowest;
+    }
+    for (size_t i = 0; i < target_count && targets; i++) {
+        if (is_jpeg_transcode(input_format, targets[i], options)) {
+            per_pixel += costs->ns_per_pixel[STAGE_TRANSCODE][FORMAT_JPG];
+        } else {
+            per_pixel += costs->ns_per_pixel[STAGE_ENCODE][targets[i]];
+            decode = true;
+        }
+    }
+    if (decode) {
+        per_pixel += costs->ns_per_pixel[STAGE_DECODE][input_format];
+    }
+
+    return per_pixel * (double)pixels;
+}